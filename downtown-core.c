@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "downtown.h"
+#include "hilbert.h"
 #include "voronoi.h"
 #include "zigzag.h"
 
@@ -10,6 +11,7 @@ void downtown_init(void) {
   /* add new samplers here */
   zigzag_register();
   voronoi_register();
+  hilbert_register();
 }
 
 /* vim:ts=2:sw=2:sts=2:et:ft=c
@@ -0,0 +1,190 @@
+/* downtown-match.c */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "log.h"
+#include "sigalign.h"
+#include "sigdb.h"
+#include "sigfile.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "util.h"
+
+#define PROG      "downtown-match"
+
+static int cfg_align = 0;
+static char **cfg_input = NULL;
+static unsigned cfg_n_input = 0;
+static int cfg_jobs = 0;
+static unsigned cfg_k = 0;
+static int cfg_radius = -1;
+static unsigned cfg_step = 0;
+
+static void usage() {
+  fprintf(stderr, "Usage: " PROG " [options] <ref.sig | ref.sigdb>...\n\n"
+          "Find the nearest reference frames for each query frame.\n\n"
+          "Options:\n"
+          "  -h, --help                See this message\n"
+          "  -a, --align               Report aligned segments instead of frames\n"
+          "  -i, --input <file>        Query signatures (repeatable)\n"
+          "  -j, --jobs <n>            Worker threads (default: one per CPU)\n"
+          "  -k, --top <k>             Matches per frame (default 5, 8 to seed --align)\n"
+          "  -q, --quiet               No log output\n"
+          "  -r, --radius <bits>       Largest distance to report (default 24, 16 to seed --align)\n"
+          "  -s, --step <n>            Seed --align from every n'th query frame (default 2)\n"
+          "\n"
+         );
+  exit(1);
+}
+
+static void parse_options(int *argc, char ***argv) {
+  int ch, oidx;
+
+  static struct option opts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"align", no_argument, NULL, 'a'},
+    {"input", required_argument, NULL, 'i'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"top", required_argument, NULL, 'k'},
+    {"quiet", no_argument, NULL, 'q'},
+    {"radius", required_argument, NULL, 'r'},
+    {"step", required_argument, NULL, 's'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (ch = getopt_long(*argc, *argv, "ahi:j:k:qr:s:", opts, &oidx), ch != -1) {
+    switch (ch) {
+
+    case 'a':
+      cfg_align = 1;
+      break;
+
+    case 'i':
+      cfg_input = realloc(cfg_input, sizeof(char *) * (cfg_n_input + 1));
+      if (!cfg_input) die("Out of memory");
+      cfg_input[cfg_n_input++] = optarg;
+      break;
+
+    case 'j':
+      cfg_jobs = atoi(optarg);
+      break;
+
+    case 'k':
+      cfg_k = (unsigned) atoi(optarg);
+      break;
+
+    case 'q':
+      log_level = ERROR;
+      break;
+
+    case 'r':
+      cfg_radius = atoi(optarg);
+      break;
+
+    case 's':
+      cfg_step = (unsigned) atoi(optarg);
+      break;
+
+    case 'h':
+    default:
+      usage();
+      break;
+
+    }
+  }
+
+  *argc -= optind;
+  *argv += optind;
+}
+
+static void match_file(const sigindex *idx, const char *name, int n_jobs) {
+  sigindex_match_file(idx, name, cfg_radius >= 0 ? (unsigned) cfg_radius : 24,
+                      cfg_k ? cfg_k : 5, (unsigned) n_jobs, stdout);
+}
+
+static void align_file(const sigindex *idx, const char *name, int n_jobs) {
+  sigalign_params p;
+  uint64_t first;
+  size_t n;
+
+  sigalign_defaults(&p);
+  p.threads = (unsigned) n_jobs;
+  if (cfg_k) p.k = cfg_k;
+  if (cfg_radius >= 0) p.radius = (unsigned) cfg_radius;
+  if (cfg_step) p.step = cfg_step;
+
+  signature *query = sigfile_load(name, &n, &first);
+  size_t max_seg = n / 8 + 16;
+  sigalign_segment *seg = alloc(sizeof(sigalign_segment) * max_seg);
+
+  log_info("Aligning %llu frames from %s", (unsigned long long) n, name);
+  size_t n_seg = sigalign_find(idx, query, n, &p, seg, max_seg);
+
+  for (size_t i = 0; i < n_seg; i++) {
+    const sigalign_segment *s = &seg[i];
+    const sigindex_file *f = &idx->files[s->file];
+    printf("{\"query\":");
+    json_put_string(name, stdout);
+    printf(",\"query_start\":%llu,\"query_end\":%llu,\"file\":",
+           (unsigned long long)(first + s->q_start),
+           (unsigned long long)(first + s->q_end));
+    json_put_string(f->name, stdout);
+    printf(",\"start\":%llu,\"end\":%llu"
+           ",\"offset\":%.3f,\"rate\":%.5f,\"distance\":%.2f"
+           ",\"confidence\":%.4f,\"votes\":%u}\n",
+           (unsigned long long)(f->first_frame + s->r_start),
+           (unsigned long long)(f->first_frame + s->r_end),
+           f->first_frame + s->offset - s->rate * first, s->rate,
+           s->distance, s->confidence, s->votes);
+  }
+
+  free(seg);
+  free(query);
+}
+
+int main(int argc, char *argv[]) {
+  parse_options(&argc, &argv);
+  if (argc == 0 || cfg_n_input == 0) usage();
+
+  int n_jobs = cfg_jobs > 0 ? cfg_jobs : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_jobs < 1) n_jobs = 1;
+
+  sigindex *idx = sigindex_new();
+  sigdb **dbs = alloc(sizeof(sigdb *) * argc);
+  unsigned n_dbs = 0;
+
+  for (int i = 0; i < argc; i++) {
+    if (sigdb_is_db(argv[i])) {
+      sigindex_build(idx, n_jobs);
+      dbs[n_dbs] = sigdb_open(argv[i]);
+      sigdb_load(dbs[n_dbs++], idx);
+    }
+    else {
+      sigindex_add_file(idx, argv[i]);
+    }
+  }
+  sigindex_build(idx, n_jobs);
+
+  log_info("Indexed %llu frames from %u files",
+           (unsigned long long) sigindex_size(idx), (unsigned) idx->n_files);
+
+  for (unsigned i = 0; i < cfg_n_input; i++)
+    if (cfg_align) align_file(idx, cfg_input[i], n_jobs);
+    else match_file(idx, cfg_input[i], n_jobs);
+
+  sigindex_free(idx);
+  for (unsigned i = 0; i < n_dbs; i++)
+    sigdb_close(dbs[i]);
+  free(dbs);
+  free(cfg_input);
+
+  return 0;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,286 @@
+/* downtown-profile.c */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "log.h"
+#include "profile.h"
+#include "spectrum.h"
+#include "util.h"
+
+#define PROG      "downtown-profile"
+
+/* One downtown-sig --raw file */
+typedef struct {
+  const char *name;
+  char *spec;
+  unsigned width, height;
+  spectrum_sum *sum;
+} source;
+
+typedef struct {
+  source *src;
+  size_t n_src;
+  size_t next;
+  pthread_mutex_t mutex;
+} corpus;
+
+static int cfg_jobs = 0;
+static char *cfg_output = "-";
+static char *cfg_params = NULL;
+
+static void usage() {
+  fprintf(stderr, "Usage: " PROG " [options] <raw.dat>...\n\n"
+          "Average the spectra in downtown-sig --raw files into a profile.\n\n"
+          "Options:\n"
+          "  -h, --help                See this message\n"
+          "  -j, --jobs <n>            Worker threads (default: one per CPU)\n"
+          "  -o, --output <file>       Profile (.profile or .profbin, default stdout)\n"
+          "  -p, --params <json>       Extra profile parameters\n"
+          "  -q, --quiet               No log output\n"
+          "\n"
+         );
+  exit(1);
+}
+
+static void parse_options(int *argc, char ***argv) {
+  int ch, oidx;
+
+  static struct option opts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"output", required_argument, NULL, 'o'},
+    {"params", required_argument, NULL, 'p'},
+    {"quiet", no_argument, NULL, 'q'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (ch = getopt_long(*argc, *argv, "hj:o:p:q", opts, &oidx), ch != -1) {
+    switch (ch) {
+
+    case 'j':
+      cfg_jobs = atoi(optarg);
+      break;
+
+    case 'o':
+      cfg_output = optarg;
+      break;
+
+    case 'p':
+      cfg_params = optarg;
+      break;
+
+    case 'q':
+      log_level = ERROR;
+      break;
+
+    case 'h':
+    default:
+      usage();
+      break;
+
+    }
+  }
+
+  *argc -= optind;
+  *argv += optind;
+}
+
+static FILE *open_source(const source *s) {
+  FILE *fl = fopen(s->name, "r");
+  if (!fl) die("Can't read %s: %s", s->name, strerror(errno));
+  return fl;
+}
+
+/* The first line of a raw file describes the sampler that made it */
+static void read_header(source *s) {
+  char *line = NULL;
+  size_t size = 0;
+
+  FILE *fl = open_source(s);
+  if (getline(&line, &size, fl) < 0) die("%s is empty", s->name);
+  fclose(fl);
+
+  scope {
+    jd_var *hdr = jd_nv();
+    jd_from_json(hdr, jd_nsv(line));
+    jd_var *spec = jd_get_ks(hdr, "sampler", 0);
+    if (!spec) die("%s has no sampler header", s->name);
+    s->spec = sstrdup(jd_bytes(spec, NULL));
+    s->width = (unsigned) jd_get_int(jd_get_ks(hdr, "width", 0));
+    s->height = (unsigned) jd_get_int(jd_get_ks(hdr, "height", 0));
+  }
+
+  free(line);
+}
+
+static void read_spectra(source *s) {
+  char *line = NULL;
+  size_t size = 0;
+  size_t cap = 0;
+  double *data = NULL;
+
+  log_info("Reading %s", s->name);
+
+  FILE *fl = open_source(s);
+  while (getline(&line, &size, fl) >= 0) {
+    size_t len = spectrum_parse_raw(line, data, cap);
+    if (!len) continue;
+
+    if (!s->sum) {
+      if (len > cap) {
+        free(data);
+        data = alloc(sizeof(double) * len);
+        cap = spectrum_parse_raw(line, data, len);
+      }
+      s->sum = spectrum_sum_new(len);
+    }
+
+    if (len != s->sum->len)
+      die("%s: spectrum length changed from %u to %u",
+          s->name, (unsigned) s->sum->len, (unsigned) len);
+
+    spectrum_sum_add(s->sum, data);
+  }
+
+  if (ferror(fl)) die("Error reading %s: %s", s->name, strerror(errno));
+  fclose(fl);
+
+  if (!s->sum) die("No spectra in %s", s->name);
+
+  free(data);
+  free(line);
+}
+
+static void *worker(void *ctx) {
+  corpus *c = ctx;
+
+  for (;;) {
+    pthread_mutex_lock(&c->mutex);
+    size_t i = c->next++;
+    pthread_mutex_unlock(&c->mutex);
+    if (i >= c->n_src) break;
+    read_spectra(&c->src[i]);
+  }
+
+  return NULL;
+}
+
+static void run_workers(corpus *c, int n_jobs) {
+  pthread_t thread[n_jobs];
+
+  pthread_mutex_init(&c->mutex, NULL);
+
+  for (int i = 0; i < n_jobs; i++)
+    if (pthread_create(&thread[i], NULL, worker, c))
+      die("Can't create thread: %s", strerror(errno));
+
+  for (int i = 0; i < n_jobs; i++)
+    pthread_join(thread[i], NULL);
+
+  pthread_mutex_destroy(&c->mutex);
+}
+
+static jd_var *make_profile(jd_var *out, const source *s, const double *baseline) {
+  jd_set_hash(out, 5);
+  jd_set_int(jd_get_ks(out, "width", 1), s->width);
+  jd_set_int(jd_get_ks(out, "height", 1), s->height);
+
+  if (cfg_params) {
+    scope {
+      jd_var *parms = jd_nv();
+      jd_from_json(parms, jd_nsv(cfg_params));
+      jd_merge(out, parms, 0);
+    }
+  }
+
+  jd_set_string(jd_get_ks(out, "sampler", 1), s->spec);
+
+  jd_var *bl = jd_set_array(jd_get_ks(out, "baseline", 1), 1);
+  jd_var *slot = jd_push(jd_set_array(jd_push(bl, 1), s->sum->len), s->sum->len);
+  for (unsigned i = 0; i < s->sum->len; i++)
+    jd_set_real(&slot[i], baseline[i]);
+
+  return out;
+}
+
+static void save_profile(jd_var *config, const char *filename) {
+  const char *dot = strrchr(filename, '.');
+
+  if (dot && !strcmp(dot, ".profbin")) {
+    profile *p = profile_new(config, filename);
+    profile_save_bin(p, filename);
+    profile_free(p);
+  }
+  else if (!strcmp(filename, "-")) {
+    json_save(config, stdout);
+    printf("\n");
+  }
+  else {
+    json_save_file(config, filename);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  corpus c;
+
+  parse_options(&argc, &argv);
+  if (argc == 0) usage();
+
+  int n_jobs = cfg_jobs > 0 ? cfg_jobs : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_jobs < 1) n_jobs = 1;
+  if (n_jobs > argc) n_jobs = argc;
+
+  memset(&c, 0, sizeof(c));
+  c.n_src = argc;
+  c.src = alloc(sizeof(source) * c.n_src);
+
+  for (unsigned i = 0; i < c.n_src; i++) {
+    source *s = &c.src[i];
+    s->name = argv[i];
+    read_header(s);
+    if (strcmp(s->spec, c.src[0].spec) ||
+        s->width != c.src[0].width || s->height != c.src[0].height)
+      die("%s (%s, %ux%u) doesn't match %s (%s, %ux%u)",
+          s->name, s->spec, s->width, s->height,
+          c.src[0].name, c.src[0].spec, c.src[0].width, c.src[0].height);
+  }
+
+  log_info("Averaging %u files with %d threads", (unsigned) c.n_src, n_jobs);
+  run_workers(&c, n_jobs);
+
+  /* merge in file order so the result doesn't depend on scheduling */
+  spectrum_sum *total = spectrum_sum_new(c.src[0].sum->len);
+  for (unsigned i = 0; i < c.n_src; i++)
+    spectrum_sum_merge(total, c.src[i].sum);
+
+  log_info("Averaged %llu frames", total->count);
+
+  double *baseline = alloc(sizeof(double) * total->len);
+  spectrum_sum_mean(total, baseline);
+
+  scope {
+    source s = c.src[0];
+    s.sum = total;
+    save_profile(make_profile(jd_nv(), &s, baseline), cfg_output);
+  }
+
+  free(baseline);
+  spectrum_sum_free(total);
+  for (unsigned i = 0; i < c.n_src; i++) {
+    spectrum_sum_free(c.src[i].sum);
+    free(c.src[i].spec);
+  }
+  free(c.src);
+
+  return 0;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
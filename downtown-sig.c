@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <fftw3.h>
 
@@ -13,13 +14,19 @@
 #include "delta.h"
 #include "downtown.h"
 #include "histogram.h"
+#include "json.h"
 #include "log.h"
 #include "merge.h"
 #include "profile.h"
 #include "progress.h"
 #include "resample.h"
+#include "sad.h"
 #include "sampler.h"
 #include "scale.h"
+#include "sigfile.h"
+#include "sigindex.h"
+#include "sigwatch.h"
+#include "splitter.h"
 #include "util.h"
 #include "voronoi.h"
 #include "yuv4mpeg2.h"
@@ -31,12 +38,16 @@
 typedef struct {
   fftw_plan plan;
   sampler_context *sampler;
+  double *sam;            /* last sampler output */
   double *ibuf, *obuf;
   size_t len;
 
   double *raw_sig;;
   int rs_size;
 
+  /* range of raw_sig actually computed */
+  int bin_lo, bin_hi;
+
   double *display_sig;
   int vpos;
   int vsize;
@@ -44,26 +55,90 @@ typedef struct {
 
 } fft_context;
 
+/* --fused-check: the scaled path, run alongside a fused job */
 typedef struct {
+  fft_context fc;
+  scale_plane *scale;
+  uint8_t *frame;
+  double sq_err, sq_ref, max_err;
+  unsigned long bits, max_bits, frames;
+} fused_check;
+
+/* One profile / sampler and the streams it writes */
+typedef struct job {
+  struct job *next;
+  unsigned id;
+
+  const char *sampler;
+  const char *profile;
+  const char *size;
+  const char *output;
+  const char *raw;
+
+  unsigned width, height;
+  int fused;              /* sampler projected onto unscaled frames */
+  sampler_pyramid *pyramid; /* --pyramid: frames come from here */
+  fused_check *check;
   unsigned long frame_count;
-  y4m2_output *next;
   fft_context plane_info[Y4M2_N_PLANE];
   FILE *fh_sig;
   FILE *fh_raw;
+  int raw_header;         /* already in a resumed --raw file */
+  sigfile_writer *sw;
+  unsigned fps_num, fps_den;
+  uint64_t discard;       /* frames only needed to prime --delta */
+
+  /* --merge / --delta on sampled vectors */
+  double *acc, *prev, *out;
+  unsigned phase;
+  uint64_t seq;
+
+  /* references to watch the stream for */
+  const char **watch;
+  unsigned n_watch;
+  sigindex *watch_idx;
+  sigwatch *watcher;
 
   profile *prof;
+} job;
+
+/* All the jobs that sample frames of one size */
+typedef struct context {
+  unsigned width, height;
+  job **jobs;
+  size_t n_jobs;
+
+  /* --pyramid: sizes made by halving this one's frames */
+  sampler_pyramid *pyramid;
+  struct context **kids;
+  size_t n_kids;
+  int is_kid;
+
+  /* --skip-static: Y plane of the last frame actually sampled */
+  uint8_t *prev_y;
+  size_t prev_len;
+  unsigned long frames, reused;
 } context;
 
-static char *cfg_sampler = NULL;
 static int cfg_histogram = 0;
 static int cfg_centre = 0;
 static int cfg_delta = 0;
 static int cfg_merge = 1;
+static int cfg_pixel_domain = 0;
+static int cfg_pyramid = 0;
+static int cfg_fused = 0;
+static int cfg_fused_check = 0;
 static char *cfg_input = "-";
-static char *cfg_output = NULL;
-static char *cfg_raw = NULL;
-static char *cfg_profile = NULL;
 static char *cfg_size = NULL;
+static char *cfg_output_format = "text";
+static int cfg_resume = 0;
+static double cfg_skip_static = -1;
+
+static int sample_domain = 0;
+
+static job *jobs = NULL;
+static job **jobs_tail = &jobs;
+static job *cur_job = NULL;
 
 static void usage() {
   fprintf(stderr, "Usage: " PROG " [options] < <in.y4m2> > <out.y4m2>\n\n"
@@ -73,13 +148,57 @@ static void usage() {
           "  -d, --delta               Work on diff between frames\n"
           "  -H, --histogram           Histogram equalisation\n"
           "  -i, --input <file.yuv>    Input file (default stdin)\n"
+          "  -k, --cache <dir>         Cache sampler maps in <dir>\n"
+          "                            (default $DOWNTOWN_CACHE, \"\" for none)\n"
           "  -M, --merge <n>           Merge every <n> input frames\n"
           "  -o, --output <file>       signature output file\n"
-          "  -p, --profile <file.json> Use profile\n"
+          "  -f, --output-format <fmt> text (default), hex, bin or rle\n"
+          "  -F, --fused               Sample profile jobs' frames unscaled\n"
+          "  -C, --fused-check         --fused, reporting its error against scaling\n"
+          "  -P, --pixel-domain        Merge and delta whole frames, as before\n"
+          "  -Y, --pyramid             Make sizes that halve the largest by box filtering\n"
+          "  -p, --profile <file>      Use profile (.profile or .profbin)\n"
           "  -q, --quiet               No log output\n"
           "  -r, --raw <file>          raw FFT output file\n"
-          "  -s, --size <w>x<h>        Scale frames\n"
+          "  -R, --resume              Continue interrupted --output / --raw files\n"
+          "  -s, --size <w>x<h>        Scale frames for following jobs\n"
+          "  -U, --skip-static[=<mad>] Reuse the last spectrum while the Y plane's\n"
+          "                            mean absolute difference from it is <= mad\n"
+          "                            (default 0: only identical frames)\n"
           "  -S, --sampler <algo>      Select sampler algorithm\n"
+          "  -w, --watch <ref.sig>     Report when the job sees a reference\n"
+          "\n"
+          "Each --profile or --sampler starts a new job. --output, --raw and\n"
+          "--watch apply to the most recent job, --size to the jobs after it.\n"
+          "All jobs share one decode and one scale per distinct frame size.\n"
+          "\n"
+          "--resume finds the last frame every output file has complete,\n"
+          "drops anything after it and carries on from the next input frame.\n"
+          "The results match an uninterrupted run, so it can't be used with\n"
+          "a --skip-static threshold above 0.\n"
+          "\n"
+          "When every job's sampler is linear and neither --histogram nor\n"
+          "--centre is used, --merge and --delta work on the sampled vectors,\n"
+          "which is much cheaper than filtering every pixel. The vectors are\n"
+          "the same but for rounding and the clipping of large pixel\n"
+          "differences, with two exceptions: a partial --merge at the end\n"
+          "averages the frames it has where the pixel filter counts the\n"
+          "missing ones as black, and output frames are numbered by the\n"
+          "input frame they start at divided by --merge where the pixel\n"
+          "filters number every frame 0. --pixel-domain keeps the old\n"
+          "behaviour for exact compatibility.\n"
+          "\n"
+          "--fused projects a profile's sampler onto the input resolution so\n"
+          "each region averages the source pixels it covers. That saves the\n"
+          "scaling pass; it applies to samplers that can be projected.\n"
+          "\n"
+          "--pyramid scales frames once, to the largest job size, and makes\n"
+          "any job sizes that are it halved one or more times by averaging 2x2\n"
+          "blocks. That's much cheaper than scaling to each size but isn't\n"
+          "bicubic, so those signatures differ from the default ones.\n"
+          "\n"
+          "--watch may be repeated. Matches against the references start and\n"
+          "stop are written to stdout as JSON lines as soon as they're seen.\n"
           "\n"
          );
   exit(1);
@@ -96,10 +215,58 @@ static void free_fft_context(fft_context *c) {
   }
 }
 
-static void free_context(context *c) {
-  profile_free(c->prof);
+static void free_check(job *j) {
+  fused_check *fk = j->check;
+
+  if (fk->frames) {
+    log_info("Job %u: fused sampling vs scaled over %lu frames:", j->id, fk->frames);
+    log_info("  rms error %.5f (%.3f%% of rms sample), max %.5f",
+             sqrt(fk->sq_err / fk->frames / fk->fc.len),
+             fk->sq_ref ? 100 * sqrt(fk->sq_err / fk->sq_ref) : 0, fk->max_err);
+    log_info("  signatures differ by %.2f bits on average, %lu at most",
+             (double) fk->bits / fk->frames, fk->max_bits);
+  }
+
+  sampler_free(fk->fc.sampler);
+  free_fft_context(&fk->fc);
+  scale_plane_free(fk->scale);
+  free(fk->frame);
+  free(fk);
+  j->check = NULL;
+}
+
+static void free_job(job *j) {
+  if (j->check) free_check(j);
+  sigfile_writer_free(j->sw);
+  j->sw = NULL;
+  sigwatch_free(j->watcher);
+  j->watcher = NULL;
+  sigindex_free(j->watch_idx);
+  j->watch_idx = NULL;
+  profile_free(j->prof);
+  j->prof = NULL;
+  free(j->acc);
+  free(j->prev);
+  free(j->out);
+  j->acc = j->prev = j->out = NULL;
   for (int pl = 0; pl < Y4M2_N_PLANE; pl++) {
-    free_fft_context(&c->plane_info[pl]);
+    free_fft_context(&j->plane_info[pl]);
+  }
+}
+
+static void free_context(context *c) {
+  if (c) {
+    if (cfg_skip_static >= 0)
+      log_info("Reused the previous spectrum for %lu of %lu frames", c->reused, c->frames);
+    free(c->prev_y);
+    for (unsigned i = 0; i < c->n_jobs; i++)
+      free_job(c->jobs[i]);
+    free(c->jobs);
+    for (unsigned i = 0; i < c->n_kids; i++)
+      free_context(c->kids[i]);
+    free(c->kids);
+    sampler_pyramid_free(c->pyramid);
+    free(c);
   }
 }
 
@@ -109,10 +276,15 @@ static void process_fft(fft_context *c) {
   if (!c->raw_sig) {
     c->rs_size = size;
     c->raw_sig = fftw_malloc(sizeof(double) * c->rs_size);
+    if (!c->raw_sig) die("Out of memory");
+    memset(c->raw_sig, 0, sizeof(double) * c->rs_size);
+    if (c->bin_hi == 0 || c->bin_hi > size) c->bin_hi = size;
+    if (c->bin_lo > c->bin_hi) c->bin_lo = c->bin_hi;
   }
 
-  double *out = c->raw_sig;
-  for (int i = 1; i <= size; i++) {
+  /* bins outside [bin_lo, bin_hi) are never looked at */
+  double *out = c->raw_sig + c->bin_lo;
+  for (int i = c->bin_lo + 1; i <= c->bin_hi; i++) {
     double sr = c->obuf[i];
     double si = c->obuf[c->len - i];
     *out++ = sqrt(sr * sr + si * si);
@@ -136,6 +308,14 @@ oom:
   die("Out of memory");
 }
 
+static void spectrum(fft_context *fc, const double *sam) {
+  if (!fc->plan) init_fft_context(fc);
+
+  memcpy(fc->ibuf, sam, sizeof(double) * fc->len);
+  fftw_execute(fc->plan);
+  process_fft(fc);
+}
+
 static jd_var *jd_doubles(jd_var *out, const double *in, size_t len) {
   jd_var *slot = jd_push(jd_set_array(out, len), len);
   for (unsigned i = 0; i < len; i++)
@@ -143,7 +323,7 @@ static jd_var *jd_doubles(jd_var *out, const double *in, size_t len) {
   return out;
 }
 
-static void write_raw_header(context *c, FILE *fl) {
+static void write_raw_header(job *c, FILE *fl) {
   scope {
     fft_context *fc = &c->plane_info[Y4M2_Y_PLANE];
     sampler_context *sam = fc->sampler;
@@ -158,69 +338,276 @@ static void write_raw_header(context *c, FILE *fl) {
 
 }
 
-static void write_raw(context *c, FILE *fl, const y4m2_frame *frame) {
+static void write_raw(job *c, FILE *fl, uint64_t seq) {
   scope {
     fft_context *fc = &c->plane_info[Y4M2_Y_PLANE];
 
     jd_var *rec = jd_nhv(4);
-    jd_set_int(jd_get_ks(rec, "frame", 1), frame->sequence);
+    jd_set_int(jd_get_ks(rec, "frame", 1), seq);
     jd_var *pln = jd_set_array(jd_get_ks(rec, "planes", 1), 1);
     jd_doubles(jd_push(pln, 1), fc->raw_sig, fc->rs_size);
     jd_fprintf(fl, "%J\n", rec);
   }
 }
 
-static void write_sig(context *c, FILE *fl, const y4m2_frame *frame) {
+static void write_sig(job *c, FILE *fl, uint64_t seq) {
   if (!c->prof) die("Can't write a signature without a profile");
   fft_context *fc = &c->plane_info[Y4M2_Y_PLANE];
-  char sig[profile_SIGNATURE_BITS + 1];
-  profile_signature(c->prof, sig, fc->raw_sig, fc->rs_size);
-  fprintf(fl, "%14llu %s\n", (unsigned long long) frame->sequence, sig);
+
+  if (!strcmp(cfg_output_format, "text")) {
+    char sig[profile_SIGNATURE_BITS + 1];
+    profile_signature(c->prof, sig, fc->raw_sig, fc->rs_size);
+    fprintf(fl, "%14llu %s\n", (unsigned long long) seq, sig);
+    return;
+  }
+
+  signature sig;
+  profile_signature_bits(c->prof, &sig, fc->raw_sig, fc->rs_size);
+
+  if (!strcmp(cfg_output_format, "hex")) {
+    char hex[signature_LEN_HEX + 1];
+    signature_format_hex(&sig, hex, sizeof(hex));
+    fprintf(fl, "%14llu %s\n", (unsigned long long) seq, hex);
+    return;
+  }
+
+  if (!c->sw)
+    c->sw = sigfile_writer_new(fl, profile_hash(c->prof), c->fps_num, c->fps_den,
+                               strcmp(cfg_output_format, "rle") ? 0 : sigfile_RLE);
+  sigfile_write(c->sw, seq, &sig);
+}
+
+static void watch_event(const sigwatch_event *ev, void *ctx) {
+  job *c = ctx;
+  const sigindex_file *f = &c->watch_idx->files[ev->file];
+
+  printf("{\"event\":\"%s\",\"job\":%u,\"frame\":%llu,\"file\":",
+         ev->type == sigwatch_START ? "start" : "stop", c->id,
+         (unsigned long long) ev->frame);
+  json_put_string(f->name, stdout);
+  printf(",\"ref_frame\":%llu,\"at\":%llu,\"frames\":%llu,\"distance\":%.2f}\n",
+         (unsigned long long)(f->first_frame + ev->ref_frame),
+         (unsigned long long) ev->at, (unsigned long long) ev->frames,
+         ev->distance);
+  fflush(stdout);
 }
 
-static void create_sampler(context *c, fft_context *fc, int w, int h) {
+static void watch_sig(job *c, uint64_t seq) {
+  fft_context *fc = &c->plane_info[Y4M2_Y_PLANE];
+  signature sig;
+
+  profile_signature_bits(c->prof, &sig, fc->raw_sig, fc->rs_size);
+  sigwatch_push(c->watcher, seq, &sig);
+}
+
+static void create_sampler(job *c, fft_context *fc, int w, int h) {
   if (c->prof) {
     fc->sampler = profile_sampler(c->prof, &fc->len);
+    if (c->fused) sampler_project(fc->sampler, w, h);
+    /* raw output needs the whole spectrum */
+    if (!c->fh_raw) {
+      size_t lo, hi;
+      profile_bins(c->prof, &lo, &hi);
+      fc->bin_lo = (int) lo;
+      fc->bin_hi = (int) hi;
+      if (lo != 0 || hi != c->prof->len)
+        log_info("Computing spectrum bins [%d, %d)", fc->bin_lo, fc->bin_hi);
+    }
     return;
   }
 
-  const char *spec = cfg_sampler ? cfg_sampler : SAMPLER;
-  log_info("Creating sampler %s", spec);
+  const char *spec = c->sampler ? c->sampler : SAMPLER;
+  log_info("Job %u: creating sampler %s", c->id, spec);
   fc->sampler = sampler_new(spec, "sampler");
   fc->len = sampler_init(fc->sampler, w, h);
 }
 
-static void process_frame(context *c, const y4m2_frame *frame) {
-  int pl;
+/* Sample frame the way the scaled path would and compare with sam, the
+ * fused job's sample of it.
+ */
+static void check_fused(job *c, const y4m2_frame *frame, const double *sam) {
+  fused_check *fk = c->check;
+  fft_context *fc = &c->plane_info[Y4M2_Y_PLANE];
+  fft_context *kc = &fk->fc;
+  signature fused, scaled;
 
-  for (pl = Y4M2_Y_PLANE; pl == Y4M2_Y_PLANE; pl++) {
-    fft_context *fc = &c->plane_info[pl];
+  if (!kc->sampler) {
+    unsigned w, h;
+    profile_frame_size(c->prof, &w, &h);
+    kc->sampler = sampler_new(c->prof->spec, c->prof->filename);
+    kc->len = sampler_init(kc->sampler, w, h);
+    kc->bin_lo = fc->bin_lo;
+    kc->bin_hi = fc->bin_hi;
+    fk->scale = scale_plane_new(frame->i.width, frame->i.height, w, h);
+    fk->frame = alloc_no_clear(w * h);
+  }
 
-    int w = frame->i.width / frame->i.plane[pl].xs;
-    int h = frame->i.height / frame->i.plane[pl].ys;
+  scale_plane_run(fk->scale, fk->frame, frame->plane[Y4M2_Y_PLANE],
+                  frame->i.plane[Y4M2_Y_PLANE].stride);
+  const double *ref = sampler_sample(kc->sampler, fk->frame);
+
+  for (size_t i = 0; i < kc->len; i++) {
+    double err = fabs(sam[i] - ref[i]);
+    fk->sq_err += err * err;
+    fk->sq_ref += ref[i] * ref[i];
+    fk->max_err = MAX(fk->max_err, err);
+  }
+
+  spectrum(kc, sam);
+  profile_signature_bits(c->prof, &fused, kc->raw_sig, kc->rs_size);
+  spectrum(kc, ref);
+  profile_signature_bits(c->prof, &scaled, kc->raw_sig, kc->rs_size);
+
+  unsigned bits = signature_distance(&fused, &scaled);
+  fk->bits += bits;
+  fk->max_bits = MAX(fk->max_bits, bits);
+  fk->frames++;
+}
+
+/* --merge and --delta on the output of a linear sampler: the sample of
+ * an average or difference of frames is the average or difference of
+ * their samples. sam is NULL at the end of the stream to flush a partly
+ * filled merge, which is averaged over the frames it has; the pixel
+ * filter treats the missing frames as black instead. Returns the vector
+ * to transform, or NULL while a merge is still filling, and sets *seqp
+ * to the output frame number.
+ */
+static const double *temporal_sample(job *c, const double *sam, size_t len,
+                                     uint64_t *seqp) {
+  if (cfg_merge > 1) {
+    if (!c->acc) c->acc = alloc(sizeof(double) * len);
+    if (sam) {
+      if (c->phase == 0) c->seq = *seqp / cfg_merge;
+      for (size_t i = 0; i < len; i++)
+        c->acc[i] += sam[i];
+      if (++c->phase < (unsigned) cfg_merge) return NULL;
+    }
+    else if (!c->phase) return NULL;
+
+    if (!c->out) c->out = alloc_no_clear(sizeof(double) * len);
+    for (size_t i = 0; i < len; i++) {
+      c->out[i] = c->acc[i] / c->phase;
+      c->acc[i] = 0;
+    }
+    c->phase = 0;
+    *seqp = c->seq;
+    sam = c->out;
+  }
+  else if (!sam) return NULL;
+
+  if (cfg_delta) {
+    if (!c->out) c->out = alloc_no_clear(sizeof(double) * len);
+    if (!c->prev) {
+      c->prev = alloc_no_clear(sizeof(double) * len);
+      memcpy(c->prev, sam, sizeof(double) * len);
+    }
+    for (size_t i = 0; i < len; i++) {
+      double v = sam[i];
+      c->out[i] = v - c->prev[i];
+      c->prev[i] = v;
+    }
+    sam = c->out;
+  }
+
+  return sam;
+}
+
+/* frame is NULL to flush the sampler domain filters at the end */
+static void process_frame(job *c, const y4m2_frame *frame, int reuse) {
+  fft_context *fc = &c->plane_info[Y4M2_Y_PLANE];
+  const double *sam = NULL;
+  uint64_t seq = 0;
+
+  if (frame) {
+    seq = frame->sequence;
 
     /* TODO - make profile sampler if available */
     if (!fc->sampler) {
+      int w = frame->i.width / frame->i.plane[Y4M2_Y_PLANE].xs;
+      int h = frame->i.height / frame->i.plane[Y4M2_Y_PLANE].ys;
+      if (c->pyramid) {
+        w = c->width;
+        h = c->height;
+      }
       create_sampler(c, fc, w, h);
-      if (pl == Y4M2_Y_PLANE && c->fh_raw)
+      if (c->pyramid) sampler_pyramid_attach(c->pyramid, fc->sampler);
+      if (c->fh_raw && !c->raw_header)
         write_raw_header(c, c->fh_raw);
     }
 
-    double *sam = sampler_sample(fc->sampler, frame->plane[pl]);
+    if (!reuse) {
+      fc->sam = c->pyramid
+                ? sampler_pyramid_sample(c->pyramid, fc->sampler)
+                : sampler_sample_stride(fc->sampler, frame->plane[Y4M2_Y_PLANE],
+                                        frame->i.plane[Y4M2_Y_PLANE].stride);
+      if (c->check) check_fused(c, frame, fc->sam);
+    }
+    sam = fc->sam;
+  }
 
-    if (!fc->plan) init_fft_context(fc);
+  if (sample_domain) {
+    /* merged or differenced vectors are new even if the frame wasn't */
+    if (!fc->sampler || !(sam = temporal_sample(c, sam, fc->len, &seq))) return;
+    reuse = 0;
+  }
 
-    memcpy(fc->ibuf, sam, fc->len);
-    fftw_execute(fc->plan);
-    process_fft(fc);
+  if (!reuse) spectrum(fc, sam);
+
+  if (c->discard) {
+    c->discard--;
+    return;
   }
 
-  if (c->fh_sig) write_sig(c, c->fh_sig, frame);
-  if (c->fh_raw) write_raw(c, c->fh_raw, frame);
+  if (c->fh_sig) write_sig(c, c->fh_sig, seq);
+  if (c->fh_raw) write_raw(c, c->fh_raw, seq);
+  if (c->watcher) watch_sig(c, seq);
 
   c->frame_count++;
 }
 
+/* Is frame close enough to the last one sampled to reuse its spectrum?
+ * Frames are compared with the last one actually sampled, not the last
+ * one seen, so a slow fade can't creep past the threshold.
+ */
+static int is_static(context *c, const y4m2_frame *frame) {
+  if (cfg_skip_static < 0) return 0;
+
+  const uint8_t *y = frame->plane[Y4M2_Y_PLANE];
+  size_t len = frame->i.plane[Y4M2_Y_PLANE].size;
+
+  if (c->prev_y && c->prev_len == len &&
+      sad_u8(c->prev_y, y, len) <= cfg_skip_static * len)
+    return 1;
+
+  if (c->prev_len != len) {
+    free(c->prev_y);
+    c->prev_y = alloc_no_clear(len);
+    c->prev_len = len;
+  }
+  memcpy(c->prev_y, y, len);
+  return 0;
+}
+
+static void parse_fps(const char *fps, unsigned *nump, unsigned *denp) {
+  unsigned num, den;
+  if (fps && sscanf(fps, "%u:%u", &num, &den) == 2) {
+    *nump = num;
+    *denp = den;
+  }
+}
+
+/* frame is NULL to flush at the end. The jobs of a --pyramid kid
+ * sample their level of the pyramid made from frame.
+ */
+static void process_context(context *c, const y4m2_frame *frame, int reuse) {
+  if (frame) {
+    c->frames++;
+    c->reused += reuse;
+  }
+  for (unsigned i = 0; i < c->n_jobs; i++)
+    process_frame(c->jobs[i], frame, reuse);
+}
+
 static void callback(y4m2_reason reason,
                      const y4m2_parameters *parms,
                      y4m2_frame *frame,
@@ -230,16 +617,32 @@ static void callback(y4m2_reason reason,
   switch (reason) {
 
   case Y4M2_START:
-    y4m2_emit_start(c->next, parms);
+    for (unsigned k = 0; k <= c->n_kids; k++) {
+      context *kc = k ? c->kids[k - 1] : c;
+      for (unsigned i = 0; i < kc->n_jobs; i++)
+        parse_fps(y4m2_get_parm(parms, "F"), &kc->jobs[i]->fps_num, &kc->jobs[i]->fps_den);
+    }
     break;
 
   case Y4M2_FRAME:
-    process_frame(c, frame);
-    y4m2_emit_frame(c->next, parms, frame);
+    {
+      int reuse = is_static(c, frame);
+      if (c->pyramid)
+        sampler_pyramid_frame(c->pyramid, frame->plane[Y4M2_Y_PLANE],
+                              frame->i.plane[Y4M2_Y_PLANE].stride);
+      process_context(c, frame, reuse);
+      for (unsigned i = 0; i < c->n_kids; i++)
+        process_context(c->kids[i], frame, reuse);
+    }
+    y4m2_release_frame(frame);
     break;
 
   case Y4M2_END:
-    y4m2_emit_end(c->next);
+    if (sample_domain) {
+      process_context(c, NULL, 0);
+      for (unsigned i = 0; i < c->n_kids; i++)
+        process_context(c->kids[i], NULL, 0);
+    }
     free_context(c);
     break;
   }
@@ -273,6 +676,27 @@ static double parse_double(const char *num) {
   return v;
 }
 
+static job *new_job(void) {
+  job *j = alloc(sizeof(job));
+  j->size = cfg_size;
+  *jobs_tail = j;
+  jobs_tail = &j->next;
+  return cur_job = j;
+}
+
+/* A --profile or --sampler opens a new job unless the current one is
+ * still waiting for one.
+ */
+static job *spec_job(void) {
+  if (!cur_job || cur_job->profile || cur_job->sampler)
+    return new_job();
+  return cur_job;
+}
+
+static job *output_job(void) {
+  return cur_job ? cur_job : new_job();
+}
+
 static void parse_options(int *argc, char ***argv) {
   int ch, oidx;
 
@@ -282,18 +706,27 @@ static void parse_options(int *argc, char ***argv) {
     {"center", no_argument, NULL, 'c'},
     {"delta", no_argument, NULL, 'd'},
     {"input", required_argument, NULL, 'i'},
+    {"cache", required_argument, NULL, 'k'},
     {"histogram", no_argument, NULL, 'H'},
     {"merge", required_argument, NULL, 'M'},
     {"profile", required_argument, NULL, 'p'},
     {"output", required_argument, NULL, 'o'},
+    {"output-format", required_argument, NULL, 'f'},
+    {"fused", no_argument, NULL, 'F'},
+    {"fused-check", no_argument, NULL, 'C'},
+    {"pixel-domain", no_argument, NULL, 'P'},
+    {"pyramid", no_argument, NULL, 'Y'},
     {"quiet", no_argument, NULL, 'q'},
     {"raw", required_argument, NULL, 'r'},
+    {"resume", no_argument, NULL, 'R'},
     {"sampler", required_argument, NULL, 'S'},
     {"size", required_argument, NULL, 's'},
+    {"skip-static", optional_argument, NULL, 'U'},
+    {"watch", required_argument, NULL, 'w'},
     {NULL, 0, NULL, 0}
   };
 
-  while (ch = getopt_long(*argc, *argv, "S:s:M:i:o:r:cdhHq", opts, &oidx), ch != -1) {
+  while (ch = getopt_long(*argc, *argv, "S:s:M:i:k:o:f:p:r:w:CcdFhHPqRU::Y", opts, &oidx), ch != -1) {
     switch (ch) {
 
     case 'c':
@@ -304,6 +737,21 @@ static void parse_options(int *argc, char ***argv) {
       cfg_delta = 1;
       break;
 
+    case 'C':
+      cfg_fused_check = 1;
+      break;
+
+    case 'F':
+      cfg_fused = 1;
+      break;
+
+    case 'f':
+      if (strcmp(optarg, "text") && strcmp(optarg, "hex") &&
+          strcmp(optarg, "bin") && strcmp(optarg, "rle"))
+        die("Unknown output format: %s", optarg);
+      cfg_output_format = optarg;
+      break;
+
     case 'H':
       cfg_histogram = 1;
       break;
@@ -312,16 +760,29 @@ static void parse_options(int *argc, char ***argv) {
       cfg_input = optarg;
       break;
 
+    case 'k':
+      sampler_set_cache(optarg);
+      break;
+
     case 'M':
       cfg_merge = (int) parse_double(optarg);
       break;
 
     case 'o':
-      cfg_output = optarg;
+      if (output_job()->output) die("Job already has an --output");
+      cur_job->output = optarg;
+      break;
+
+    case 'P':
+      cfg_pixel_domain = 1;
+      break;
+
+    case 'Y':
+      cfg_pyramid = 1;
       break;
 
     case 'p':
-      cfg_profile = optarg;
+      spec_job()->profile = optarg;
       break;
 
     case 'q':
@@ -329,17 +790,34 @@ static void parse_options(int *argc, char ***argv) {
       break;
 
     case 'r':
-      cfg_raw = optarg;
+      if (output_job()->raw) die("Job already has a --raw");
+      cur_job->raw = optarg;
+      break;
+
+    case 'R':
+      cfg_resume = 1;
       break;
 
     case 'S':
-      cfg_sampler = optarg;
+      spec_job()->sampler = optarg;
       break;
 
     case 's':
       cfg_size = optarg;
       break;
 
+    case 'U':
+      cfg_skip_static = optarg ? parse_double(optarg) : 0;
+      if (cfg_skip_static < 0) die("--skip-static threshold can't be negative");
+      break;
+
+    case 'w':
+      output_job();
+      cur_job->watch = realloc(cur_job->watch, sizeof(char *) * (cur_job->n_watch + 1));
+      if (!cur_job->watch) die("Out of memory");
+      cur_job->watch[cur_job->n_watch++] = optarg;
+      break;
+
     case 'h':
     default:
       usage();
@@ -350,12 +828,26 @@ static void parse_options(int *argc, char ***argv) {
 
   *argc -= optind;
   *argv += optind;
+
+  /* the spectrum a static run reuses isn't in the output to resume from */
+  if (cfg_resume && cfg_skip_static > 0)
+    die("Can't --resume with a --skip-static threshold above 0");
+
+  if (!jobs) new_job();
+
+  /* a trailing --size applies to any jobs that didn't get one */
+  for (job *j = jobs; j; j = j->next)
+    if (!j->size) j->size = cfg_size;
 }
 
 static FILE *openout(const char *filename) {
   if (!filename) return NULL;
-  if (!strcmp(filename, "-")) return stdout;
-  FILE *fl = fopen(filename, "w");
+  if (!strcmp(filename, "-")) {
+    if (cfg_resume) die("Can't resume output to stdout");
+    return stdout;
+  }
+  FILE *fl = cfg_resume ? fopen(filename, "r+") : NULL;
+  if (!fl) fl = fopen(filename, cfg_resume ? "w+" : "w");
   if (!fl) die("Can't write %s: %s", filename, strerror(errno));
   return fl;
 }
@@ -372,8 +864,184 @@ static void closeio(FILE *fl) {
   if (fl && fl != stdin && fl != stdout && fl != stderr) fclose(fl);
 }
 
+static void setup_job(job *j) {
+  if (j->profile) {
+    log_info("Job %u: loading profile %s", j->id, j->profile);
+    j->prof = profile_load(j->profile);
+    profile_frame_size(j->prof, &j->width, &j->height);
+  }
+  else if (j->size) {
+    parse_size(j->size, &j->width, &j->height);
+  }
+
+  if (j->prof && (cfg_fused || cfg_fused_check)) {
+    if (sampler_can_project(profile_sampler(j->prof, NULL))) {
+      /* sample frames at whatever size they arrive */
+      j->fused = 1;
+      j->width = j->height = 0;
+      if (cfg_fused_check) j->check = alloc(sizeof(fused_check));
+    }
+    else {
+      log_warning("Job %u: sampler %s can't be fused", j->id, j->prof->spec);
+    }
+  }
+
+  if ((j->output || j->n_watch) && !j->prof)
+    die("Can't write a signature without a profile");
+
+  j->fh_sig = openout(j->output);
+  j->fh_raw = openout(j->raw);
+
+  if (j->n_watch) {
+    j->watch_idx = sigindex_new();
+    for (unsigned i = 0; i < j->n_watch; i++)
+      sigindex_add_file(j->watch_idx, j->watch[i]);
+    sigindex_build(j->watch_idx, 1);
+    log_info("Job %u: watching for %llu frames from %u files", j->id,
+             (unsigned long long) sigindex_size(j->watch_idx), j->n_watch);
+    j->watcher = sigwatch_new(j->watch_idx, NULL, watch_event, j);
+  }
+}
+
+/* Resuming */
+
+/* Offset just past the first n complete lines of fl, or all of them;
+ * the number found goes in *linesp.
+ */
+static off_t line_offset(FILE *fl, uint64_t n, uint64_t *linesp) {
+  off_t pos = 0, end = 0;
+  uint64_t lines = 0;
+  int ch;
+
+  rewind(fl);
+  while (lines < n && (ch = getc(fl)) != EOF) {
+    pos++;
+    if (ch == '\n') {
+      lines++;
+      end = pos;
+    }
+  }
+
+  *linesp = lines;
+  return end;
+}
+
+static void truncate_at(FILE *fl, off_t off) {
+  fflush(fl);
+  if (ftruncate(fileno(fl), off)) die("Can't truncate output: %s", strerror(errno));
+  if (fseeko(fl, off, SEEK_SET)) die("Seek failed: %s", strerror(errno));
+}
+
+static int text_output(void) {
+  return !strcmp(cfg_output_format, "text") || !strcmp(cfg_output_format, "hex");
+}
+
+/* Frames complete in every output */
+static uint64_t resume_point(void) {
+  uint64_t done = UINT64_MAX, n;
+
+  if (!strcmp(cfg_output_format, "rle")) die("Can't resume RLE output");
+
+  for (job *j = jobs; j; j = j->next) {
+    if (j->fh_sig) {
+      if (text_output()) line_offset(j->fh_sig, UINT64_MAX, &n);
+      else n = sigfile_resumable(j->fh_sig, profile_hash(j->prof));
+      done = MIN(done, n);
+    }
+    if (j->fh_raw) {
+      /* first line is the header */
+      line_offset(j->fh_raw, UINT64_MAX, &n);
+      done = MIN(done, n ? n - 1 : 0);
+    }
+  }
+
+  return done == UINT64_MAX ? 0 : done;
+}
+
+static void resume_job(job *j, uint64_t done) {
+  uint64_t n;
+
+  if (j->fh_sig) {
+    if (text_output()) truncate_at(j->fh_sig, line_offset(j->fh_sig, done, &n));
+    else if (sigfile_resumable(j->fh_sig, profile_hash(j->prof)) || done)
+      j->sw = sigfile_writer_resume(j->fh_sig, done);
+    else truncate_at(j->fh_sig, 0);
+  }
+
+  if (j->fh_raw) {
+    off_t end = line_offset(j->fh_raw, done + 1, &n);
+    j->raw_header = n > 0;
+    truncate_at(j->fh_raw, end);
+  }
+}
+
+/* Can --merge and --delta move after sampling? */
+static int use_sample_domain(void) {
+  if (cfg_merge <= 1 && !cfg_delta) return 0;
+  if (cfg_pixel_domain || cfg_histogram || cfg_centre) return 0;
+
+  for (job *j = jobs; j; j = j->next) {
+    const char *spec = j->prof ? j->prof->spec : j->sampler ? j->sampler : SAMPLER;
+    if (!spec || !sampler_is_linear(spec)) return 0;
+  }
+
+  return 1;
+}
+
+static context *find_context(context **ctxs, size_t n_ctx, const job *j) {
+  for (unsigned i = 0; i < n_ctx; i++)
+    if (ctxs[i]->width == j->width && ctxs[i]->height == j->height)
+      return ctxs[i];
+  return NULL;
+}
+
+/* --pyramid: hang every size that halves the largest off it */
+static void build_pyramid(context **ctxs, size_t n_ctx) {
+  context *base = NULL;
+
+  for (unsigned i = 0; i < n_ctx; i++) {
+    context *c = ctxs[i];
+    if (c->width && c->height &&
+        (!base || (uint64_t) c->width * c->height > (uint64_t) base->width * base->height))
+      base = c;
+  }
+  if (!base) return;
+
+  sampler_pyramid *py = sampler_pyramid_new(base->width, base->height);
+
+  for (unsigned i = 0; i < n_ctx; i++) {
+    context *c = ctxs[i];
+    if (c == base || !c->width || !c->height) continue;
+    int level = sampler_pyramid_find(py, c->width, c->height);
+    if (level <= 0) continue;
+
+    log_info("Making %ux%u frames by halving %ux%u %d time%s", c->width, c->height,
+             base->width, base->height, level, level == 1 ? "" : "s");
+    c->is_kid = 1;
+    for (unsigned j = 0; j < c->n_jobs; j++)
+      c->jobs[j]->pyramid = py;
+    base->kids = realloc(base->kids, sizeof(context *) * (base->n_kids + 1));
+    if (!base->kids) die("Out of memory");
+    base->kids[base->n_kids++] = c;
+  }
+
+  if (base->n_kids) base->pyramid = py;
+  else sampler_pyramid_free(py);
+}
+
+/* The pixel filters run on each context's scaled frames, as they did
+ * when there was only one size.
+ */
+static y4m2_output *pixel_filters(y4m2_output *out) {
+  if (cfg_centre) out = centre_filter(out);
+  if (cfg_delta && !sample_domain) out = delta_filter(out);
+  if (cfg_histogram) out = histogram_filter(out);
+  if (cfg_merge > 1 && !sample_domain) out = merge_filter(out, cfg_merge);
+  return out;
+}
+
 int main(int argc, char *argv[]) {
-  context ctx;
+  unsigned n_job = 0;
 
   downtown_init();
 
@@ -382,45 +1050,79 @@ int main(int argc, char *argv[]) {
 
   log_info("Starting " PROG);
 
-  memset(&ctx, 0, sizeof(ctx));
+  for (job *j = jobs; j; j = j->next) {
+    j->id = n_job++;
+    setup_job(j);
+  }
 
-  ctx.fh_sig = openout(cfg_output);
-  ctx.fh_raw = openout(cfg_raw);
-  FILE *inh = openin(cfg_input);
+  sample_domain = use_sample_domain();
+  if (sample_domain) log_info("Merging / differencing sampled frames");
 
-  if (cfg_profile) {
-    if (cfg_sampler) die("Can't use --sampler with --profile");
-    log_info("Loading profile %s", cfg_profile);
-    ctx.prof = profile_load(cfg_profile);
-  }
+  uint64_t skip = 0, discard = 0;
+  if (cfg_resume) {
+    uint64_t done = resume_point();
+    for (job *j = jobs; j; j = j->next)
+      resume_job(j, done);
 
-  ctx.next = y4m2_output_null();
+    /* a delta needs the frame before the first one we want */
+    skip = done;
+    if (cfg_delta && done) skip--, discard++;
+    skip *= cfg_merge > 1 ? cfg_merge : 1;
 
-  y4m2_output *out = y4m2_output_next(callback, &ctx);
+    if (done) log_info("Resuming after %llu frames", (unsigned long long) done);
+  }
 
-  if (cfg_centre) out = centre_filter(out);
-  if (cfg_delta) out = delta_filter(out);
-  if (cfg_histogram) out = histogram_filter(out);
-  if (cfg_merge > 1) out = merge_filter(out, cfg_merge);
+  FILE *inh = openin(cfg_input);
 
-  if (ctx.prof) {
-    unsigned w, h;
-    profile_frame_size(ctx.prof, &w, &h);
-    out = scale_filter(out, w, h);
+  /* group jobs by frame size so each size is only scaled once */
+  context **ctxs = alloc(sizeof(context *) * n_job);
+  y4m2_output **outs = alloc(sizeof(y4m2_output *) * n_job);
+  size_t n_ctx = 0;
+
+  for (job *j = jobs; j; j = j->next) {
+    context *c = find_context(ctxs, n_ctx, j);
+    if (!c) {
+      c = ctxs[n_ctx++] = alloc(sizeof(context));
+      c->width = j->width;
+      c->height = j->height;
+      c->jobs = alloc(sizeof(job *) * n_job);
+    }
+    c->jobs[c->n_jobs++] = j;
+    j->discard = discard;
   }
-  else if (cfg_size) {
-    unsigned w, h;
-    parse_size(cfg_size, &w, &h);
-    out = scale_filter(out, w, h);
+
+  if (cfg_pyramid) build_pyramid(ctxs, n_ctx);
+
+  size_t n_out = 0;
+  for (unsigned i = 0; i < n_ctx; i++) {
+    context *c = ctxs[i];
+    if (c->is_kid) continue;
+    outs[n_out] = pixel_filters(y4m2_output_next(callback, c));
+    if (c->width && c->height)
+      outs[n_out] = scale_filter(outs[n_out], c->width, c->height);
+    n_out++;
   }
 
+  if (n_ctx > 1)
+    log_info("Running %u jobs at %u frame sizes", n_job, (unsigned) n_ctx);
+
+  y4m2_output *out = n_out == 1 ? outs[0] : splitter_filter_ar(outs, n_out);
+
   /*  out = frameinfo_filter(out);*/
   out = progress_filter(out, PROGRESS_RATE);
 
-  y4m2_parse(inh, out);
+  y4m2_parse_skip(inh, out, skip);
+
+  for (job *j = jobs, *next; j; j = next) {
+    next = j->next;
+    closeio(j->fh_sig);
+    closeio(j->fh_raw);
+    free(j->watch);
+    free(j);
+  }
 
-  closeio(ctx.fh_sig);
-  closeio(ctx.fh_raw);
+  free(outs);
+  free(ctxs);
   closeio(inh);
 
   return 0;
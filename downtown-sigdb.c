@@ -0,0 +1,157 @@
+/* downtown-sigdb.c */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sigdb.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "util.h"
+
+#define PROG      "downtown-sigdb"
+
+static int cfg_compact = 0;
+static char **cfg_lookup = NULL;
+static unsigned cfg_n_lookup = 0;
+static int cfg_jobs = 0;
+static unsigned cfg_k = 5;
+static int cfg_list = 0;
+static unsigned cfg_radius = 24;
+
+static void usage() {
+  fprintf(stderr, "Usage: " PROG " [options] <db.sigdb> [<file.sig>...]\n\n"
+          "Add signature files to a database and look frames up in it. The\n"
+          "files given are indexed and appended to the database as a new\n"
+          "segment, creating it if it doesn't exist.\n\n"
+          "Options:\n"
+          "  -c, --compact             Merge the database's segments into one\n"
+          "  -h, --help                See this message\n"
+          "  -j, --jobs <n>            Threads to build with (default: one per CPU)\n"
+          "  -k, --top <k>             Matches per frame (default 5)\n"
+          "  -l, --lookup <file>       Match the frames of a signature file\n"
+          "  -L, --list                List the files in the database\n"
+          "  -q, --quiet               No log output\n"
+          "  -r, --radius <bits>       Largest distance to report (default 24)\n"
+          "\n"
+         );
+  exit(1);
+}
+
+static void parse_options(int *argc, char ***argv) {
+  int ch, oidx;
+
+  static struct option opts[] = {
+    {"compact", no_argument, NULL, 'c'},
+    {"help", no_argument, NULL, 'h'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"top", required_argument, NULL, 'k'},
+    {"lookup", required_argument, NULL, 'l'},
+    {"list", no_argument, NULL, 'L'},
+    {"quiet", no_argument, NULL, 'q'},
+    {"radius", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (ch = getopt_long(*argc, *argv, "chj:k:l:Lqr:", opts, &oidx), ch != -1) {
+    switch (ch) {
+
+    case 'c':
+      cfg_compact = 1;
+      break;
+
+    case 'j':
+      cfg_jobs = atoi(optarg);
+      break;
+
+    case 'k':
+      cfg_k = (unsigned) atoi(optarg);
+      break;
+
+    case 'l':
+      cfg_lookup = realloc(cfg_lookup, sizeof(char *) * (cfg_n_lookup + 1));
+      if (!cfg_lookup) die("Out of memory");
+      cfg_lookup[cfg_n_lookup++] = optarg;
+      break;
+
+    case 'L':
+      cfg_list = 1;
+      break;
+
+    case 'q':
+      log_level = ERROR;
+      break;
+
+    case 'r':
+      cfg_radius = (unsigned) atoi(optarg);
+      break;
+
+    case 'h':
+    default:
+      usage();
+      break;
+
+    }
+  }
+
+  *argc -= optind;
+  *argv += optind;
+}
+
+static void add_files(const char *db, char **files, int n_files, int n_jobs) {
+  sigindex *idx = sigindex_new();
+  for (int i = 0; i < n_files; i++)
+    sigindex_add_file(idx, files[i]);
+  sigindex_build(idx, n_jobs);
+
+  log_info("Adding %llu frames from %d files to %s",
+           (unsigned long long) sigindex_size(idx), n_files, db);
+  sigdb_append(db, idx);
+  sigindex_free(idx);
+}
+
+static void list_files(const sigindex *idx) {
+  for (size_t i = 0; i < idx->n_files; i++) {
+    const sigindex_file *f = &idx->files[i];
+    printf("%10llu %10llu %s\n", (unsigned long long) f->first_frame,
+           (unsigned long long) f->frames, f->name);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  parse_options(&argc, &argv);
+  if (argc < 1 || (argc == 1 && !cfg_compact && !cfg_list && !cfg_n_lookup)) usage();
+
+  int n_jobs = cfg_jobs > 0 ? cfg_jobs : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_jobs < 1) n_jobs = 1;
+
+  if (argc > 1) add_files(argv[0], argv + 1, argc - 1, n_jobs);
+  if (cfg_compact) sigdb_compact(argv[0], (unsigned) n_jobs);
+
+  if (cfg_list || cfg_n_lookup) {
+    sigdb *db = sigdb_open(argv[0]);
+    sigindex *idx = sigindex_new();
+    sigdb_load(db, idx);
+
+    log_info("%s: %llu frames from %u files in %u segments", argv[0],
+             (unsigned long long) sigindex_size(idx), (unsigned) idx->n_files,
+             (unsigned) db->n_segments);
+
+    if (cfg_list) list_files(idx);
+    for (unsigned i = 0; i < cfg_n_lookup; i++)
+      sigindex_match_file(idx, cfg_lookup[i], cfg_radius, cfg_k, (unsigned) n_jobs, stdout);
+
+    sigindex_free(idx);
+    sigdb_close(db);
+  }
+
+  free(cfg_lookup);
+
+  return 0;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -14,6 +14,7 @@
 #include "downtown.h"
 #include "dumpframe.h"
 #include "frameinfo.h"
+#include "hilbert.h"
 #include "histogram.h"
 #include "log.h"
 #include "merge.h"
@@ -227,8 +228,9 @@ static void layout_display(context *c, const y4m2_frame *frame) {
 }
 
 static void create_sampler(fft_context *fc, const char *spec, const char *name, int w, int h) {
-  fc->sampler = sampler_new(spec, name);
-  fc->len = sampler_init(fc->sampler, w, h);
+  /* planes of the same size share a sampler */
+  fc->sampler = sampler_acquire(spec, name, w, h);
+  fc->len = fc->sampler->len;
   log_debug("Sampler for %s will return %u samples", name, fc->len);
 }
 
@@ -311,11 +313,12 @@ static void process_frame(context *c, const y4m2_frame *frame) {
 
     if (!fc->sampler) create_sampler(fc, cfg_sampler, plane_name[pl], w, h);
 
-    double *sam = sampler_sample(fc->sampler, frame->plane[pl]);
+    double *sam = sampler_sample_stride(fc->sampler, frame->plane[pl],
+                                        frame->i.plane[pl].stride);
 
     if (!fc->plan) init_fft_context(fc);
 
-    memcpy(fc->ibuf, sam, fc->len);
+    memcpy(fc->ibuf, sam, sizeof(double) * fc->len);
     fftw_execute(fc->plan);
     process_fft(fc);
 
@@ -483,6 +486,7 @@ static void parse_options(int *argc, char ***argv) {
 static void register_samplers() {
   zigzag_register();
   voronoi_register();
+  hilbert_register();
 }
 
 static y4m2_output *add_graph(y4m2_output *out, const char *spec) {
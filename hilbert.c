@@ -0,0 +1,164 @@
+/* hilbert.c */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hilbert.h"
+#include "log.h"
+#include "sampler.h"
+#include "util.h"
+
+/* Samples pixels in the order of a Hilbert curve over the smallest
+ * power of two square that covers the frame, skipping the parts of it
+ * that fall outside. The curve finishes each power of two tile before
+ * it moves on to the next, so neighbouring samples are near each other
+ * in the frame as well as in memory.
+ *
+ * With length=<n> (default 0: every pixel) the curve is cut into n
+ * nearly equal runs and each sample is the mean of a run.
+ */
+
+typedef struct {
+  uint32_t *idx;    /* pixel offsets in curve order */
+  unsigned stride;  /* that idx is for */
+  size_t n_pixels;
+  uint32_t *bound;  /* run i is idx[bound[i], bound[i + 1]) */
+  size_t len;
+} hilbert_context;
+
+typedef struct {
+  double length;
+} hilbert_config;
+
+static const sampler_schema hilbert_schema[] = {
+  { "length", sampler_NUMBER, "0", offsetof(hilbert_config, length) },
+  { NULL, sampler_NUMBER, NULL, 0 }
+};
+
+/* Position d along the curve over a side x side square */
+static void _d2xy(uint32_t side, uint64_t d, uint32_t *xp, uint32_t *yp) {
+  uint32_t x = 0, y = 0;
+
+  for (uint32_t s = 1; s < side; s *= 2) {
+    uint32_t rx = 1 & (uint32_t)(d / 2);
+    uint32_t ry = 1 & (uint32_t)(d ^ rx);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      uint32_t t = x;
+      x = y;
+      y = t;
+    }
+    x += s * rx;
+    y += s * ry;
+    d /= 4;
+  }
+
+  *xp = x;
+  *yp = y;
+}
+
+static void _free(sampler_context *ctx) {
+  hilbert_context *hc = ctx->user;
+  if (hc) {
+    free(hc->idx);
+    free(hc->bound);
+    free(hc);
+    ctx->user = NULL;
+  }
+}
+
+static size_t _init(sampler_context *ctx) {
+  _free(ctx);
+
+  hilbert_context *hc = ctx->user = alloc(sizeof(hilbert_context));
+  uint32_t side = 1;
+  while (side < MAX(ctx->width, ctx->height)) side *= 2;
+
+  hc->n_pixels = (size_t) ctx->width * ctx->height;
+  hc->idx = alloc_no_clear(sizeof(uint32_t) * (hc->n_pixels + 1));
+
+  size_t pos = 0;
+  for (uint64_t d = 0; d < (uint64_t) side * side; d++) {
+    uint32_t x, y;
+    _d2xy(side, d, &x, &y);
+    if (x < ctx->width && y < ctx->height)
+      hc->idx[pos++] = y * ctx->width + x;
+  }
+  hc->stride = ctx->width;
+
+  double length = ((const hilbert_config *) ctx->config)->length;
+  hc->len = hc->n_pixels;
+  if (length >= 1 && length < hc->n_pixels) {
+    hc->len = (size_t) length;
+    hc->bound = alloc_no_clear(sizeof(uint32_t) * (hc->len + 1));
+    for (size_t i = 0; i <= hc->len; i++)
+      hc->bound[i] = (uint32_t)(i * hc->n_pixels / hc->len);
+  }
+
+  log_debug("Hilbert curve over %ux%u: %llu samples from %llu pixels",
+            side, side, (unsigned long long) hc->len,
+            (unsigned long long) hc->n_pixels);
+
+  free(ctx->buf);
+  ctx->buf = alloc(sizeof(double) * hc->len);
+  return hc->len;
+}
+
+/* Frames almost always come with the same stride so the offsets are
+ * rewritten for a new one rather than worked out for every pixel.
+ */
+static void _restride(sampler_context *ctx, unsigned stride) {
+  hilbert_context *hc = ctx->user;
+
+  if ((uint64_t) stride * ctx->height > UINT32_MAX)
+    die("Hilbert: stride %u too large", stride);
+
+  for (size_t i = 0; i < hc->n_pixels; i++)
+    hc->idx[i] = hc->idx[i] / hc->stride * stride + hc->idx[i] % hc->stride;
+  hc->stride = stride;
+}
+
+static double *_sample(sampler_context *ctx, const uint8_t *in, unsigned stride)  {
+  const hilbert_context *hc = ctx->user;
+
+  if (stride != hc->stride) _restride(ctx, stride);
+
+  if (!hc->bound) {
+    for (size_t i = 0; i < hc->len; i++)
+      ctx->buf[i] = sampler_byte2double(in[hc->idx[i]]);
+    return ctx->buf;
+  }
+
+  /* summed as integers so a run of one is exactly the pixel's value */
+  for (size_t i = 0; i < hc->len; i++) {
+    uint64_t sum = 0;
+    for (uint32_t j = hc->bound[i]; j < hc->bound[i + 1]; j++)
+      sum += in[hc->idx[j]];
+    double count = hc->bound[i + 1] - hc->bound[i];
+    ctx->buf[i] = ((double) sum - 128 * count) / 128 / count;
+  }
+
+  return ctx->buf;
+}
+
+void hilbert_register(void) {
+  sampler_info hilbert = {
+    .name = "hilbert",
+    .init = _init,
+    .sample = _sample,
+    .free = _free,
+    .schema = hilbert_schema,
+    .config_size = sizeof(hilbert_config),
+    .linear = 1
+  };
+
+  sampler_register(&hilbert);
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,19 @@
+/* hilbert.h */
+
+#ifndef HILBERT_H_
+#define HILBERT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void hilbert_register(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -62,5 +62,24 @@ double *json_get_real(jd_var *ar, size_t *sizep) {
   return data;
 }
 
+/* Write s to f as a quoted JSON string */
+void json_put_string(const char *s, FILE *f) {
+  putc('"', f);
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\') {
+      putc('\\', f);
+      putc(c, f);
+    }
+    else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    }
+    else {
+      putc(c, f);
+    }
+  }
+  putc('"', f);
+}
+
 /* vim:ts=2:sw=2:sts=2:et:ft=c
  */
@@ -16,6 +16,7 @@ jd_var *json_save(jd_var *obj, FILE *f);
 jd_var *json_load_file(jd_var *out, const char *fn);
 jd_var *json_save_file(jd_var *out, const char *fn);
 double *json_get_real(jd_var *ar, size_t *sizep);
+void json_put_string(const char *s, FILE *f);
 
 #ifdef __cplusplus
 }
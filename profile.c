@@ -1,43 +1,384 @@
 /* profile.c */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <jd_pretty.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "average.h"
 #include "json.h"
 #include "profile.h"
-#include "resample.h"
 #include "sampler.h"
+#include "signature.h"
 #include "util.h"
 
-/*#define RESAMPLE_LOG*/
+/* A profile may limit the part of the spectrum it consumes:
+ *
+ *   "bins" : [ <first>, <end> ]
+ *
+ * Only bins first <= n < end are used to build the signature.
+ */
+static void unpack_bins(profile *p) {
+  jd_var *bins = jd_get_ks(&p->config, "bins", 0);
 
-#ifdef RESAMPLE_LOG
-#define RESAMPLE resample_log
-#else
-#define RESAMPLE resample_double
-#endif
+  p->bin_lo = 0;
+  p->bin_hi = p->len;
+
+  if (bins) {
+    if (jd_count(bins) != 2) die("'bins' must be [first, end] in %s", p->filename);
+    p->bin_lo = (size_t) jd_get_int(jd_get_idx(bins, 0));
+    p->bin_hi = (size_t) jd_get_int(jd_get_idx(bins, 1));
+    if (p->bin_lo >= p->bin_hi || p->bin_hi > p->len)
+      die("Bad bin range [%u, %u) in %s (profile length: %u)",
+          (unsigned) p->bin_lo, (unsigned) p->bin_hi, p->filename, (unsigned) p->len);
+  }
+}
+
+/* ... or group it into coarse bands:
+ *
+ *   "bands" : [ <e0>, <e1>, ..., <en> ]
+ *
+ * Band i covers bins e(i) <= n < e(i+1) and the signature is built from
+ * each band's mean magnitude rather than from every bin. The bands
+ * replace "bins": only bins e0 <= n < en are used.
+ */
+static void check_bands(const profile *p) {
+  if (p->n_bands < 1) die("'bands' needs at least two edges in %s", p->filename);
+  for (size_t i = 0; i < p->n_bands; i++)
+    if (p->bands[i] >= p->bands[i + 1])
+      die("'bands' must be increasing in %s", p->filename);
+  if (p->bands[p->n_bands] > p->len)
+    die("Bad band edge %u in %s (profile length: %u)", (unsigned) p->bands[p->n_bands],
+        p->filename, (unsigned) p->len);
+}
+
+static void unpack_bands(profile *p) {
+  jd_var *bands = jd_get_ks(&p->config, "bands", 0);
+  if (!bands) return;
+  if (jd_get_ks(&p->config, "bins", 0))
+    die("Use 'bins' or 'bands', not both, in %s", p->filename);
+
+  size_t n = jd_count(bands);
+  p->n_bands = n ? n - 1 : 0;
+  p->bands = alloc(sizeof(uint64_t) * (n + 1));
+  for (size_t i = 0; i < n; i++)
+    p->bands[i] = (uint64_t) jd_get_int(jd_get_idx(bands, i));
+  check_bands(p);
+
+  p->bin_lo = p->bands[0];
+  p->bin_hi = p->bands[p->n_bands];
+}
+
+static unsigned get_uint(profile *p, const char *key) {
+  jd_var *v = jd_get_ks(&p->config, key, 0);
+  return v ? (unsigned) jd_get_int(v) : 0;
+}
 
 static void unpack(profile *p) {
   p->baseline = json_get_real(jd_get_idx(jd_get_ks(&p->config, "baseline", 0), 0), &p->len);
   jd_var *smooth = jd_get_ks(&p->config, "smooth", 0);
   p->smooth_span = smooth ? (unsigned) jd_get_int(smooth) : 1;
+  p->width = get_uint(p, "width");
+  p->height = get_uint(p, "height");
+  jd_var *spec = jd_get_ks(&p->config, "sampler", 0);
+  p->spec = spec ? sstrdup(jd_bytes(spec, NULL)) : NULL;
+  unpack_bins(p);
+  unpack_bands(p);
+}
+
+/* Binary profiles (.profbin)
+ *
+ * A profile_bin_header, the NUL terminated sampler spec padded to
+ * profile_BIN_ALIGN, the baseline as native doubles and then any band
+ * edges as uint64_t, also aligned. The file is mapped and the baseline
+ * and bands used in place.
+ */
+#define profile_BIN_MAGIC   "DTPROFB\n"
+#define profile_BIN_VERSION 2
+#define profile_BIN_BOM     0x01020304
+#define profile_BIN_ALIGN   16
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint32_t width, height;
+  uint32_t smooth_span;
+  uint32_t spec_len;
+  uint64_t len;
+  uint64_t bin_lo, bin_hi;
+  uint64_t baseline_offset;
+  uint64_t n_bands;
+  uint64_t bands_offset;
+} profile_bin_header;
+
+static size_t bin_align(size_t off) {
+  return (off + profile_BIN_ALIGN - 1) & ~(size_t)(profile_BIN_ALIGN - 1);
+}
+
+int profile_is_bin(const char *filename) {
+  char magic[8];
+  FILE *fl = fopen(filename, "rb");
+  if (!fl) die("Can't read %s: %s", filename, strerror(errno));
+  size_t got = fread(magic, 1, sizeof(magic), fl);
+  fclose(fl);
+  return got == sizeof(magic) && !memcmp(magic, profile_BIN_MAGIC, sizeof(magic));
+}
+
+static void load_bin(profile *p) {
+  int fd = open(p->filename, O_RDONLY);
+  if (fd < 0) die("Can't read %s: %s", p->filename, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st)) die("Can't stat %s: %s", p->filename, strerror(errno));
+  if ((size_t) st.st_size < sizeof(profile_bin_header)) die("%s is truncated", p->filename);
+
+  p->map_size = st.st_size;
+  p->map = mmap(NULL, p->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p->map == MAP_FAILED) die("Can't map %s: %s", p->filename, strerror(errno));
+  close(fd);
+
+  const profile_bin_header *hdr = p->map;
+  if (memcmp(hdr->magic, profile_BIN_MAGIC, sizeof(hdr->magic)))
+    die("%s is not a binary profile", p->filename);
+  if (hdr->bom != profile_BIN_BOM)
+    die("%s has the wrong byte order", p->filename);
+  if (hdr->version != profile_BIN_VERSION)
+    die("%s: unsupported version %u", p->filename, (unsigned) hdr->version);
+  if (hdr->baseline_offset % profile_BIN_ALIGN ||
+      hdr->baseline_offset < sizeof(*hdr) + hdr->spec_len ||
+      hdr->baseline_offset > p->map_size ||
+      hdr->len > (p->map_size - hdr->baseline_offset) / sizeof(double))
+    die("%s is corrupt", p->filename);
+
+  const char *spec = (const char *)(hdr + 1);
+  if (hdr->spec_len && spec[hdr->spec_len - 1] != '\0')
+    die("%s is corrupt", p->filename);
+
+  p->width = hdr->width;
+  p->height = hdr->height;
+  p->smooth_span = hdr->smooth_span;
+  p->spec = hdr->spec_len ? sstrdup(spec) : NULL;
+  p->len = hdr->len;
+  p->bin_lo = hdr->bin_lo;
+  p->bin_hi = hdr->bin_hi;
+  p->baseline = (double *)((char *) p->map + hdr->baseline_offset);
+
+  if (p->bin_lo >= p->bin_hi || p->bin_hi > p->len)
+    die("%s is corrupt", p->filename);
+
+  if (hdr->n_bands) {
+    if (hdr->bands_offset % profile_BIN_ALIGN ||
+        hdr->bands_offset < hdr->baseline_offset + hdr->len * sizeof(double) ||
+        hdr->bands_offset > p->map_size ||
+        hdr->n_bands >= (p->map_size - hdr->bands_offset) / sizeof(uint64_t))
+      die("%s is corrupt", p->filename);
+    p->n_bands = hdr->n_bands;
+    p->bands = (uint64_t *)((char *) p->map + hdr->bands_offset);
+    for (size_t i = 0; i < p->n_bands; i++)
+      if (p->bands[i] >= p->bands[i + 1]) die("%s is corrupt", p->filename);
+    if (p->bands[0] != p->bin_lo || p->bands[p->n_bands] != p->bin_hi)
+      die("%s is corrupt", p->filename);
+  }
+}
+
+void profile_save_bin(const profile *p, const char *filename) {
+  profile_bin_header hdr;
+  static const char pad[profile_BIN_ALIGN];
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, profile_BIN_MAGIC, sizeof(hdr.magic));
+  hdr.version = profile_BIN_VERSION;
+  hdr.bom = profile_BIN_BOM;
+  hdr.width = p->width;
+  hdr.height = p->height;
+  hdr.smooth_span = p->smooth_span;
+  hdr.spec_len = p->spec ? strlen(p->spec) + 1 : 0;
+  hdr.len = p->len;
+  hdr.bin_lo = p->bin_lo;
+  hdr.bin_hi = p->bin_hi;
+  hdr.baseline_offset = bin_align(sizeof(hdr) + hdr.spec_len);
+  hdr.n_bands = p->n_bands;
+  if (p->n_bands)
+    hdr.bands_offset = bin_align(hdr.baseline_offset + sizeof(double) * p->len);
+
+  FILE *fl = fopen(filename, "wb");
+  if (!fl) die("Can't write %s: %s", filename, strerror(errno));
+
+  size_t padding = hdr.baseline_offset - sizeof(hdr) - hdr.spec_len;
+  size_t band_padding = hdr.n_bands
+                        ? hdr.bands_offset - hdr.baseline_offset - sizeof(double) * p->len
+                        : 0;
+
+  if (fwrite(&hdr, sizeof(hdr), 1, fl) != 1 ||
+      (hdr.spec_len && fwrite(p->spec, hdr.spec_len, 1, fl) != 1) ||
+      (padding && fwrite(pad, padding, 1, fl) != 1) ||
+      fwrite(p->baseline, sizeof(double), p->len, fl) != p->len ||
+      (band_padding && fwrite(pad, band_padding, 1, fl) != 1) ||
+      (hdr.n_bands && fwrite(p->bands, sizeof(uint64_t), p->n_bands + 1, fl) != p->n_bands + 1) ||
+      fclose(fl))
+    die("Error writing %s: %s", filename, strerror(errno));
+}
+
+/* Work out the window the running log average in smooth() would use for
+ * each output bin. The smoothed value of bin i is then the geometric
+ * mean of norm[sm_lo[i]] .. norm[sm_hi[i] - 1].
+ */
+static void plan_smooth(profile_plan *pp, unsigned span) {
+  size_t len = pp->len;
+  unsigned lo = 0, hi = 0, dpos = 0;
+
+  pp->sm_lo = alloc(sizeof(unsigned) * len);
+  pp->sm_hi = alloc(sizeof(unsigned) * len);
+
+  for (unsigned i = 0; i < len; i++) {
+    if (hi - lo >= span / 2) {
+      pp->sm_lo[dpos] = lo;
+      pp->sm_hi[dpos++] = hi;
+    }
+    if (hi - lo == span) lo++;
+    hi++;
+  }
+
+  while (dpos != len) {
+    pp->sm_lo[dpos] = lo;
+    pp->sm_hi[dpos++] = hi;
+    if (lo != hi) lo++;
+  }
+}
+
+/* Rows of the sparse len -> profile_SIGNATURE_BITS resampling matrix. Each
+ * row is a run of bins with fractional weights at either end; the
+ * arithmetic mirrors resample_double() exactly.
+ */
+static void plan_resample(profile_plan *pp) {
+  size_t isize = pp->len;
+  size_t osize = profile_SIGNATURE_BITS;
+  double scale = (double) isize / (double) osize;
+
+  pp->rs_scale = isize == osize ? 1 : scale;
+
+  for (unsigned i = 0; i < osize; i++) {
+    profile_plan_row *row = &pp->rs[i];
+
+    if (isize == osize) {
+      row->first = row->last = i;
+      row->w_first = 1;
+      continue;
+    }
+
+    double is = (double) i * scale;
+    double ie = is + scale;
+
+    unsigned iis = (unsigned) is;
+    unsigned iie = (unsigned) ie;
+
+    row->first = iis;
+    row->last = iie;
+
+    if (iis == iie) {
+      row->w_first = scale;
+    }
+    else {
+      row->w_first = 1 - (is - iis);
+      row->w_last = ie - iie;
+    }
+  }
+}
+
+static profile_plan *plan_new(profile *p) {
+  profile_plan *pp = alloc(sizeof(profile_plan));
+  size_t len = pp->len = p->n_bands ? p->n_bands : p->bin_hi - p->bin_lo;
+
+  if (len == 0) die("Empty profile: %s", p->filename);
+
+  /* a band's mean over the baseline's mean is the ratio of their sums */
+  pp->rbase = alloc(sizeof(double) * len);
+  for (unsigned i = 0; i < len; i++) {
+    if (p->n_bands) {
+      double sum = 0;
+      for (uint64_t j = p->bands[i]; j < p->bands[i + 1]; j++)
+        sum += p->baseline[j];
+      pp->rbase[i] = 1 / sum;
+    }
+    else {
+      pp->rbase[i] = 1 / p->baseline[p->bin_lo + i];
+    }
+  }
+
+  pp->norm = alloc(sizeof(double) * len);
+
+  if (p->smooth_span > 1) {
+    plan_smooth(pp, p->smooth_span);
+    pp->lsum = alloc(sizeof(double) * (len + 1));
+  }
+
+  plan_resample(pp);
+
+  return pp;
+}
+
+static void plan_free(profile_plan *pp) {
+  if (pp) {
+    free(pp->rbase);
+    free(pp->sm_lo);
+    free(pp->sm_hi);
+    free(pp->norm);
+    free(pp->lsum);
+    free(pp);
+  }
+}
+
+profile *profile_new(jd_var *config, const char *name) {
+  profile *p = alloc(sizeof(profile));
+  p->filename = sstrdup(name);
+  jd_assign(&p->config, config);
+  unpack(p);
+  p->plan = plan_new(p);
+  return p;
 }
 
 profile *profile_load(const char *filename) {
   profile *p = alloc(sizeof(profile));
   p->filename = sstrdup(filename);
-  json_load_file(&p->config, p->filename);
-  unpack(p);
+  if (profile_is_bin(p->filename)) {
+    load_bin(p);
+  }
+  else {
+    json_load_file(&p->config, p->filename);
+    unpack(p);
+  }
+  p->plan = plan_new(p);
   return p;
 }
 
 void profile_free(profile *p) {
-  jd_release(&p->config);
-  sampler_free(p->sam);
-  free(p->filename);
-  free(p->baseline);
+  if (p) {
+    jd_release(&p->config);
+    sampler_free(p->sam);
+    plan_free(p->plan);
+    free(p->filename);
+    free(p->spec);
+    if (p->map) {
+      munmap(p->map, p->map_size);
+    }
+    else {
+      free(p->baseline);
+      free(p->bands);
+    }
+    free(p);
+  }
 }
 
 double *profile__log2lin(double *out, const double *in, size_t len) {
@@ -52,18 +393,6 @@ double *profile__lin2log(double *out, const double *in, size_t len) {
   return out;
 }
 
-#ifdef RESAMPLE_LOG
-static double *resample_log(double *out, size_t olen, const double *in, size_t ilen) {
-  double in_log[ilen];
-  double out_log[olen];
-
-  profile__lin2log(in_log, in, ilen);
-  resample_double(out_log, olen, in_log, ilen);
-  profile__log2lin(out, out_log, olen);
-  return out;
-}
-#endif
-
 static double *smooth(double *dst, const double *src, size_t len, unsigned span) {
   average *avg = average_new_log(span);
 
@@ -88,24 +417,66 @@ double *profile_smooth(const profile *p, double *dst, const double *src, size_t
   return smooth(dst, src, len, p->smooth_span);
 }
 
-char *profile_signature(const profile *p, char *sig, const double *data, size_t len) {
+static void plan_resample_apply(const profile_plan *pp, double *out, const double *in) {
+  for (unsigned i = 0; i < profile_SIGNATURE_BITS; i++) {
+    const profile_plan_row *row = &pp->rs[i];
+    double sum = in[row->first] * row->w_first;
+    if (row->last != row->first) {
+      for (unsigned j = row->first + 1; j != row->last; j++) sum += in[j];
+      if (row->last < pp->len) sum += in[row->last] * row->w_last;
+    }
+    out[i] = sum / pp->rs_scale;
+  }
+}
+
+double *profile_signature_data(const profile *p, double *out, const double *data, size_t len) {
   if (len != p->len) die("Data size incorrect: profile length: %u, data length: %u",
                            (unsigned) p->len, (unsigned) len);
-  double norm[p->len];
-  double smoothed[p->len];
-  double sig_raw[p->len];
 
-  for (unsigned i = 0; i < len; i++)
-    norm[i] = data[i] / p->baseline[i];
+  profile_plan *pp = p->plan;
+  const double *bdata = data + p->bin_lo;
+  double *norm = pp->norm;
+  size_t blen = pp->len;
 
-  double *smoop = profile_smooth(p, smoothed, norm, len);
+  if (p->n_bands) {
+    for (unsigned i = 0; i < blen; i++) {
+      double sum = 0;
+      for (uint64_t j = p->bands[i]; j < p->bands[i + 1]; j++)
+        sum += data[j];
+      norm[i] = sum * pp->rbase[i];
+    }
+  }
+  else {
+    for (unsigned i = 0; i < blen; i++)
+      norm[i] = bdata[i] * pp->rbase[i];
+  }
 
-  for (unsigned i = 0; i < len; i++)
-    sig_raw[i] = norm[i] - (smoop ? smoop[i] : 1);
+  if (pp->lsum) {
+    /* subtract the smoothed spectrum: a geometric mean over each bin's
+     * window, taken from prefix sums of the log spectrum */
+    double *lsum = pp->lsum;
+    lsum[0] = 0;
+    for (unsigned i = 0; i < blen; i++)
+      lsum[i + 1] = lsum[i] + log(norm[i]);
 
+    for (unsigned i = 0; i < blen; i++) {
+      unsigned lo = pp->sm_lo[i], hi = pp->sm_hi[i];
+      norm[i] -= exp((lsum[hi] - lsum[lo]) / (double)(hi - lo));
+    }
+  }
+  else {
+    for (unsigned i = 0; i < blen; i++)
+      norm[i] -= 1;
+  }
+
+  plan_resample_apply(pp, out, norm);
+  return out;
+}
+
+char *profile_signature(const profile *p, char *sig, const double *data, size_t len) {
   double sig_data[profile_SIGNATURE_BITS];
 
-  RESAMPLE(sig_data, profile_SIGNATURE_BITS, sig_raw, p->len);
+  profile_signature_data(p, sig_data, data, len);
 
   for (unsigned i = 0; i < profile_SIGNATURE_BITS; i++)
     sig[i] = sig_data[i] > 0 ? '1' : '0';
@@ -115,16 +486,64 @@ char *profile_signature(const profile *p, char *sig, const double *data, size_t
   return sig;
 }
 
+/* Bit order matches signature_parse(): the first bin is the most
+ * significant bit of the last word.
+ */
+signature *profile_signature_bits(const profile *p, signature *sig, const double *data, size_t len) {
+  double sig_data[profile_SIGNATURE_BITS];
+
+  profile_signature_data(p, sig_data, data, len);
+
+  for (unsigned i = 0; i < signature_WCOUNT; i++) {
+    const double *sd = sig_data + (signature_WCOUNT - 1 - i) * signature_WBITS;
+    signature_word w = 0;
+#ifdef __SSE2__
+    const __m128d zero = _mm_setzero_pd();
+    for (unsigned b = 0; b < signature_WBITS; b += 2) {
+      __m128d v = _mm_loadu_pd(sd + signature_WBITS - 2 - b);
+      v = _mm_shuffle_pd(v, v, 1);
+      w |= (signature_word) _mm_movemask_pd(_mm_cmpgt_pd(v, zero)) << b;
+    }
+#else
+    for (unsigned b = 0; b < signature_WBITS; b++)
+      w = (w << 1) | (sd[b] > 0);
+#endif
+    sig->w[i] = w;
+  }
+
+  return sig;
+}
+
+/* Covers everything that affects the signatures a profile makes, so a
+ * signature file can be tied back to its profile whichever format that
+ * was loaded from.
+ */
+uint64_t profile_hash(const profile *p) {
+  const char *spec = p->spec ? p->spec : "";
+  uint32_t dims[] = { p->width, p->height, p->smooth_span };
+  uint64_t bins[] = { p->len, p->bin_lo, p->bin_hi };
+
+  uint64_t h = fnv1a(FNV_OFFSET, spec, strlen(spec) + 1);
+  h = fnv1a(h, dims, sizeof(dims));
+  h = fnv1a(h, bins, sizeof(bins));
+  if (p->n_bands) h = fnv1a(h, p->bands, sizeof(uint64_t) * (p->n_bands + 1));
+  return fnv1a(h, p->baseline, sizeof(double) * p->len);
+}
+
 void profile_frame_size(profile *p, unsigned *wp, unsigned *hp) {
-  if (wp) *wp = (unsigned) jd_get_int(jd_get_ks(&p->config, "width", 0));
-  if (hp) *hp = (unsigned) jd_get_int(jd_get_ks(&p->config, "height", 0));
+  if (wp) *wp = p->width;
+  if (hp) *hp = p->height;
+}
+
+void profile_bins(const profile *p, size_t *lop, size_t *hip) {
+  if (lop) *lop = p->bin_lo;
+  if (hip) *hip = p->bin_hi;
 }
 
 sampler_context *profile_sampler(profile *p, size_t *lenp) {
   if (!p->sam) {
-    const char *spec = jd_bytes(jd_get_ks(&p->config, "sampler", 0), NULL);
-    if (!spec) die("'sampler' missing in %s", p->filename);
-    p->sam = sampler_new(spec, p->filename);
+    if (!p->spec) die("'sampler' missing in %s", p->filename);
+    p->sam = sampler_new(p->spec, p->filename);
     unsigned w, h;
     profile_frame_size(p, &w, &h);
     p->sam_len = sampler_init(p->sam, w, h);
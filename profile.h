@@ -7,32 +7,74 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "jsondata.h"
 #include "sampler.h"
+#include "signature.h"
 
-#define profile_SIGNATURE_BITS  256
+#define profile_SIGNATURE_BITS  signature_BITS
+
+typedef struct {
+  unsigned first, last;
+  double w_first, w_last;
+} profile_plan_row;
+
+/* Everything profile_signature() needs, computed once at load time. The
+ * scratch buffers make a profile unsafe to share between threads.
+ */
+typedef struct {
+  size_t len;
+  double *rbase;
+  unsigned *sm_lo, *sm_hi;
+  profile_plan_row rs[profile_SIGNATURE_BITS];
+  double rs_scale;
+  double *norm, *lsum;
+} profile_plan;
 
 typedef struct {
   char *filename;
   jd_var config;
 
+  unsigned width, height;
+  char *spec;
+
   size_t len;
   double *baseline;
 
   unsigned smooth_span;
 
+  /* spectrum bins consumed by the signature: [bin_lo, bin_hi) */
+  size_t bin_lo, bin_hi;
+
+  /* optional coarse bands: band i is bins [bands[i], bands[i + 1]) */
+  size_t n_bands;
+  uint64_t *bands;
+
   sampler_context *sam;
   size_t sam_len;
 
+  profile_plan *plan;
+
+  /* binary profiles are mapped; baseline points into the map */
+  void *map;
+  size_t map_size;
+
 } profile;
 
+profile *profile_new(jd_var *config, const char *name);
 profile *profile_load(const char *filename);
 void profile_free(profile *p);
+int profile_is_bin(const char *filename);
+void profile_save_bin(const profile *p, const char *filename);
 double *profile_smooth(const profile *p, double *dst, const double *src, size_t len);
+double *profile_signature_data(const profile *p, double *out, const double *data, size_t len);
 char *profile_signature(const profile *p, char *sig, const double *data, size_t len);
+signature *profile_signature_bits(const profile *p, signature *sig, const double *data, size_t len);
+uint64_t profile_hash(const profile *p);
 void profile_frame_size(profile *p, unsigned *wp, unsigned *hp);
+void profile_bins(const profile *p, size_t *lop, size_t *hip);
 sampler_context *profile_sampler(profile *p, size_t *lenp);
 
 double *profile__log2lin(double *out, const double *in, size_t len);
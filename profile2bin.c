@@ -0,0 +1,86 @@
+/* profile2bin.c */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "profile.h"
+#include "util.h"
+
+#define PROG      "profile2bin"
+
+static char *cfg_output = NULL;
+
+static void usage() {
+  fprintf(stderr, "Usage: " PROG " [options] <in.profile>...\n\n"
+          "Options:\n"
+          "  -h, --help                See this message\n"
+          "  -o, --output <file>       Output file (default <in>.profbin)\n"
+          "  -q, --quiet               No log output\n"
+          "\n"
+         );
+  exit(1);
+}
+
+static void parse_options(int *argc, char ***argv) {
+  int ch, oidx;
+
+  static struct option opts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"output", required_argument, NULL, 'o'},
+    {"quiet", no_argument, NULL, 'q'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (ch = getopt_long(*argc, *argv, "ho:q", opts, &oidx), ch != -1) {
+    switch (ch) {
+
+    case 'o':
+      cfg_output = optarg;
+      break;
+
+    case 'q':
+      log_level = ERROR;
+      break;
+
+    case 'h':
+    default:
+      usage();
+      break;
+
+    }
+  }
+
+  *argc -= optind;
+  *argv += optind;
+}
+
+static char *bin_name(const char *name) {
+  const char *dot = strrchr(name, '.');
+  const char *slash = strrchr(name, '/');
+  if (!dot || (slash && dot < slash) || strcmp(dot, ".profile"))
+    return ssprintf("%s.profbin", name);
+  return ssprintf("%.*s.profbin", (int)(dot - name), name);
+}
+
+int main(int argc, char *argv[]) {
+  parse_options(&argc, &argv);
+  if (argc == 0) usage();
+  if (cfg_output && argc != 1) die("Can't use --output with multiple profiles");
+
+  for (int i = 0; i < argc; i++) {
+    char *out = cfg_output ? sstrdup(cfg_output) : bin_name(argv[i]);
+    log_info("%s -> %s", argv[i], out);
+    profile *p = profile_load(argv[i]);
+    profile_save_bin(p, out);
+    profile_free(p);
+    free(out);
+  }
+
+  return 0;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -53,8 +53,11 @@ static char *timecode(double elapsed) {
 
 static void show_progress(context *c, const y4m2_frame *frame) {
   double now = time_of_day();
-  if (frame->sequence == 0)
+  /* a resumed stream doesn't start at frame 0 */
+  if (c->count == 0) {
     c->start_time = now;
+    c->last_sequence = frame->sequence;
+  }
 
   if (now - c->last_time >= c->every) {
     double since = now - c->last_time;
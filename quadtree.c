@@ -1,11 +1,27 @@
 /* quadtree.c */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "util.h"
 #include "quadtree.h"
 
+/* enough for a node's kids at every level of any tree */
+#define STACK_SIZE (4 * 34)
+
+typedef struct {
+  uint64_t code;    /* Morton code of the point */
+  uint32_t order;   /* position in added_pt */
+} qt_key;
+
+typedef struct {
+  uint32_t node;
+  int x0, y0, size;
+  int dist;
+  unsigned kid;
+} qt_visit;
+
 static unsigned _next_power(int i) {
   for (unsigned bit = 0;; bit++) {
     int x = 1 << bit;
@@ -21,84 +37,64 @@ quadtree *quadtree_new(int w, int h) {
   return qt;
 }
 
-static void _free(quadtree_node *nd) {
-  if (nd) {
-    for (unsigned i = 0; i < 4; i++) _free(nd->kids[i]);
-    free(nd);
-  }
+quadtree *quadtree_build(int w, int h, const quadtree_point *pt, size_t n) {
+  quadtree *qt = quadtree_new(w, h);
+  for (size_t i = 0; i < n; i++)
+    quadtree_add_point(qt, &pt[i]);
+  quadtree_index(qt);
+  return qt;
 }
 
 void quadtree_free(quadtree *qt) {
-  _free(qt->root);
-  free(qt);
-}
-
-static void _dump(quadtree_node *nd, FILE *out, unsigned depth, int x0, int y0, int x1, int y1) {
-  if (nd) {
-    unsigned i;
-
-    for (i = 0; i < depth; i++) fprintf(out, "  ");
-    fprintf(out, "[%d, %d, %d, %d]", x0, y0, x1, y1);
-    if (nd->internal) fprintf(out, " internal");
-    for (i = 0; i < nd->used; i++)
-      fprintf(out, " <%u> [%d, %d]%s", nd->pt[i].tag, nd->pt[i].x, nd->pt[i].y,
-              (nd->pt[i].x < x0 || nd->pt[i].x >= x1 || nd->pt[i].y < y0 || nd->pt[i].y >= y1)
-              ? " **** OUTSIDE PARENT ****" : ""
-             );
-    fprintf(out, "\n");
-
-    int xm = (x0 + x1) / 2;
-    int ym = (y0 + y1) / 2;
-
-    _dump(nd->kids[0], out, depth + 1, x0, y0, xm,  ym);
-    _dump(nd->kids[1], out, depth + 1, xm, y0, x1,  ym);
-    _dump(nd->kids[2], out, depth + 1, x0, ym, xm,  y1);
-    _dump(nd->kids[3], out, depth + 1, xm, ym, x1,  y1);
+  if (qt) {
+    free(qt->nodes);
+    free(qt->pt);
+    free(qt->added_pt);
+    free(qt);
   }
 }
 
-void quadtree_dump(quadtree *qt, FILE *out) {
-  fprintf(out, "size: %dx%d, dim: %d\n", qt->w, qt->h, qt->dim);
-  _dump(qt->root, out, 1, 0, 0, qt->dim, qt->dim);
-}
-
-static quadtree_node *_add(quadtree_node *nd, const quadtree_point *pt, int x0, int y0, int x1, int y1) {
-  if (x0 == x1) die("Tree overloaded");
-
-  if (!nd) nd = alloc(sizeof(quadtree_node));
-
-  if (nd->internal) {
-    int xm = (x0 + x1) / 2;
-    int ym = (y0 + y1) / 2;
-    if (pt->x < xm && pt->y < ym)
-      nd->kids[0] = _add(nd->kids[0], pt, x0, y0, xm, ym);
-    else if (pt->x >= xm && pt->y < ym)
-      nd->kids[1] = _add(nd->kids[1], pt, xm, y0, x1, ym);
-    else if (pt->x < xm && pt->y >= ym)
-      nd->kids[2] = _add(nd->kids[2], pt, x0, ym, xm, y1);
-    else
-      nd->kids[3] = _add(nd->kids[3], pt, xm, ym, x1, y1);
-    return nd;
+static void _dump(const quadtree *qt, uint32_t idx, FILE *out, unsigned depth, int x0, int y0, int x1, int y1) {
+  const quadtree_node *nd = &qt->nodes[idx];
+  unsigned i;
+
+  for (i = 0; i < depth; i++) fprintf(out, "  ");
+  fprintf(out, "[%d, %d, %d, %d]", x0, y0, x1, y1);
+  if (nd->internal) fprintf(out, " internal");
+  for (i = 0; i < nd->used; i++) {
+    const quadtree_point *pt = &qt->pt[nd->first + i];
+    fprintf(out, " <%u> [%d, %d]%s", pt->tag, pt->x, pt->y,
+            (pt->x < x0 || pt->x >= x1 || pt->y < y0 || pt->y >= y1)
+            ? " **** OUTSIDE PARENT ****" : ""
+           );
   }
+  fprintf(out, "\n");
 
-  if (nd->used < quadtree_POINTS) {
-    nd->pt[nd->used++] = *pt;
-    return nd;
-  }
+  int xm = (x0 + x1) / 2;
+  int ym = (y0 + y1) / 2;
 
-  /* upgrade to internal node */
-  nd->internal = 1;
-  for (unsigned i = 0; i < nd->used; i++)
-    nd = _add(nd, &nd->pt[i], x0, y0, x1, y1);
-  nd->used = 0;
-  return _add(nd, pt, x0, y0, x1, y1);
+  if (nd->kids[0]) _dump(qt, nd->kids[0], out, depth + 1, x0, y0, xm,  ym);
+  if (nd->kids[1]) _dump(qt, nd->kids[1], out, depth + 1, xm, y0, x1,  ym);
+  if (nd->kids[2]) _dump(qt, nd->kids[2], out, depth + 1, x0, ym, xm,  y1);
+  if (nd->kids[3]) _dump(qt, nd->kids[3], out, depth + 1, xm, ym, x1,  y1);
+}
+
+void quadtree_dump(quadtree *qt, FILE *out) {
+  quadtree_index(qt);
+  fprintf(out, "size: %dx%d, dim: %d\n", qt->w, qt->h, qt->dim);
+  if (qt->n_nodes) _dump(qt, 0, out, 1, 0, 0, qt->dim, qt->dim);
 }
 
 int quadtree_add_point(quadtree *qt, const quadtree_point *pt) {
   qt->added++;
   if (pt->x >= 0 && pt->x < qt->w && pt->y >= 0 && pt->y <= qt->h) {
-    qt->root = _add(qt->root, pt, 0, 0, qt->dim, qt->dim);
-    qt->used++;
+    if (qt->used == qt->added_cap) {
+      qt->added_cap = qt->added_cap ? qt->added_cap * 2 : 256;
+      qt->added_pt = realloc(qt->added_pt, sizeof(quadtree_point) * qt->added_cap);
+      if (!qt->added_pt) die("Out of memory");
+    }
+    qt->added_pt[qt->used++] = *pt;
+    qt->dirty = 1;
     return 1;
   }
   return 0;
@@ -112,85 +108,300 @@ int quadtree_add(quadtree *qt, int x, int y, unsigned tag) {
   return quadtree_add_point(qt, &pt);
 }
 
+/* Building */
+
+/* A point on the bottom edge (y == h) may lie outside the tree. It goes
+ * wherever the last row would.
+ */
+static int _clamp(const quadtree *qt, int v) {
+  return v < qt->dim ? v : qt->dim - 1;
+}
+
+static uint64_t _morton(unsigned x, unsigned y) {
+  uint64_t code = 0;
+  for (unsigned bit = 0; bit < 32; bit++) {
+    code |= (uint64_t)((x >> bit) & 1) << (2 * bit);
+    code |= (uint64_t)((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return code;
+}
+
+static int cmp_key(const void *a, const void *b) {
+  const qt_key *ka = a;
+  const qt_key *kb = b;
+  if (ka->code != kb->code) return ka->code < kb->code ? -1 : 1;
+  return ka->order < kb->order ? -1 : ka->order > kb->order ? 1 : 0;
+}
+
+static uint32_t _new_node(quadtree *qt) {
+  if (qt->n_nodes == qt->nodes_cap) {
+    qt->nodes_cap = qt->nodes_cap ? qt->nodes_cap * 2 : 64;
+    qt->nodes = realloc(qt->nodes, sizeof(quadtree_node) * qt->nodes_cap);
+    if (!qt->nodes) die("Out of memory");
+  }
+  memset(&qt->nodes[qt->n_nodes], 0, sizeof(quadtree_node));
+  return (uint32_t) qt->n_nodes++;
+}
+
+/* Build the node for key[lo, hi), which all fall in the size x size
+ * square at x0, y0. Being in Morton order the points of each kid are
+ * contiguous and the kids come in kid order.
+ */
+static uint32_t _build(quadtree *qt, qt_key *key, size_t lo, size_t hi,
+                       size_t *next_pt, int x0, int y0, int size) {
+  uint32_t idx = _new_node(qt);
+
+  if (hi - lo <= quadtree_POINTS) {
+    /* a leaf keeps the order its points were added in */
+    for (size_t i = lo + 1; i < hi; i++) {
+      qt_key t = key[i];
+      size_t j = i;
+      for (; j > lo && key[j - 1].order > t.order; j--)
+        key[j] = key[j - 1];
+      key[j] = t;
+    }
+
+    qt->nodes[idx].first = (uint32_t) *next_pt;
+    qt->nodes[idx].used = (uint32_t)(hi - lo);
+    for (size_t i = lo; i < hi; i++)
+      qt->pt[(*next_pt)++] = qt->added_pt[key[i].order];
+    return idx;
+  }
+
+  if (size == 1) die("Tree overloaded");
+
+  qt->nodes[idx].internal = 1;
+
+  int half = size / 2;
+  size_t start = lo;
+  for (unsigned q = 0; q < 4; q++) {
+    int kx = x0 + ((q & 1) ? half : 0);
+    int ky = y0 + ((q & 2) ? half : 0);
+    size_t end = start;
+    while (end < hi) {
+      const quadtree_point *pt = &qt->added_pt[key[end].order];
+      int px = _clamp(qt, pt->x), py = _clamp(qt, pt->y);
+      if (px < kx || px >= kx + half || py < ky || py >= ky + half) break;
+      end++;
+    }
+    if (end > start) {
+      uint32_t kid = _build(qt, key, start, end, next_pt, kx, ky, half);
+      qt->nodes[idx].kids[q] = kid;
+    }
+    start = end;
+  }
+
+  return idx;
+}
+
+/* Index the points added so far. Queries do this when they need to;
+ * call it before sharing a tree between threads.
+ */
+void quadtree_index(quadtree *qt) {
+  if (!qt->dirty) return;
+
+  qt->n_nodes = 0;
+  free(qt->pt);
+  qt->pt = alloc(sizeof(quadtree_point) * (qt->used + 1));
+
+  qt_key *key = alloc(sizeof(qt_key) * (qt->used + 1));
+  for (uint32_t i = 0; i < qt->used; i++) {
+    const quadtree_point *pt = &qt->added_pt[i];
+    key[i].code = _morton(_clamp(qt, pt->x), _clamp(qt, pt->y));
+    key[i].order = i;
+  }
+  qsort(key, qt->used, sizeof(qt_key), cmp_key);
+
+  size_t next_pt = 0;
+  if (qt->used) _build(qt, key, 0, qt->used, &next_pt, 0, 0, qt->dim);
+
+  free(key);
+  qt->dirty = 0;
+}
+
+/* Searching */
+
 static int _dist(int x0, int y0, int x1, int y1) {
   int dx = x0 - x1;
   int dy = y0 - y1;
   return dx * dx + dy * dy;
 }
 
-struct nearest_work {
-  int best;
-  const quadtree_point *best_pt;
-  unsigned checked;
-};
-
-struct nearest_node {
-  quadtree_node *nd;
-  int x0, y0, x2, y2;
-  int dist;
-};
-
-static int node_dist(const struct nearest_node *nd, int x, int y) {
-  int dx = x < nd->x0 ? nd->x0 - x : x >= nd->x2 ? nd->x2 - x - 1 : 0;
-  int dy = y < nd->y0 ? nd->y0 - y : y >= nd->y2 ? nd->y2 - y - 1 : 0;
+static int node_dist(const qt_visit *v, int x, int y) {
+  int x2 = v->x0 + v->size, y2 = v->y0 + v->size;
+  int dx = x < v->x0 ? v->x0 - x : x >= x2 ? x2 - x - 1 : 0;
+  int dy = y < v->y0 ? v->y0 - y : y >= y2 ? y2 - y - 1 : 0;
   return dx * dx + dy * dy;
 }
 
-static int cmp_nn_dist(const void *a, const void *b) {
-  const struct nearest_node *an = a;
-  const struct nearest_node *bn = b;
-  return an->dist < bn->dist ? -1 : an->dist > bn->dist ? 1 : 0;
-}
-
-static void _nearest(const quadtree_node *nd, int x, int y,
-                     int x0, int y0, int x4, int y4,
-                     struct nearest_work *wrk) {
-  if (!nd) return;
-
-  if (nd->internal) {
-    struct nearest_node near[4];
-    unsigned near_used = 0;
-    unsigned i;
-
-    int kw = (x4 - x0) / 2;
-    int kh = (y4 - y0) / 2;
-    for (i = 0; i < 4; i++) {
-      if (!nd->kids[i]) continue;
-      int dx = (i & 1) ? kw : 0;
-      int dy = (i & 2) ? kh : 0;
-      near[near_used].nd = nd->kids[i];
-      near[near_used].x0 = x0 + dx;
-      near[near_used].y0 = y0 + dy;
-      near[near_used].x2 = near[near_used].x0 + kw;
-      near[near_used].y2 = near[near_used].y0 + kh;
-      near[near_used].dist = node_dist(&near[near_used], x, y);
-      near_used++;
+#define VISIT_AFTER(a, b) \
+  ((a)->dist > (b)->dist || ((a)->dist == (b)->dist && (a)->kid > (b)->kid))
+
+#define SORT2(i, j) do {                                                \
+    if (VISIT_AFTER(&kv[i], &kv[j])) {                                  \
+      qt_visit t = kv[i];                                               \
+      kv[i] = kv[j];                                                    \
+      kv[j] = t;                                                        \
+    }                                                                   \
+  } while (0)
+
+/* Push the kids of v, nearest to x, y on top. Ties go in kid order. */
+static size_t _push_kids(const quadtree *qt, const qt_visit *v, int x, int y, qt_visit *stack) {
+  const quadtree_node *nd = &qt->nodes[v->node];
+  qt_visit kv[4];
+  size_t n = 0;
+  int half = v->size / 2;
+
+  for (unsigned q = 0; q < 4; q++) {
+    kv[q].node = nd->kids[q];
+    kv[q].x0 = v->x0 + ((q & 1) ? half : 0);
+    kv[q].y0 = v->y0 + ((q & 2) ? half : 0);
+    kv[q].size = half;
+    kv[q].kid = q;
+    if (nd->kids[q]) {
+      kv[q].dist = node_dist(&kv[q], x, y);
+      n++;
+    }
+    else {
+      kv[q].dist = INT_MAX;
     }
+  }
+
+  /* keys are unique so the network is stable */
+  SORT2(0, 1);
+  SORT2(2, 3);
+  SORT2(0, 2);
+  SORT2(1, 3);
+  SORT2(1, 2);
+
+  for (size_t i = 0; i < n; i++)
+    stack[i] = kv[n - 1 - i];
+  return n;
+}
+
+static void _push_root(qt_visit *v) {
+  memset(v, 0, sizeof(*v));
+}
+
+/* Visits nodes in the order a recursive search would and keeps the
+ * first of equally near points, so the answer doesn't depend on how the
+ * search is done.
+ */
+const quadtree_point *quadtree_nearest(quadtree *qt, int x, int y) {
+  qt_visit stack[STACK_SIZE];
+  size_t sp = 0;
+  const quadtree_point *best_pt = NULL;
+  int best = 0;
+
+  quadtree_index(qt);
+  if (!qt->n_nodes) return NULL;
+
+  _push_root(&stack[sp++]);
+  stack[0].size = qt->dim;
 
-    qsort(near, near_used, sizeof(struct nearest_node), cmp_nn_dist);
+  while (sp) {
+    qt_visit v = stack[--sp];
+    if (best_pt && best < v.dist) continue;
+
+    const quadtree_node *nd = &qt->nodes[v.node];
+    if (nd->internal) {
+      sp += _push_kids(qt, &v, x, y, stack + sp);
+      continue;
+    }
 
-    for (i = 0; i < near_used; i++) {
-      if (wrk->best_pt && wrk->best < node_dist(&near[i], x, y)) break;
-      _nearest(near[i].nd, x, y, near[i].x0, near[i].y0, near[i].x2, near[i].y2, wrk);
+    const quadtree_point *pt = qt->pt + nd->first;
+    for (unsigned i = 0; i < nd->used; i++) {
+      int dist = _dist(x, y, pt[i].x, pt[i].y);
+      if (NULL == best_pt || dist < best) {
+        best = dist;
+        best_pt = &pt[i];
+      }
     }
   }
 
-  for (unsigned i = 0; i < nd->used; i++) {
-    int dist = _dist(x, y, nd->pt[i].x, nd->pt[i].y);
-    if (NULL == wrk->best_pt || dist < wrk->best) {
-      wrk->best = dist;
-      wrk->best_pt = &nd->pt[i];
+  return best_pt;
+}
+
+/* The k nearest points to x, y, nearest first, in pt. Returns how many
+ * were found. Equally near points come in the order quadtree_nearest()
+ * would prefer them.
+ */
+size_t quadtree_knearest(quadtree *qt, int x, int y,
+                         const quadtree_point **pt, size_t k) {
+  qt_visit stack[STACK_SIZE];
+  size_t sp = 0, found = 0;
+
+  quadtree_index(qt);
+  if (!qt->n_nodes || !k) return 0;
+
+  int *dist = alloc_no_clear(sizeof(int) * k);
+
+  _push_root(&stack[sp++]);
+  stack[0].size = qt->dim;
+
+  while (sp) {
+    qt_visit v = stack[--sp];
+    if (found == k && dist[k - 1] <= v.dist) continue;
+
+    const quadtree_node *nd = &qt->nodes[v.node];
+    if (nd->internal) {
+      sp += _push_kids(qt, &v, x, y, stack + sp);
+      continue;
+    }
+
+    const quadtree_point *lp = qt->pt + nd->first;
+    for (unsigned i = 0; i < nd->used; i++) {
+      int d = _dist(x, y, lp[i].x, lp[i].y);
+      if (found == k && d >= dist[k - 1]) continue;
+
+      size_t j = found < k ? found++ : k - 1;
+      for (; j > 0 && dist[j - 1] > d; j--) {
+        dist[j] = dist[j - 1];
+        pt[j] = pt[j - 1];
+      }
+      dist[j] = d;
+      pt[j] = &lp[i];
     }
   }
-  wrk->checked += nd->used;
+
+  free(dist);
+  return found;
 }
 
-const quadtree_point *quadtree_nearest(quadtree *qt, int x, int y) {
-  struct nearest_work work;
-  memset(&work, 0, sizeof(work));
-  _nearest(qt->root, x, y, 0, 0, qt->dim, qt->dim, &work);
-  /*  fprintf(stderr, "# checked %u\n", work.checked);*/
-  return work.best_pt;
+/* Points no further than radius from x, y in no particular order. Up
+ * to max of them go in pt; returns how many there are.
+ */
+size_t quadtree_within(quadtree *qt, int x, int y, int radius,
+                       const quadtree_point **pt, size_t max) {
+  qt_visit stack[STACK_SIZE];
+  size_t sp = 0, found = 0;
+  int limit = radius * radius;
+
+  quadtree_index(qt);
+  if (!qt->n_nodes || radius < 0) return 0;
+
+  _push_root(&stack[sp++]);
+  stack[0].size = qt->dim;
+
+  while (sp) {
+    qt_visit v = stack[--sp];
+    if (v.dist > limit) continue;
+
+    const quadtree_node *nd = &qt->nodes[v.node];
+    if (nd->internal) {
+      sp += _push_kids(qt, &v, x, y, stack + sp);
+      continue;
+    }
+
+    const quadtree_point *lp = qt->pt + nd->first;
+    for (unsigned i = 0; i < nd->used; i++) {
+      if (_dist(x, y, lp[i].x, lp[i].y) > limit) continue;
+      if (found < max) pt[found] = &lp[i];
+      found++;
+    }
+  }
+
+  return found;
 }
 
 unsigned quadtree_used(quadtree *qt) {
@@ -201,16 +412,9 @@ unsigned quadtree_added(quadtree *qt) {
   return qt->added;
 }
 
-static quadtree_point *_get(quadtree_node *nd, quadtree_point *pt) {
-  if (!nd) return pt;
-  for (unsigned i = 0; i < 4; i++)
-    pt = _get(nd->kids[i], pt);
-  memcpy(pt, nd->pt, sizeof(quadtree_point) * nd->used);
-  return pt + nd->used;
-}
-
 void quadtree_get(quadtree *qt, quadtree_point *pt) {
-  _get(qt->root, pt);
+  quadtree_index(qt);
+  memcpy(pt, qt->pt, sizeof(quadtree_point) * qt->used);
 }
 
 static int cmp_tag(const void *a, const void *b) {
@@ -7,8 +7,10 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <stdio.h>
 
+/* most points in a leaf */
 #define quadtree_POINTS 20
 
   typedef struct {
@@ -16,16 +18,31 @@ extern "C" {
     unsigned tag;
   } quadtree_point;
 
-  typedef struct quadtree_node quadtree_node;
-  struct quadtree_node {
-    quadtree_node *kids[4];
-    unsigned internal;
-    quadtree_point pt[quadtree_POINTS];
-    size_t used;
-  };
+  /* Nodes live in one pool and refer to their kids by index; 0 means no
+   * kid (the root, at 0, is nobody's kid). A leaf's points are
+   * pt[first, first + used).
+   */
+  typedef struct {
+    uint32_t kids[4];
+    uint32_t first, used;
+    uint32_t internal;
+  } quadtree_node;
 
+  /* Points are added to a list and indexed in bulk the next time the
+   * tree is queried. A node is split when more than quadtree_POINTS
+   * points fall in it and a leaf keeps its points in the order they were
+   * added, so the tree is the same shape it would be if they had been
+   * inserted one at a time.
+   */
   typedef struct {
-    quadtree_node *root;
+    quadtree_node *nodes;
+    size_t n_nodes, nodes_cap;
+    quadtree_point *pt;       /* in leaf order once indexed */
+
+    quadtree_point *added_pt; /* in the order added */
+    size_t added_cap;
+    int dirty;
+
     int w, h;
     int dim;
     unsigned used;
@@ -33,11 +50,17 @@ extern "C" {
   } quadtree;
 
   quadtree *quadtree_new(int w, int h);
+  quadtree *quadtree_build(int w, int h, const quadtree_point *pt, size_t n);
   void quadtree_free(quadtree *qt);
   int quadtree_add_point(quadtree *qt, const quadtree_point *pt);
   int quadtree_add(quadtree *qt, int x, int y, unsigned tag);
+  void quadtree_index(quadtree *qt);
   void quadtree_dump(quadtree *qt, FILE *out);
   const quadtree_point *quadtree_nearest(quadtree *qt, int x, int y);
+  size_t quadtree_knearest(quadtree *qt, int x, int y,
+                           const quadtree_point **pt, size_t k);
+  size_t quadtree_within(quadtree *qt, int x, int y, int radius,
+                         const quadtree_point **pt, size_t max);
   unsigned quadtree_used(quadtree *qt);
   unsigned quadtree_added(quadtree *qt);
   void quadtree_get(quadtree *qt, quadtree_point *pt);
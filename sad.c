@@ -0,0 +1,73 @@
+/* sad.c */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sad.h"
+
+#ifdef __SSE2__
+/* Add the two 64 bit lanes. _mm_cvtsi128_si64 would do but only exists
+ * on x86-64.
+ */
+static inline uint64_t _sum_lanes(__m128i v) {
+  uint64_t lane[2];
+  _mm_storeu_si128((__m128i *) lane, v);
+  return lane[0] + lane[1];
+}
+#endif
+
+/* Sum of absolute differences between two byte arrays */
+uint64_t sad_u8(const uint8_t *a, const uint8_t *b, size_t len) {
+  uint64_t sum = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  /* psadbw leaves two 16 bit sums per register so accumulating 64 bit
+   * lanes can't overflow
+   */
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  sum = _sum_lanes(acc);
+#endif
+
+  for (; i < len; i++)
+    sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+  return sum;
+}
+
+/* Sum of a byte array: its SAD from zero. Made for the short runs the
+ * voronoi sampler sums, so an 8 byte tail is done in one go too.
+ */
+uint64_t sad_sum_u8(const uint8_t *a, size_t len) {
+  uint64_t sum = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for (; i + 16 <= len; i += 16)
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)), zero));
+  if (i + 8 <= len) {
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i *)(a + i)), zero));
+    i += 8;
+  }
+  sum = _sum_lanes(acc);
+#endif
+
+  for (; i < len; i++)
+    sum += a[i];
+
+  return sum;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,23 @@
+/* sad.h */
+
+#ifndef SAD_H_
+#define SAD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+uint64_t sad_u8(const uint8_t *a, const uint8_t *b, size_t len);
+uint64_t sad_sum_u8(const uint8_t *a, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -2,9 +2,14 @@
 
 #include <ctype.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "log.h"
 #include "sampler.h"
 #include "util.h"
@@ -13,9 +18,11 @@ typedef struct sampler_info_list sampler_info_list;
 struct sampler_info_list {
   sampler_info_list *next;
   sampler_info i;
+  sampler_params *defaults;
 };
 
 static sampler_info_list *samplers = NULL;
+static sampler_context *shared = NULL;
 
 sampler_params *sampler_new_params() {
   return alloc(sizeof(sampler_params));
@@ -138,9 +145,21 @@ sampler_params *sampler_clone_params(const sampler_params *sp) {
   return _merge_params(NULL, sp);
 }
 
+/* Defaults are parsed once, here, and cloned for each sampler */
 void sampler_register(const sampler_info *info) {
   sampler_info_list *si = alloc(sizeof(sampler_info_list));
   memcpy(&si->i, info, sizeof(*info));
+
+  if (info->schema) {
+    for (const sampler_schema *ss = info->schema; ss->name; ss++)
+      if (ss->def)
+        si->defaults = sampler_set_param(si->defaults, ss->name, ss->def,
+                                         ss->type == sampler_NUMBER ? strtod(ss->def, NULL) : NAN);
+  }
+  else if (info->default_config) {
+    si->defaults = sampler_parse_params(info->default_config);
+  }
+
   si->next = samplers;
   samplers = si;
 }
@@ -152,6 +171,36 @@ static sampler_info_list *find_sampler(const char *name) {
   return NULL;
 }
 
+static const sampler_schema *_find_schema(const sampler_schema *ss, const char *name) {
+  for (; ss->name; ss++) if (0 == strcmp(name, ss->name)) return ss;
+  return NULL;
+}
+
+/* Check ctx's params against its schema and store their values in
+ * ctx->config. Text values point into ctx->params.
+ */
+static void _compile(sampler_context *ctx) {
+  const sampler_info *si = ctx->class;
+
+  for (sampler_params *pp = ctx->params; pp; pp = pp->next)
+    if (!_find_schema(si->schema, pp->name))
+      die("Unknown param %s for sampler %s", pp->name, si->name);
+
+  ctx->config = alloc(si->config_size);
+
+  for (const sampler_schema *ss = si->schema; ss->name; ss++) {
+    sampler_params *pp = sampler_find_param(ctx->params, ss->name);
+    char *field = (char *) ctx->config + ss->offset;
+    if (ss->type == sampler_NUMBER) {
+      if (pp && isnan(pp->value)) die("%s is not a number", ss->name);
+      *(double *) field = pp ? pp->value : NAN;
+    }
+    else {
+      *(const char **) field = pp ? pp->text : NULL;
+    }
+  }
+}
+
 /* Spec syntax:
  *
  *   <name>[:<params>]
@@ -181,14 +230,9 @@ sampler_context *sampler_new(const char *spec, const char *name) {
   ctx = alloc(sizeof(sampler_context));
   ctx->class = &si->i;
   ctx->name = sstrdup(name);
-
-  if (si->i.default_config)  {
-    ctx->params = sampler_merge_params(sampler_parse_params(si->i.default_config), sp);
-    sampler_free_params(sp);
-  }
-  else {
-    ctx->params = sp;
-  }
+  ctx->params = sampler_merge_params(si->defaults, sp);
+  sampler_free_params(sp);
+  if (si->i.schema) _compile(ctx);
 
   log_info("Sampler: %s", spec);
   for (sampler_params *pp = ctx->params; pp; pp = pp->next)
@@ -200,10 +244,55 @@ sampler_context *sampler_new(const char *spec, const char *name) {
   return ctx;
 }
 
+/* Is the sampler named by spec linear? Unknown samplers aren't. */
+int sampler_is_linear(const char *spec) {
+  size_t len = strcspn(spec, ":");
+  for (sampler_info_list *si  = samplers; si; si = si->next) {
+    if (strlen(si->i.name) == len && !memcmp(spec, si->i.name, len))
+      return si->i.linear;
+  }
+  return 0;
+}
+
+/* A shared sampler is initialised at w x h and may be handed to more
+ * than one caller. Every sample overwrites its one buffer, so each
+ * caller must use or copy the vector it gets before another holder
+ * samples, and none may project it. Samplers are the same if their
+ * canonical specs are.
+ */
+sampler_context *sampler_acquire(const char *spec, const char *name, unsigned w, unsigned h) {
+  sampler_context *ctx = sampler_new(spec, name);
+  uint64_t hash = sampler_hash(ctx);
+
+  for (sampler_context *sc = shared; sc; sc = sc->next_shared)
+    if (sc->hash == hash && sc->width == w && sc->height == h &&
+        !strcmp(sc->spec, ctx->spec)) {
+      sampler_free(ctx);
+      sc->refs++;
+      return sc;
+    }
+
+  sampler_init(ctx, w, h);
+  ctx->refs = 1;
+  ctx->next_shared = shared;
+  shared = ctx;
+  return ctx;
+}
+
 void sampler_free(sampler_context *ctx) {
   if (ctx) {
+    if (ctx->refs > 1) {
+      ctx->refs--;
+      return;
+    }
+    if (ctx->refs) {
+      sampler_context **scp = &shared;
+      while (*scp != ctx) scp = &(*scp)->next_shared;
+      *scp = ctx->next_shared;
+    }
     if (ctx->class->free) ctx->class->free(ctx);
     sampler_free_params(ctx->params);
+    free(ctx->config);
     free(ctx->name);
     free(ctx->buf);
     free(ctx->spec);
@@ -214,29 +303,348 @@ void sampler_free(sampler_context *ctx) {
 size_t sampler_init(sampler_context *ctx, unsigned w, unsigned h) {
   ctx->width = w;
   ctx->height = h;
-  if (ctx->class->init) return ctx->class->init(ctx);
-  return 0;
+  ctx->len = ctx->class->init ? ctx->class->init(ctx) : 0;
+  return ctx->len;
 }
 
+/* Sample a plane whose rows are packed */
 double *sampler_sample(sampler_context *ctx, const uint8_t *in) {
-  return ctx->class->sample(ctx, in);
+  return ctx->class->sample(ctx, in, ctx->width);
+}
+
+double *sampler_sample_stride(sampler_context *ctx, const uint8_t *in, unsigned stride) {
+  if (stride < ctx->width)
+    die("Sampler %s: stride %u is less than width %u", ctx->class->name, stride, ctx->width);
+  return ctx->class->sample(ctx, in, stride);
+}
+
+/* Sample n frames into the rows of out, ld doubles apart. stride may be
+ * NULL if every plane's rows are packed. Samplers that can't do a batch
+ * themselves sample a frame at a time.
+ */
+void sampler_sample_batch(sampler_context *ctx, const uint8_t *const *in,
+                          const unsigned *stride, size_t n,
+                          double *out, size_t ld) {
+  if (ctx->class->sample_batch) {
+    ctx->class->sample_batch(ctx, in, stride, n, out, ld);
+    return;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    memcpy(out + i * ld, ctx->class->sample(ctx, in[i], stride ? stride[i] : ctx->width),
+           sizeof(double) * ctx->len);
+}
+
+/* Samplers may cache what sampler_init() builds in dir, which defaults
+ * to $DOWNTOWN_CACHE. An empty dir turns caching off.
+ */
+static char *cache_dir = NULL;
+
+void sampler_set_cache(const char *dir) {
+  free(cache_dir);
+  cache_dir = sstrdup(dir);
+}
+
+/* The cache file for ctx's spec and size, or NULL if caching is off.
+ * The name is a hash, so the sampler must check the spec it finds.
+ */
+char *sampler_cache_file(sampler_context *ctx, const char *ext) {
+  const char *dir = cache_dir ? cache_dir : getenv("DOWNTOWN_CACHE");
+  if (!dir || !*dir) return NULL;
+
+  uint32_t dims[] = { ctx->width, ctx->height };
+  uint64_t h = fnv1a(sampler_hash(ctx), dims, sizeof(dims));
+
+  return ssprintf("%s/%s-%016llx.%s", dir, ctx->class->name, (unsigned long long) h, ext);
+}
+
+int sampler_can_project(const sampler_context *ctx) {
+  return ctx->class->project != NULL;
+}
+
+void sampler_project(sampler_context *ctx, unsigned w, unsigned h) {
+  if (!ctx->class->project)
+    die("Sampler %s can't be projected to %ux%u", ctx->class->name, w, h);
+  if (ctx->refs)
+    die("Shared sampler %s can't be projected", ctx->class->name);
+  if (w == ctx->width && h == ctx->height) return;
+  ctx->class->project(ctx, w, h);
+}
+
+/* Bulk sampler_byte2double. x - 128 and the scaling by a power of two
+ * are exact, so the vector and scalar paths agree to the bit.
+ */
+#ifdef __SSE2__
+/* Convert 16 bytes to pairs of doubles, lowest bytes in d[0] */
+static inline void _b2d16(__m128d d[8], const uint8_t *in) {
+  const __m128i bias = _mm_set1_epi8((char) 0x80);
+  const __m128d scale = _mm_set1_pd(1.0 / 128);
+
+  /* x ^ 0x80 is x - 128 as a signed byte; sign extend it by shifting */
+  __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in), bias);
+  __m128i w[2] = {
+    _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8),
+    _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8)
+  };
+
+  for (unsigned i = 0; i < 2; i++) {
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(w[i], w[i]), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(w[i], w[i]), 16);
+    d[i * 4 + 0] = _mm_mul_pd(_mm_cvtepi32_pd(lo), scale);
+    d[i * 4 + 1] = _mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(lo, lo)), scale);
+    d[i * 4 + 2] = _mm_mul_pd(_mm_cvtepi32_pd(hi), scale);
+    d[i * 4 + 3] = _mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(hi, hi)), scale);
+  }
+}
+#endif
+
+void sampler_bytes2double(double *out, const uint8_t *in, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    __m128d d[8];
+    _b2d16(d, in + i);
+    for (unsigned j = 0; j < 8; j++)
+      _mm_storeu_pd(out + i + j * 2, d[j]);
+  }
+#endif
+
+  for (; i < len; i++)
+    out[i] = sampler_byte2double(in[i]);
+}
+
+/* As sampler_bytes2double with out in reverse order */
+void sampler_bytes2double_reverse(double *out, const uint8_t *in, size_t len) {
+  double *op = out + len;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    __m128d d[8];
+    _b2d16(d, in + i);
+    for (unsigned j = 0; j < 8; j++)
+      _mm_storeu_pd(op - j * 2 - 2, _mm_shuffle_pd(d[j], d[j], 1));
+    op -= 16;
+  }
+#endif
+
+  for (; i < len; i++)
+    *--op = sampler_byte2double(in[i]);
+}
+
+/* Pyramids */
+
+typedef struct {
+  unsigned width, height;
+  uint8_t *plane;   /* level 0 is the caller's frame */
+} pyramid_level;
+
+struct sampler_pyramid {
+  pyramid_level *level;
+  unsigned n_levels;
+
+  sampler_context **ctx;
+  unsigned *ctx_level;
+  size_t n_ctx;
+
+  const uint8_t *in;
+  unsigned stride;
+  int made;         /* levels made from in */
+};
+
+sampler_pyramid *sampler_pyramid_new(unsigned w, unsigned h) {
+  sampler_pyramid *py = alloc(sizeof(sampler_pyramid));
+  py->level = alloc(sizeof(pyramid_level));
+  py->level[0].width = w;
+  py->level[0].height = h;
+  py->n_levels = 1;
+  return py;
 }
 
+void sampler_pyramid_free(sampler_pyramid *py) {
+  if (py) {
+    for (unsigned i = 1; i < py->n_levels; i++)
+      free(py->level[i].plane);
+    free(py->level);
+    free(py->ctx);
+    free(py->ctx_level);
+    free(py);
+  }
+}
+
+/* The level that is w x h, or -1 if none is */
+int sampler_pyramid_find(const sampler_pyramid *py, unsigned w, unsigned h) {
+  unsigned lw = py->level[0].width, lh = py->level[0].height;
+  for (int l = 0; lw && lh; l++, lw /= 2, lh /= 2)
+    if (lw == w && lh == h) return l;
+  return -1;
+}
+
+static void _pyramid_grow(sampler_pyramid *py, unsigned n_levels) {
+  if (n_levels <= py->n_levels) return;
+  py->level = realloc(py->level, sizeof(pyramid_level) * n_levels);
+  if (!py->level) die("Out of memory");
+  for (unsigned l = py->n_levels; l < n_levels; l++) {
+    pyramid_level *lv = &py->level[l];
+    lv->width = py->level[l - 1].width / 2;
+    lv->height = py->level[l - 1].height / 2;
+    lv->plane = alloc_no_clear((size_t) lv->width * lv->height);
+  }
+  py->n_levels = n_levels;
+  py->made = 0;
+}
+
+/* Attach an initialised sampler to the level of its size. */
+unsigned sampler_pyramid_attach(sampler_pyramid *py, sampler_context *ctx) {
+  int l = sampler_pyramid_find(py, ctx->width, ctx->height);
+  if (l < 0)
+    die("Sampler %s: %ux%u isn't a level of a %ux%u pyramid", ctx->class->name,
+        ctx->width, ctx->height, py->level[0].width, py->level[0].height);
+
+  _pyramid_grow(py, l + 1);
+
+  py->ctx = realloc(py->ctx, sizeof(sampler_context *) * (py->n_ctx + 1));
+  py->ctx_level = realloc(py->ctx_level, sizeof(unsigned) * (py->n_ctx + 1));
+  if (!py->ctx || !py->ctx_level) die("Out of memory");
+  py->ctx[py->n_ctx] = ctx;
+  py->ctx_level[py->n_ctx++] = l;
+
+  return l;
+}
+
+/* out[x] is the rounded mean of the 2x2 block at 2x in rows r0 and r1 */
+void sampler_pyramid_halve(uint8_t *out, const uint8_t *r0, const uint8_t *r1, unsigned w) {
+  unsigned x = 0;
+
+#ifdef __SSE2__
+  const __m128i lo = _mm_set1_epi16(0x00ff);
+  const __m128i two = _mm_set1_epi16(2);
+
+  for (; x + 16 <= w; x += 16) {
+    __m128i half[2];
+    for (unsigned i = 0; i < 2; i++) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(r0 + x * 2 + i * 16));
+      __m128i b = _mm_loadu_si128((const __m128i *)(r1 + x * 2 + i * 16));
+      __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, lo), _mm_srli_epi16(a, 8)),
+                                  _mm_add_epi16(_mm_and_si128(b, lo), _mm_srli_epi16(b, 8)));
+      half[i] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    }
+    _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(half[0], half[1]));
+  }
+#endif
+
+  for (; x < w; x++)
+    out[x] = (uint8_t)((r0[x * 2] + r0[x * 2 + 1] + r1[x * 2] + r1[x * 2 + 1] + 2) >> 2);
+}
+
+static const uint8_t *_pyramid_row(const sampler_pyramid *py, unsigned l, unsigned y) {
+  if (l == 0) return py->in + (size_t) y * py->stride;
+  return py->level[l].plane + (size_t) y * py->level[l].width;
+}
+
+/* Make every level in one pass down the frame: each pair of rows of a
+ * level makes a row of the next while they're still in cache.
+ */
+static void _pyramid_make(sampler_pyramid *py) {
+  for (unsigned y = 0; y < py->level[0].height; y++) {
+    unsigned ly = y;
+    for (unsigned l = 0; l + 1 < py->n_levels && (ly & 1); l++) {
+      pyramid_level *next = &py->level[l + 1];
+      sampler_pyramid_halve(next->plane + (size_t)(ly / 2) * next->width,
+                            _pyramid_row(py, l, ly - 1), _pyramid_row(py, l, ly),
+                            next->width);
+      ly /= 2;
+    }
+  }
+  py->made = 1;
+}
+
+/* Give the pyramid its next frame. Levels are made when they're first
+ * needed; in must stay put until then.
+ */
+void sampler_pyramid_frame(sampler_pyramid *py, const uint8_t *in, unsigned stride) {
+  py->in = in;
+  py->stride = stride;
+  py->made = 0;
+}
+
+const uint8_t *sampler_pyramid_level(sampler_pyramid *py, unsigned level) {
+  if (level >= py->n_levels) die("Pyramid has no level %u", level);
+  if (level == 0) return py->in;
+  if (!py->made) _pyramid_make(py);
+  return py->level[level].plane;
+}
+
+/* Sample the current frame with an attached sampler */
+double *sampler_pyramid_sample(sampler_pyramid *py, sampler_context *ctx) {
+  for (size_t i = 0; i < py->n_ctx; i++)
+    if (py->ctx[i] == ctx) {
+      unsigned l = py->ctx_level[i];
+      return ctx->class->sample(ctx, sampler_pyramid_level(py, l),
+                                l ? py->level[l].width : py->stride);
+    }
+  die("Sampler %s isn't attached to the pyramid", ctx->class->name);
+  return NULL;
+}
+
+static void _spec_param(char **buf, size_t *used, size_t *size,
+                        char joiner, const sampler_params *p) {
+  for (;;) {
+    size_t room = *size - *used;
+    int len = isnan(p->value)
+              ? snprintf(*buf + *used, room, "%c%s='%s'", joiner, p->name, p->text)
+              : snprintf(*buf + *used, room, "%c%s=%.17g", joiner, p->name, p->value);
+    if ((size_t) len < room) {
+      *used += len;
+      return;
+    }
+    *size = *used + len + 64;
+    char *nbuf = alloc_no_clear(*size);
+    memcpy(nbuf, *buf, *used + 1);
+    free(*buf);
+    *buf = nbuf;
+  }
+}
+
+/* The canonical spec: numbers are printed in full and text is quoted.
+ * Params a sampler's schema knows are listed in schema order so specs
+ * that differ only in order or formatting are the same.
+ */
 char *sampler_spec(sampler_context *ctx) {
   if (!ctx->spec) {
-    ctx->spec = sstrdup(ctx->class->name);
+    const sampler_schema *ss = ctx->class->schema;
+    size_t used = strlen(ctx->class->name), size = used + 128;
     char joiner = ':';
-    for (sampler_params *p = ctx->params; p; p = p->next) {
-      char *nspec = isnan(p->value)
-                    ?  ssprintf("%s%c%s='%s'", ctx->spec, joiner, p->name, p->text)
-                    :  ssprintf("%s%c%s=%.17g", ctx->spec, joiner, p->name, p->value) ;
-      joiner = ',';
-      free(ctx->spec);
-      ctx->spec = nspec;
+
+    ctx->spec = alloc_no_clear(size);
+    memcpy(ctx->spec, ctx->class->name, used + 1);
+
+    if (ss) {
+      for (; ss->name; ss++) {
+        sampler_params *p = sampler_find_param(ctx->params, ss->name);
+        if (!p) continue;
+        _spec_param(&ctx->spec, &used, &size, joiner, p);
+        joiner = ',';
+      }
+    }
+    else {
+      for (sampler_params *p = ctx->params; p; p = p->next) {
+        _spec_param(&ctx->spec, &used, &size, joiner, p);
+        joiner = ',';
+      }
     }
+
+    ctx->hash = fnv1a(FNV_OFFSET, ctx->spec, used + 1);
   }
   return ctx->spec;
 }
 
+/* A hash of the canonical spec, the same in every process */
+uint64_t sampler_hash(sampler_context *ctx) {
+  sampler_spec(ctx);
+  return ctx->hash;
+}
+
 /* vim:ts=2:sw=2:sts=2:et:ft=c
  */
@@ -7,6 +7,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define sampler_byte2double(x) ((((double) x) - 128) / 128)
@@ -21,16 +22,60 @@ struct sampler_params {
 
 typedef struct sampler_context sampler_context;
 
+typedef enum {
+  sampler_NUMBER,
+  sampler_TEXT
+} sampler_param_type;
+
+/* One entry of a sampler's parameter schema. The value is stored at
+ * offset in the config struct: a double for a number, a const char *
+ * for text. Params without a default are optional and are NAN or NULL
+ * when missing. A schema ends with an entry whose name is NULL.
+ */
+typedef struct {
+  const char *name;
+  sampler_param_type type;
+  const char *def;
+  size_t offset;
+} sampler_schema;
+
 typedef size_t (*sampler_init_func)(sampler_context *ctx);
-typedef double *(*sampler_sample_func)(sampler_context *ctx, const uint8_t *in);
+typedef double *(*sampler_sample_func)(sampler_context *ctx, const uint8_t *in, unsigned stride);
 typedef void (*sampler_free_func)(sampler_context *ctx);
-
+typedef void (*sampler_project_func)(sampler_context *ctx, unsigned w, unsigned h);
+typedef void (*sampler_sample_batch_func)(sampler_context *ctx, const uint8_t *const *in,
+    const unsigned *stride, size_t n,
+    double *out, size_t ld);
+
+/* A linear sampler's output is a fixed weighting of sampler_byte2double
+ * of its input pixels, so sampling the average or difference of two
+ * frames gives the average or difference of their samples.
+ *
+ * sample reads a width x height plane whose rows start stride bytes
+ * apart, so a window onto a larger or padded frame needs no copy.
+ *
+ * project, if present, retargets an initialised sampler at frames of
+ * another size without changing the layout of its output.
+ *
+ * sample_batch, if present, samples n frames into the rows of out, ld
+ * doubles apart. Row i of frame i's plane starts stride[i] bytes after
+ * the one before. Samplers without one are run a frame at a time.
+ *
+ * A sampler with a schema has its params checked and compiled into a
+ * config_size struct at ctx->config by sampler_new(). default_config is
+ * only used by samplers without a schema.
+ */
 typedef struct {
   const char *name;
   const char *default_config;
   sampler_init_func init;
   sampler_sample_func sample;
   sampler_free_func free;
+  sampler_project_func project;
+  sampler_sample_batch_func sample_batch;
+  const sampler_schema *schema;
+  size_t config_size;
+  int linear;
 } sampler_info;
 
 struct sampler_context {
@@ -38,9 +83,14 @@ struct sampler_context {
   char *name;
   sampler_params *params;
   unsigned width, height;
+  size_t len;   /* returned by init */
   double *buf;
   char *spec;
+  uint64_t hash;  /* of spec */
+  void *config;   /* compiled params */
   void *user;
+  unsigned refs;  /* non-zero if shared by sampler_acquire */
+  sampler_context *next_shared;
 };
 
 sampler_params *sampler_new_params();
@@ -58,10 +108,44 @@ void sampler_free_params(sampler_params *sp);
 void sampler_register(const sampler_info *info);
 
 sampler_context *sampler_new(const char *spec, const char *name);
+/* Returns an initialised sampler shared with every caller asking for the
+ * same canonical spec and size; sampler_free() drops one reference.
+ * Sampling writes the shared ctx->buf, so a holder must use or copy the
+ * returned vector before anyone else samples. It can't be projected.
+ */
+sampler_context *sampler_acquire(const char *spec, const char *name, unsigned w, unsigned h);
 void sampler_free(sampler_context *ctx);
 size_t sampler_init(sampler_context *ctx, unsigned w, unsigned h);
 double *sampler_sample(sampler_context *ctx, const uint8_t *in);
+double *sampler_sample_stride(sampler_context *ctx, const uint8_t *in, unsigned stride);
+void sampler_sample_batch(sampler_context *ctx, const uint8_t *const *in,
+                          const unsigned *stride, size_t n,
+                          double *out, size_t ld);
 char *sampler_spec(sampler_context *ctx);
+uint64_t sampler_hash(sampler_context *ctx);
+int sampler_is_linear(const char *spec);
+int sampler_can_project(const sampler_context *ctx);
+void sampler_set_cache(const char *dir);
+char *sampler_cache_file(sampler_context *ctx, const char *ext);
+void sampler_project(sampler_context *ctx, unsigned w, unsigned h);
+
+/* A pyramid halves a frame again and again with a 2x2 box filter.
+ * Samplers initialised at the size of one of its levels are attached to
+ * it and sample that level, so one frame feeds samplers of many sizes.
+ */
+typedef struct sampler_pyramid sampler_pyramid;
+
+sampler_pyramid *sampler_pyramid_new(unsigned w, unsigned h);
+void sampler_pyramid_free(sampler_pyramid *py);
+int sampler_pyramid_find(const sampler_pyramid *py, unsigned w, unsigned h);
+unsigned sampler_pyramid_attach(sampler_pyramid *py, sampler_context *ctx);
+void sampler_pyramid_frame(sampler_pyramid *py, const uint8_t *in, unsigned stride);
+const uint8_t *sampler_pyramid_level(sampler_pyramid *py, unsigned level);
+double *sampler_pyramid_sample(sampler_pyramid *py, sampler_context *ctx);
+void sampler_pyramid_halve(uint8_t *out, const uint8_t *r0, const uint8_t *r1, unsigned w);
+
+void sampler_bytes2double(double *out, const uint8_t *in, size_t len);
+void sampler_bytes2double_reverse(double *out, const uint8_t *in, size_t len);
 
 #ifdef __cplusplus
 }
@@ -135,5 +135,39 @@ y4m2_output *scale_filter(y4m2_output *next, unsigned width, unsigned height) {
   return y4m2_output_next(callback, ctx_new(next, width, height));
 }
 
+/* Scale a single 8 bit plane the way scale_filter scales luma */
+struct scale_plane {
+  unsigned dw;
+  unsigned sh;
+  struct SwsContext *swc;
+};
+
+scale_plane *scale_plane_new(unsigned sw, unsigned sh, unsigned dw, unsigned dh) {
+  scale_plane *sp = alloc(sizeof(scale_plane));
+  sp->dw = dw;
+  sp->sh = sh;
+  sp->swc = sws_getContext(sw, sh, AV_PIX_FMT_GRAY8, dw, dh, AV_PIX_FMT_GRAY8,
+                           SWS_BICUBIC, NULL, NULL, NULL);
+  if (!sp->swc) die("Failed to create scaling context");
+  return sp;
+}
+
+void scale_plane_free(scale_plane *sp) {
+  if (sp) {
+    sws_freeContext(sp->swc);
+    free(sp);
+  }
+}
+
+/* dst is dw x dh with no padding */
+void scale_plane_run(scale_plane *sp, uint8_t *dst, const uint8_t *src, unsigned stride) {
+  const uint8_t *src_plane[1] = { src };
+  int src_stride[1] = { (int) stride };
+  uint8_t *dst_plane[1] = { dst };
+  int dst_stride[1] = { (int) sp->dw };
+
+  sws_scale(sp->swc, src_plane, src_stride, 0, sp->sh, dst_plane, dst_stride);
+}
+
 /* vim:ts=2:sw=2:sts=2:et:ft=c
  */
@@ -9,8 +9,14 @@ extern "C" {
 
 #include "yuv4mpeg2.h"
 
+typedef struct scale_plane scale_plane;
+
 y4m2_output *scale_filter(y4m2_output *next, unsigned width, unsigned height);
 
+scale_plane *scale_plane_new(unsigned sw, unsigned sh, unsigned dw, unsigned dh);
+void scale_plane_free(scale_plane *sp);
+void scale_plane_run(scale_plane *sp, uint8_t *dst, const uint8_t *src, unsigned stride);
+
 #ifdef __cplusplus
 }
 #endif
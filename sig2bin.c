@@ -0,0 +1,179 @@
+/* sig2bin.c */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "profile.h"
+#include "sigfile.h"
+#include "signature.h"
+#include "util.h"
+
+#define PROG      "sig2bin"
+
+static int cfg_decode = 0;
+static char *cfg_format = NULL;
+static char *cfg_fps = NULL;
+static char *cfg_output = "-";
+static char *cfg_profile = NULL;
+
+static void usage() {
+  fprintf(stderr, "Usage: " PROG " [options] <in>\n\n"
+          "Convert downtown-sig text signatures to .sigb and back.\n\n"
+          "Options:\n"
+          "  -h, --help                See this message\n"
+          "  -d, --decode              Convert .sigb to text\n"
+          "  -f, --format <fmt>        bin (default) or rle; text (default) or hex with -d\n"
+          "  -F, --fps <num>:<den>     Frame rate to record\n"
+          "  -o, --output <file>       Output file (default stdout)\n"
+          "  -p, --profile <file>      Profile the signatures were made with\n"
+          "  -q, --quiet               No log output\n"
+          "\n"
+         );
+  exit(1);
+}
+
+static void parse_options(int *argc, char ***argv) {
+  int ch, oidx;
+
+  static struct option opts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"decode", no_argument, NULL, 'd'},
+    {"format", required_argument, NULL, 'f'},
+    {"fps", required_argument, NULL, 'F'},
+    {"output", required_argument, NULL, 'o'},
+    {"profile", required_argument, NULL, 'p'},
+    {"quiet", no_argument, NULL, 'q'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (ch = getopt_long(*argc, *argv, "df:F:ho:p:q", opts, &oidx), ch != -1) {
+    switch (ch) {
+
+    case 'd':
+      cfg_decode = 1;
+      break;
+
+    case 'f':
+      cfg_format = optarg;
+      break;
+
+    case 'F':
+      cfg_fps = optarg;
+      break;
+
+    case 'o':
+      cfg_output = optarg;
+      break;
+
+    case 'p':
+      cfg_profile = optarg;
+      break;
+
+    case 'q':
+      log_level = ERROR;
+      break;
+
+    case 'h':
+    default:
+      usage();
+      break;
+
+    }
+  }
+
+  *argc -= optind;
+  *argv += optind;
+}
+
+static FILE *openout(const char *filename) {
+  if (!strcmp(filename, "-")) return stdout;
+  FILE *fl = fopen(filename, "wb");
+  if (!fl) die("Can't write %s: %s", filename, strerror(errno));
+  return fl;
+}
+
+static void encode(const char *in, FILE *out) {
+  unsigned flags = 0;
+  unsigned fps_num = 0, fps_den = 0;
+  uint64_t hash = 0;
+
+  if (cfg_format && !strcmp(cfg_format, "rle")) flags |= sigfile_RLE;
+  else if (cfg_format && strcmp(cfg_format, "bin")) die("Unknown format: %s", cfg_format);
+
+  if (cfg_fps && sscanf(cfg_fps, "%u:%u", &fps_num, &fps_den) != 2)
+    die("Bad frame rate: %s", cfg_fps);
+
+  if (cfg_profile) {
+    profile *p = profile_load(cfg_profile);
+    hash = profile_hash(p);
+    profile_free(p);
+  }
+
+  FILE *fl = strcmp(in, "-") ? fopen(in, "r") : stdin;
+  if (!fl) die("Can't read %s: %s", in, strerror(errno));
+
+  sigfile_writer *sw = sigfile_writer_new(out, hash, fps_num, fps_den, flags);
+
+  char *line = NULL;
+  size_t size = 0;
+  unsigned long long frame, prev = 0;
+  char str[signature_LEN_BIN + 1];
+  unsigned count = 0;
+
+  while (getline(&line, &size, fl) >= 0) {
+    if (sscanf(line, "%llu %256s", &frame, str) != 2)
+      die("Bad signature line: %s", line);
+    if (count++ && frame != prev + 1)
+      log_warning("Frame %llu follows %llu; .sigb assumes consecutive frames", frame, prev);
+    prev = frame;
+
+    signature sig;
+    sigfile_write(sw, frame, signature_parse(&sig, str));
+  }
+
+  sigfile_writer_free(sw);
+  log_info("Converted %u signatures", count);
+
+  free(line);
+  if (fl != stdin) fclose(fl);
+}
+
+static void decode(const char *in, FILE *out) {
+  int hex = 0;
+
+  if (cfg_format && !strcmp(cfg_format, "hex")) hex = 1;
+  else if (cfg_format && strcmp(cfg_format, "text")) die("Unknown format: %s", cfg_format);
+
+  sigfile *sf = sigfile_open(in);
+
+  for (uint64_t i = 0; i < sf->frames; i++) {
+    char buf[signature_LEN_BIN + 1];
+    const signature *sig = sigfile_get(sf, i);
+    if (hex) signature_format_hex(sig, buf, sizeof(buf));
+    else signature_format_bin(sig, buf, sizeof(buf));
+    fprintf(out, "%14llu %s\n", (unsigned long long)(sf->hdr->first_frame + i), buf);
+  }
+
+  sigfile_close(sf);
+}
+
+int main(int argc, char *argv[]) {
+  parse_options(&argc, &argv);
+  if (argc != 1) usage();
+
+  FILE *out = openout(cfg_output);
+
+  if (cfg_decode) decode(argv[0], out);
+  else encode(argv[0], out);
+
+  if (out != stdout) fclose(out);
+
+  return 0;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,428 @@
+/* sigalign.c */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "sigalign.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "util.h"
+
+#define CHUNK     256
+
+/* rows of extra cost before a refined path is abandoned */
+#define WINDOW    16
+
+/* cost of a step off the diagonal */
+#define SKEW      1
+
+/* same rate, 2:1 frame merges and the usual pulldown / PAL speedup */
+static const double default_rates[] = {
+  1.0, 2.0, 0.5, 25.0 / 24.0, 24.0 / 25.0, 30.0 / 25.0, 25.0 / 30.0
+};
+
+void sigalign_defaults(sigalign_params *p) {
+  memset(p, 0, sizeof(*p));
+  p->k = 8;
+  p->radius = 16;
+  p->step = 2;
+  p->threads = 1;
+  p->rates = default_rates;
+  p->n_rates = sizeof(default_rates) / sizeof(default_rates[0]);
+  p->slop = 8;
+  p->min_votes = 3;
+  p->band = 16;
+  p->max_distance = 48;
+}
+
+/* Seeding: nearest reference frames for every step'th query frame */
+
+typedef struct {
+  const sigindex *idx;
+  const signature *query;
+  const sigalign_params *p;
+  size_t n_seeds;
+  sigindex_match *match;
+  size_t *count;
+  size_t next;
+  pthread_mutex_t mutex;
+} seed_context;
+
+static void *seed_worker(void *ctx) {
+  seed_context *sc = ctx;
+
+  for (;;) {
+    pthread_mutex_lock(&sc->mutex);
+    size_t from = sc->next;
+    sc->next += CHUNK;
+    pthread_mutex_unlock(&sc->mutex);
+
+    if (from >= sc->n_seeds) break;
+    size_t to = MIN(from + CHUNK, sc->n_seeds);
+
+    for (size_t s = from; s < to; s++)
+      sc->count[s] = sigindex_search(sc->idx, &sc->query[s * sc->p->step],
+                                     sc->p->radius, &sc->match[s * sc->p->k],
+                                     sc->p->k);
+  }
+
+  return NULL;
+}
+
+static void find_seeds(seed_context *sc) {
+  unsigned threads = MAX(sc->p->threads, 1);
+  pthread_t thread[threads];
+
+  pthread_mutex_init(&sc->mutex, NULL);
+  for (unsigned i = 0; i < threads; i++)
+    if (pthread_create(&thread[i], NULL, seed_worker, sc))
+      die("Can't create thread");
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join(thread[i], NULL);
+  pthread_mutex_destroy(&sc->mutex);
+}
+
+/* Voting: each seed votes for the diagonal it lies on under each rate */
+
+typedef struct {
+  unsigned file, rate;
+  int64_t bin;
+  uint64_t q, r;
+} vote;
+
+typedef struct {
+  unsigned file;
+  uint64_t q_lo, q_hi;
+  double offset, rate;
+  unsigned votes;
+} candidate;
+
+static int cmp_u64(uint64_t a, uint64_t b) {
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static int vote_cmp(const void *a, const void *b) {
+  const vote *va = a, *vb = b;
+  if (va->file != vb->file) return va->file < vb->file ? -1 : 1;
+  if (va->rate != vb->rate) return va->rate < vb->rate ? -1 : 1;
+  if (va->bin != vb->bin) return va->bin < vb->bin ? -1 : 1;
+  return cmp_u64(va->q, vb->q);
+}
+
+static int vote_cmp_bin(const vote *a, const vote *b) {
+  return a->file != b->file || a->rate != b->rate || a->bin != b->bin;
+}
+
+static int vote_q_cmp(const void *a, const void *b) {
+  const vote *va = a, *vb = b;
+  int c = cmp_u64(va->q, vb->q);
+  return c ? c : cmp_u64(va->r, vb->r);
+}
+
+static int candidate_cmp(const void *a, const void *b) {
+  const candidate *ca = a, *cb = b;
+  if (ca->votes != cb->votes) return ca->votes > cb->votes ? -1 : 1;
+  if (ca->rate != cb->rate) return ca->rate < cb->rate ? -1 : 1;
+  if (ca->file != cb->file) return ca->file < cb->file ? -1 : 1;
+  return cmp_u64(ca->q_lo, cb->q_lo);
+}
+
+/* Fit r = offset + rate * q to a run of votes sorted by q. Short runs
+ * keep the nominal rate.
+ */
+static void fit_line(const vote *v, size_t n, double nominal, candidate *c) {
+  double qm = 0, rm = 0, sqq = 0, sqr = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    qm += v[i].q;
+    rm += v[i].r;
+  }
+  qm /= n;
+  rm /= n;
+
+  for (size_t i = 0; i < n; i++) {
+    sqq += (v[i].q - qm) * (v[i].q - qm);
+    sqr += (v[i].q - qm) * (v[i].r - rm);
+  }
+
+  c->rate = nominal;
+  if (sqq > 0) {
+    double slope = sqr / sqq;
+    if (slope > nominal * 0.8 && slope < nominal * 1.25) c->rate = slope;
+  }
+  c->offset = rm - c->rate * qm;
+}
+
+/* Votes in a pair of adjacent bins, split where the query skips more
+ * than gap frames.
+ */
+static size_t add_candidates(vote *v, size_t n, const sigalign_params *p,
+                             candidate **cand, size_t *n_cand, size_t cap) {
+  uint64_t gap = (uint64_t) p->step * 32;
+
+  qsort(v, n, sizeof(vote), vote_q_cmp);
+
+  for (size_t lo = 0, hi; lo < n; lo = hi) {
+    unsigned votes = 1;
+    for (hi = lo + 1; hi < n && v[hi].q - v[hi - 1].q <= gap; hi++)
+      if (v[hi].q != v[hi - 1].q) votes++;
+
+    if (votes < p->min_votes) continue;
+
+    if (*n_cand == cap) {
+      cap = cap ? cap * 2 : 256;
+      *cand = realloc(*cand, sizeof(candidate) * cap);
+      if (!*cand) die("Out of memory");
+    }
+
+    candidate *c = &(*cand)[(*n_cand)++];
+    c->file = v[lo].file;
+    c->q_lo = v[lo].q;
+    c->q_hi = v[hi - 1].q;
+    c->votes = votes;
+    fit_line(v + lo, hi - lo, p->rates[v[lo].rate], c);
+  }
+
+  return cap;
+}
+
+static candidate *vote_diagonals(const seed_context *sc, size_t *n_cand) {
+  const sigalign_params *p = sc->p;
+  size_t n_votes = 0;
+
+  for (size_t s = 0; s < sc->n_seeds; s++)
+    n_votes += sc->count[s] * p->n_rates;
+
+  vote *v = alloc_no_clear(sizeof(vote) * (n_votes + 1));
+  vote *nv = v;
+
+  for (size_t s = 0; s < sc->n_seeds; s++) {
+    uint64_t q = s * p->step;
+    for (size_t m = 0; m < sc->count[s]; m++) {
+      const sigindex_match *sm = &sc->match[s * p->k + m];
+      for (unsigned rt = 0; rt < p->n_rates; rt++) {
+        nv->file = sm->file;
+        nv->rate = rt;
+        nv->bin = (int64_t) floor((sm->frame - p->rates[rt] * q) / p->slop);
+        nv->q = q;
+        nv->r = sm->frame;
+        nv++;
+      }
+    }
+  }
+
+  qsort(v, n_votes, sizeof(vote), vote_cmp);
+
+  /* a diagonal may straddle two bins so count each with its successor */
+  candidate *cand = NULL;
+  size_t cap = 0;
+  vote *tmp = alloc_no_clear(sizeof(vote) * (n_votes + 1));
+
+  *n_cand = 0;
+  for (size_t lo = 0, mid; lo < n_votes; lo = mid) {
+    for (mid = lo + 1; mid < n_votes && !vote_cmp_bin(&v[lo], &v[mid]); mid++)
+      ;
+    size_t hi = mid;
+    if (hi < n_votes && v[hi].file == v[lo].file && v[hi].rate == v[lo].rate
+        && v[hi].bin == v[lo].bin + 1)
+      while (hi < n_votes && !vote_cmp_bin(&v[mid], &v[hi])) hi++;
+
+    if (hi - lo < p->min_votes) continue;
+    memcpy(tmp, v + lo, sizeof(vote) * (hi - lo));
+    cap = add_candidates(tmp, hi - lo, p, &cand, n_cand, cap);
+  }
+
+  free(tmp);
+  free(v);
+
+  qsort(cand, *n_cand, sizeof(candidate), candidate_cmp);
+  return cand;
+}
+
+/* Refinement: a banded warp along the candidate's diagonal. Each query
+ * frame is paired with one reference frame within band of the line and
+ * the pairing may drift by one frame per row. The path runs on past the
+ * seeded range until its recent cost says the match has ended.
+ */
+
+static int covered(const sigalign_segment *seg, size_t n_seg, unsigned file,
+                   double q, double r, double tol) {
+  for (size_t i = 0; i < n_seg; i++) {
+    const sigalign_segment *s = &seg[i];
+    if (s->file != file || q < s->q_start || q >= s->q_end) continue;
+    if (fabs(s->offset + s->rate * q - r) <= tol) return 1;
+  }
+  return 0;
+}
+
+static int refine(const sigindex *idx, const signature *query, size_t n,
+                  const sigalign_params *p, const candidate *c,
+                  sigalign_segment *seg) {
+  const sigindex_file *f = &idx->files[c->file];
+  const signature *ref = sigindex_get(idx, c->file, 0);
+  if (!ref) return 0;
+
+  int64_t frames = (int64_t) f->frames;
+  unsigned width = 2 * p->band + 1;
+  uint64_t extend = (uint64_t) p->step * 4;
+  uint64_t q0 = c->q_lo > extend ? c->q_lo - extend : 0;
+  size_t max_rows = n - q0;
+
+  uint64_t *prev = alloc_no_clear(sizeof(uint64_t) * width);
+  uint64_t *cur = alloc_no_clear(sizeof(uint64_t) * width);
+  uint64_t *row_min = alloc_no_clear(sizeof(uint64_t) * max_rows);
+  int8_t *back = alloc_no_clear(sizeof(int8_t) * max_rows * width);
+  size_t rows = 0;
+
+  for (size_t i = 0; i < max_rows; i++) {
+    uint64_t q = q0 + i;
+    int64_t centre = llround(c->offset + c->rate * q) - p->band;
+    uint64_t best = UINT64_MAX;
+
+    for (unsigned b = 0; b < width; b++) {
+      int64_t j = centre + b;
+      uint64_t d = j < 0 || j >= frames ? signature_BITS
+                   : signature_distance(&query[q], &ref[j]);
+      int8_t from = 0;
+
+      if (i) {
+        uint64_t in = prev[b];
+        if (b > 0 && prev[b - 1] + SKEW < in) in = prev[b - 1] + SKEW, from = -1;
+        if (b + 1 < width && prev[b + 1] + SKEW < in) in = prev[b + 1] + SKEW, from = 1;
+        d += in;
+      }
+
+      cur[b] = d;
+      back[i * width + b] = from;
+      if (d < best) best = d;
+    }
+
+    row_min[i] = best;
+    rows = i + 1;
+
+    uint64_t *t = prev;
+    prev = cur;
+    cur = t;
+
+    /* early abandon once past the seeds */
+    if (q > c->q_hi && i >= WINDOW
+        && row_min[i] - row_min[i - WINDOW] > (uint64_t) p->max_distance * WINDOW)
+      break;
+  }
+
+  /* walk back from the cheapest cell of the last row */
+  int64_t *path = alloc_no_clear(sizeof(int64_t) * rows);
+  unsigned *dist = alloc_no_clear(sizeof(unsigned) * rows);
+  unsigned b = 0;
+  for (unsigned i = 1; i < width; i++)
+    if (prev[i] < prev[b]) b = i;
+
+  for (size_t i = rows; i-- > 0;) {
+    uint64_t q = q0 + i;
+    int64_t j = llround(c->offset + c->rate * q) - p->band + b;
+    path[i] = j;
+    dist[i] = j < 0 || j >= frames ? signature_BITS
+              : signature_distance(&query[q], &ref[j]);
+    b += back[i * width + b];
+  }
+
+  /* trim poorly matched ends */
+  size_t lo = 0, hi = rows;
+  while (lo < hi && dist[lo] > p->max_distance) lo++;
+  while (hi > lo && dist[hi - 1] > p->max_distance) hi--;
+
+  int found = 0;
+  if (hi - lo >= MAX(p->min_votes, 1)) {
+    uint64_t total = 0;
+    for (size_t i = lo; i < hi; i++) total += dist[i];
+
+    seg->file = c->file;
+    seg->q_start = q0 + lo;
+    seg->q_end = q0 + hi;
+    seg->r_start = path[lo];
+    seg->r_end = path[hi - 1] + 1;
+    seg->rate = hi - lo > 1
+                ? (double)(path[hi - 1] - path[lo]) / (hi - lo - 1) : c->rate;
+    seg->offset = path[lo] - seg->rate * seg->q_start;
+    seg->distance = (double) total / (hi - lo);
+    seg->confidence = MAX(0, 1 - seg->distance / (signature_BITS / 2));
+    seg->votes = c->votes;
+    found = seg->distance <= p->max_distance;
+  }
+
+  free(dist);
+  free(path);
+  free(back);
+  free(row_min);
+  free(cur);
+  free(prev);
+
+  return found;
+}
+
+static int segment_cmp(const void *a, const void *b) {
+  const sigalign_segment *sa = a, *sb = b;
+  int c = cmp_u64(sa->q_start, sb->q_start);
+  if (c) return c;
+  if (sa->file != sb->file) return sa->file < sb->file ? -1 : 1;
+  return cmp_u64(sa->r_start, sb->r_start);
+}
+
+/* Find stretches of query that appear in the indexed references. Up to
+ * max_seg segments are returned in query order; when there are more the
+ * best supported are kept.
+ */
+size_t sigalign_find(const sigindex *idx, const signature *query, size_t n,
+                     const sigalign_params *p, sigalign_segment *seg, size_t max_seg) {
+  seed_context sc;
+  size_t n_seg = 0, n_cand;
+
+  if (!n || !max_seg || !p->k || !p->step || !p->n_rates || !p->slop)
+    return 0;
+
+  memset(&sc, 0, sizeof(sc));
+  sc.idx = idx;
+  sc.query = query;
+  sc.p = p;
+  sc.n_seeds = (n + p->step - 1) / p->step;
+  sc.match = alloc_no_clear(sizeof(sigindex_match) * sc.n_seeds * p->k);
+  sc.count = alloc_no_clear(sizeof(size_t) * sc.n_seeds);
+
+  find_seeds(&sc);
+  candidate *cand = vote_diagonals(&sc, &n_cand);
+
+  log_debug("%llu seeds gave %llu candidate diagonals",
+            (unsigned long long) sc.n_seeds, (unsigned long long) n_cand);
+
+  double tol = p->slop + p->band;
+  for (size_t i = 0; i < n_cand && n_seg < max_seg; i++) {
+    const candidate *c = &cand[i];
+    double qm = (c->q_lo + c->q_hi) / 2.0;
+    if (covered(seg, n_seg, c->file, qm, c->offset + c->rate * qm, tol))
+      continue;
+
+    sigalign_segment *s = &seg[n_seg];
+    if (!refine(idx, query, n, p, c, s)) continue;
+
+    qm = (s->q_start + s->q_end) / 2.0;
+    if (covered(seg, n_seg, s->file, qm, s->offset + s->rate * qm, tol))
+      continue;
+
+    n_seg++;
+  }
+
+  qsort(seg, n_seg, sizeof(sigalign_segment), segment_cmp);
+
+  free(cand);
+  free(sc.count);
+  free(sc.match);
+
+  return n_seg;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
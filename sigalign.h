@@ -0,0 +1,55 @@
+/* sigalign.h */
+
+#ifndef SIGALIGN_H_
+#define SIGALIGN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sigindex.h"
+#include "signature.h"
+
+typedef struct {
+  /* seeding */
+  unsigned k;             /* index matches per seed frame */
+  unsigned radius;        /* largest seed distance */
+  unsigned step;          /* seed every step'th query frame */
+  unsigned threads;
+
+  /* voting */
+  const double *rates;    /* candidate reference / query frame rate ratios */
+  size_t n_rates;
+  unsigned slop;          /* offset bin width in reference frames */
+  unsigned min_votes;
+
+  /* refinement */
+  unsigned band;          /* warp either side of the diagonal */
+  unsigned max_distance;  /* mean distance at which a path is abandoned */
+} sigalign_params;
+
+typedef struct {
+  unsigned file;
+  uint64_t q_start, q_end;  /* query frames [q_start, q_end) */
+  uint64_t r_start, r_end;  /* frames within the reference file */
+  double offset, rate;      /* r ~= offset + rate * q */
+  double distance;          /* mean distance along the path */
+  double confidence;
+  unsigned votes;
+} sigalign_segment;
+
+void sigalign_defaults(sigalign_params *p);
+size_t sigalign_find(const sigindex *idx, const signature *query, size_t n,
+                     const sigalign_params *p, sigalign_segment *seg, size_t max_seg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
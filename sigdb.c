@@ -0,0 +1,401 @@
+/* sigdb.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sigdb.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "util.h"
+
+/* Signature databases (.sigdb)
+ *
+ * A sigdb_header followed by segments, each a self contained index
+ * part: a file table, the signature column, a map from signature to
+ * file and the part's hash tables, all sigdb_ALIGN aligned. Appending
+ * writes a new segment after the last and then bumps the header, so
+ * readers never see a partial segment and existing segments are never
+ * rewritten. Readers map the file read only and the tables are used in
+ * place, so processes searching the same database share its pages.
+ *
+ * Every segment carries a full set of tables however few signatures it
+ * holds, so many small appends waste space and slow searches down.
+ * Compacting rebuilds the database as one segment in a new file and
+ * renames it into place; readers keep the old file until they close it.
+ */
+#define sigdb_MAGIC     "DTSIGDB\0"
+#define sigdb_VERSION   1
+#define sigdb_BOM       0x01020304
+
+#define ALIGN_UP(x)     (((x) + sigdb_ALIGN - 1) & ~(uint64_t)(sigdb_ALIGN - 1))
+
+static void put(int fd, const char *filename, uint64_t off,
+                const void *data, size_t len) {
+  const char *p = data;
+  while (len) {
+    ssize_t got = pwrite(fd, p, len, (off_t) off);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      die("Can't write %s: %s", filename, strerror(errno));
+    }
+    p += got;
+    off += got;
+    len -= got;
+  }
+}
+
+int sigdb_is_db(const char *filename) {
+  char magic[8];
+  FILE *fl = fopen(filename, "rb");
+  if (!fl) die("Can't read %s: %s", filename, strerror(errno));
+  size_t got = fread(magic, 1, sizeof(magic), fl);
+  fclose(fl);
+  return got == sizeof(magic) && !memcmp(magic, sigdb_MAGIC, sizeof(magic));
+}
+
+static void check_header(const sigdb_header *hdr, const char *filename) {
+  if (memcmp(hdr->magic, sigdb_MAGIC, sizeof(hdr->magic)))
+    die("%s is not a signature database", filename);
+  if (hdr->bom != sigdb_BOM)
+    die("%s has the wrong byte order", filename);
+  if (hdr->version != sigdb_VERSION)
+    die("%s: unsupported version %u", filename, (unsigned) hdr->version);
+}
+
+/* Write one part of idx as a segment at off; returns its size */
+static uint64_t write_segment(int fd, const char *filename, uint64_t off,
+                              const sigindex *idx, const sigindex_part *part) {
+  sigdb_segment seg;
+  unsigned tables = signature_BITS / part->key_bits;
+
+  memset(&seg, 0, sizeof(seg));
+  seg.n_files = (uint32_t) part->n_files;
+  seg.n_sig = part->n_sig;
+  seg.key_bits = part->key_bits;
+  seg.n_tables = tables;
+
+  size_t names_len = 0;
+  for (size_t i = 0; i < part->n_files; i++)
+    names_len += strlen(idx->files[part->file_base + i].name) + 1;
+
+  uint64_t pos = ALIGN_UP(sizeof(seg));
+  seg.files = pos;
+  pos = ALIGN_UP(pos + sizeof(sigdb_file) * seg.n_files);
+  seg.names = pos;
+  pos = ALIGN_UP(pos + names_len);
+  seg.sig = pos;
+  pos = ALIGN_UP(pos + sizeof(signature) * seg.n_sig);
+  seg.map = pos;
+  pos = ALIGN_UP(pos + sizeof(uint32_t) * seg.n_sig);
+  for (unsigned t = 0; t < tables; t++) {
+    seg.start[t] = pos;
+    pos = ALIGN_UP(pos + sizeof(uint32_t) * (sigindex_BUCKETS + 1));
+    seg.ids[t] = pos;
+    pos = ALIGN_UP(pos + sizeof(uint32_t) * seg.n_sig);
+    if (part->low[t]) {
+      seg.low[t] = pos;
+      pos = ALIGN_UP(pos + sizeof(uint16_t) * seg.n_sig);
+    }
+  }
+  seg.size = pos;
+
+  sigdb_file *files = alloc(sizeof(sigdb_file) * (seg.n_files + 1));
+  char *names = alloc(names_len + 1);
+  uint32_t *map = alloc_no_clear(sizeof(uint32_t) * (seg.n_sig + 1));
+  size_t np = 0;
+
+  for (uint32_t i = 0; i < seg.n_files; i++) {
+    const sigindex_file *f = &idx->files[part->file_base + i];
+    files[i].first_frame = f->first_frame;
+    files[i].frames = f->frames;
+    files[i].base = f->base;
+    files[i].name = (uint32_t) np;
+    strcpy(names + np, f->name);
+    np += strlen(f->name) + 1;
+    for (uint64_t j = 0; j < f->frames; j++)
+      map[f->base + j] = i;
+  }
+
+  put(fd, filename, off, &seg, sizeof(seg));
+  put(fd, filename, off + seg.files, files, sizeof(sigdb_file) * seg.n_files);
+  put(fd, filename, off + seg.names, names, names_len);
+  put(fd, filename, off + seg.sig, part->sig, sizeof(signature) * seg.n_sig);
+  put(fd, filename, off + seg.map, map, sizeof(uint32_t) * seg.n_sig);
+  for (unsigned t = 0; t < tables; t++) {
+    put(fd, filename, off + seg.start[t], part->start[t],
+        sizeof(uint32_t) * (sigindex_BUCKETS + 1));
+    put(fd, filename, off + seg.ids[t], part->ids[t], sizeof(uint32_t) * seg.n_sig);
+    if (part->low[t])
+      put(fd, filename, off + seg.low[t], part->low[t], sizeof(uint16_t) * seg.n_sig);
+  }
+
+  free(map);
+  free(names);
+  free(files);
+
+  return seg.size;
+}
+
+/* Open and lock the database in filename, creating it if necessary.
+ * Compacting replaces the file, so a lock taken on the old one is
+ * dropped and taken again on the new.
+ */
+static int lock_db(const char *filename) {
+  for (;;) {
+    struct stat fst, nst;
+    int fd = open(filename, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) die("Can't write %s: %s", filename, strerror(errno));
+    if (flock(fd, LOCK_EX)) die("Can't lock %s: %s", filename, strerror(errno));
+    if (fstat(fd, &fst)) die("Can't stat %s: %s", filename, strerror(errno));
+    if (!stat(filename, &nst) && nst.st_dev == fst.st_dev && nst.st_ino == fst.st_ino)
+      return fd;
+    close(fd);
+  }
+}
+
+static void read_header(int fd, const char *filename, sigdb_header *hdr) {
+  ssize_t got = pread(fd, hdr, sizeof(*hdr), 0);
+  if (got == 0) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, sigdb_MAGIC, sizeof(hdr->magic));
+    hdr->version = sigdb_VERSION;
+    hdr->bom = sigdb_BOM;
+    hdr->size = ALIGN_UP(sizeof(*hdr));
+  }
+  else if (got != sizeof(*hdr)) {
+    die("%s is truncated", filename);
+  }
+  else {
+    check_header(hdr, filename);
+  }
+}
+
+/* Write every built part of idx after the segments in hdr and commit
+ * them by rewriting the header.
+ */
+static void write_parts(int fd, const char *filename, sigdb_header *hdr,
+                        const sigindex *idx) {
+  /* drop anything left by an interrupted append */
+  if (ftruncate(fd, (off_t) hdr->size))
+    die("Can't truncate %s: %s", filename, strerror(errno));
+
+  for (size_t p = 0; p < idx->n_parts; p++) {
+    hdr->size += write_segment(fd, filename, hdr->size, idx, &idx->parts[p]);
+    hdr->n_segments++;
+  }
+
+  /* the last segment's padding */
+  if (ftruncate(fd, (off_t) hdr->size))
+    die("Can't extend %s: %s", filename, strerror(errno));
+
+  if (fsync(fd)) die("Can't sync %s: %s", filename, strerror(errno));
+  put(fd, filename, 0, hdr, sizeof(*hdr));
+  if (fsync(fd)) die("Can't sync %s: %s", filename, strerror(errno));
+}
+
+/* Append every built part of idx to the database in filename, creating
+ * it if necessary. Concurrent appends are serialised with a lock.
+ */
+void sigdb_append(const char *filename, const sigindex *idx) {
+  sigdb_header hdr;
+
+  if (idx->n_pending) die("Build the index before saving it");
+
+  int fd = lock_db(filename);
+  read_header(fd, filename, &hdr);
+  write_parts(fd, filename, &hdr, idx);
+  close(fd);
+}
+
+/* Rebuild the database in filename as a single segment, or as few as
+ * the limit on signatures per part allows. Tables are built on up to
+ * threads threads.
+ */
+void sigdb_compact(const char *filename, unsigned threads) {
+  int fd = lock_db(filename);
+  sigdb *db = sigdb_open(filename);
+
+  if (db->n_segments < 2) {
+    log_info("%s is already compact", filename);
+    sigdb_close(db);
+    close(fd);
+    return;
+  }
+
+  sigindex *old = sigindex_new();
+  sigdb_load(db, old);
+
+  sigindex *idx = sigindex_new();
+  for (size_t i = 0; i < old->n_files; i++) {
+    const sigindex_file *f = &old->files[i];
+    if (idx->n_pending + f->frames > UINT32_MAX) sigindex_build(idx, threads);
+    sigindex_add(idx, f->name, f->first_frame, old->parts[f->part].sig + f->base,
+                 f->frames);
+  }
+  sigindex_build(idx, threads);
+
+  log_info("Compacting %llu segments of %s into %llu",
+           (unsigned long long) db->n_segments, filename,
+           (unsigned long long) idx->n_parts);
+
+  struct stat st;
+  if (fstat(fd, &st)) die("Can't stat %s: %s", filename, strerror(errno));
+
+  char *tmp_name = ssprintf("%s.compact", filename);
+  int tmp = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (tmp < 0) die("Can't write %s: %s", tmp_name, strerror(errno));
+  if (fchmod(tmp, st.st_mode & 07777))
+    die("Can't chmod %s: %s", tmp_name, strerror(errno));
+
+  sigdb_header hdr;
+  read_header(tmp, tmp_name, &hdr);
+  write_parts(tmp, tmp_name, &hdr, idx);
+  close(tmp);
+
+  if (rename(tmp_name, filename))
+    die("Can't rename %s to %s: %s", tmp_name, filename, strerror(errno));
+
+  free(tmp_name);
+  sigindex_free(idx);
+  sigindex_free(old);
+  sigdb_close(db);
+  close(fd);
+}
+
+static const void *at(const sigdb *db, const sigdb_segment *seg,
+                      uint64_t off, uint64_t len) {
+  if (off % sigdb_ALIGN || off > seg->size || len > seg->size - off)
+    die("%s is corrupt", db->filename);
+  return (const char *) seg + off;
+}
+
+sigdb *sigdb_open(const char *filename) {
+  sigdb *db = alloc(sizeof(sigdb));
+  db->filename = sstrdup(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) die("Can't read %s: %s", filename, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st)) die("Can't stat %s: %s", filename, strerror(errno));
+  if ((size_t) st.st_size < sizeof(sigdb_header)) die("%s is truncated", filename);
+
+  db->map_size = st.st_size;
+  db->map = mmap(NULL, db->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (db->map == MAP_FAILED) die("Can't map %s: %s", filename, strerror(errno));
+  close(fd);
+
+  const sigdb_header *hdr = db->hdr = db->map;
+  check_header(hdr, filename);
+  if (hdr->size > db->map_size) die("%s is truncated", filename);
+
+  db->n_segments = hdr->n_segments;
+  db->seg = alloc(sizeof(sigdb_segment *) * (db->n_segments + 1));
+
+  uint64_t pos = ALIGN_UP(sizeof(sigdb_header));
+  for (size_t i = 0; i < db->n_segments; i++) {
+    const sigdb_segment *seg = (const void *)((const char *) db->map + pos);
+    if (pos + sizeof(sigdb_segment) > hdr->size || seg->size > hdr->size - pos
+        || seg->size < sizeof(sigdb_segment) || seg->size % sigdb_ALIGN)
+      die("%s is corrupt", filename);
+    db->seg[i] = seg;
+    pos += seg->size;
+  }
+
+  return db;
+}
+
+void sigdb_close(sigdb *db) {
+  if (db) {
+    munmap(db->map, db->map_size);
+    free(db->seg);
+    free(db->filename);
+    free(db);
+  }
+}
+
+/* The tables are used in place, so check that nothing in them points
+ * outside the segment: files tile the signatures and the map agrees
+ * with them, every start table is a CSR row index ending at n_sig and
+ * every id is a signature.
+ */
+static int valid_part(const sigindex_part *part, const sigindex_file *files, size_t n_files) {
+  for (size_t i = 0; i < n_files; i++)
+    for (uint64_t j = 0; j < files[i].frames; j++)
+      if (part->file_map[files[i].base + j] != i) return 0;
+
+  for (unsigned t = 0; t < signature_BITS / part->key_bits; t++) {
+    const uint32_t *start = part->start[t];
+    if (start[0] != 0 || start[sigindex_BUCKETS] != part->n_sig) return 0;
+    for (uint32_t b = 0; b < sigindex_BUCKETS; b++)
+      if (start[b] > start[b + 1]) return 0;
+    for (uint32_t i = 0; i < part->n_sig; i++)
+      if (part->ids[t][i] >= part->n_sig) return 0;
+  }
+
+  return 1;
+}
+
+/* Add every segment of db to idx as a part. The index uses the mapped
+ * tables directly so db must stay open while idx is in use.
+ */
+void sigdb_load(const sigdb *db, sigindex *idx) {
+  for (size_t s = 0; s < db->n_segments; s++) {
+    const sigdb_segment *seg = db->seg[s];
+    sigindex_part part;
+
+    if ((seg->key_bits != 16 && seg->key_bits != 32)
+        || seg->n_tables != signature_BITS / seg->key_bits)
+      die("%s is corrupt", db->filename);
+
+    memset(&part, 0, sizeof(part));
+    part.n_sig = seg->n_sig;
+    part.key_bits = seg->key_bits;
+    part.sig = at(db, seg, seg->sig, sizeof(signature) * seg->n_sig);
+    part.file_map = at(db, seg, seg->map, sizeof(uint32_t) * seg->n_sig);
+    for (unsigned t = 0; t < seg->n_tables; t++) {
+      part.start[t] = at(db, seg, seg->start[t], sizeof(uint32_t) * (sigindex_BUCKETS + 1));
+      part.ids[t] = at(db, seg, seg->ids[t], sizeof(uint32_t) * seg->n_sig);
+      if (seg->key_bits > sigindex_PREFIX_BITS)
+        part.low[t] = at(db, seg, seg->low[t], sizeof(uint16_t) * seg->n_sig);
+    }
+
+    const sigdb_file *df = at(db, seg, seg->files, sizeof(sigdb_file) * seg->n_files);
+    const char *names = at(db, seg, seg->names, 0);
+    sigindex_file *files = alloc(sizeof(sigindex_file) * (seg->n_files + 1));
+    uint64_t next = 0;
+
+    for (uint32_t i = 0; i < seg->n_files; i++) {
+      if (df[i].name >= seg->size - seg->names
+          || !memchr(names + df[i].name, '\0', seg->size - seg->names - df[i].name)
+          || df[i].base != next || df[i].frames > seg->n_sig - df[i].base)
+        die("%s is corrupt", db->filename);
+      next += df[i].frames;
+      files[i].name = (char *) names + df[i].name;
+      files[i].first_frame = df[i].first_frame;
+      files[i].frames = df[i].frames;
+      files[i].base = df[i].base;
+    }
+    if (next != seg->n_sig) die("%s is corrupt", db->filename);
+
+    if (!valid_part(&part, files, seg->n_files)) die("%s is corrupt", db->filename);
+
+    sigindex_add_part(idx, &part, files, seg->n_files);
+    free(files);
+  }
+
+  log_debug("Loaded %llu segments from %s", (unsigned long long) db->n_segments,
+            db->filename);
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
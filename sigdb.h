@@ -0,0 +1,71 @@
+/* sigdb.h */
+
+#ifndef SIGDB_H_
+#define SIGDB_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sigindex.h"
+#include "signature.h"
+
+#define sigdb_ALIGN     64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint64_t n_segments;
+  uint64_t size;          /* bytes committed; anything after is a failed append */
+  uint64_t reserved[4];
+} sigdb_header;
+
+typedef struct {
+  uint64_t first_frame;
+  uint64_t frames;
+  uint32_t base;          /* first signature in the segment's column */
+  uint32_t name;          /* offset of the name in the segment's names */
+} sigdb_file;
+
+/* Offsets are from the start of the segment. */
+typedef struct {
+  uint64_t size;
+  uint32_t n_files, n_sig;
+  uint32_t key_bits, n_tables;
+  uint64_t files;         /* sigdb_file[n_files] */
+  uint64_t names;         /* NUL terminated */
+  uint64_t sig;           /* signature[n_sig] */
+  uint64_t map;           /* uint32_t[n_sig]: file of each signature */
+  uint64_t start[sigindex_MAX_TABLES];
+  uint64_t ids[sigindex_MAX_TABLES];
+  uint64_t low[sigindex_MAX_TABLES];
+} sigdb_segment;
+
+typedef struct {
+  char *filename;
+  void *map;
+  size_t map_size;
+  const sigdb_header *hdr;
+  size_t n_segments;
+  const sigdb_segment **seg;
+} sigdb;
+
+int sigdb_is_db(const char *filename);
+void sigdb_append(const char *filename, const sigindex *idx);
+void sigdb_compact(const char *filename, unsigned threads);
+sigdb *sigdb_open(const char *filename);
+void sigdb_close(sigdb *db);
+void sigdb_load(const sigdb *db, sigindex *idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,288 @@
+/* sigfile.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sigfile.h"
+#include "signature.h"
+#include "util.h"
+
+/* Binary signature files (.sigb)
+ *
+ * A sigfile_header followed by one record per frame - a bare signature
+ * - or, with sigfile_RLE, one sigfile_run per run of identical
+ * signatures. Everything is native byte order; bom tells a reader if
+ * the file came from a different architecture. Records cover
+ * consecutive output frames numbered from first_frame; a run's frame is
+ * in that numbering.
+ */
+#define sigfile_MAGIC     "DTSIGB\n\0"
+#define sigfile_VERSION   1
+#define sigfile_BOM       0x01020304
+
+static void put(sigfile_writer *w, const void *rec, size_t size) {
+  if (fwrite(rec, size, 1, w->fl) != 1)
+    die("Write failed: %s", strerror(errno));
+}
+
+sigfile_writer *sigfile_writer_new(FILE *fl, uint64_t profile_hash,
+                                   unsigned fps_num, unsigned fps_den,
+                                   unsigned flags) {
+  sigfile_writer *w = alloc(sizeof(sigfile_writer));
+  sigfile_header *hdr = &w->hdr;
+
+  w->fl = fl;
+  w->start = ftell(fl);
+
+  memcpy(hdr->magic, sigfile_MAGIC, sizeof(hdr->magic));
+  hdr->version = sigfile_VERSION;
+  hdr->bom = sigfile_BOM;
+  hdr->flags = flags;
+  hdr->record_size = (flags & sigfile_RLE) ? sizeof(sigfile_run) : sizeof(signature);
+  hdr->fps_num = fps_num;
+  hdr->fps_den = fps_den;
+  hdr->profile_hash = profile_hash;
+  hdr->frames = sigfile_UNKNOWN;
+
+  put(w, hdr, sizeof(*hdr));
+  hdr->frames = 0;
+
+  return w;
+}
+
+static int read_header(FILE *fl, sigfile_header *hdr, off_t *sizep) {
+  struct stat st;
+  if (fstat(fileno(fl), &st)) die("Can't stat output: %s", strerror(errno));
+  *sizep = st.st_size;
+  if ((size_t) st.st_size < sizeof(*hdr)) return 0;
+  if (fseeko(fl, 0, SEEK_SET) || fread(hdr, sizeof(*hdr), 1, fl) != 1)
+    die("Can't read output: %s", strerror(errno));
+  if (memcmp(hdr->magic, sigfile_MAGIC, sizeof(hdr->magic)) ||
+      hdr->bom != sigfile_BOM || hdr->version != sigfile_VERSION)
+    die("Output isn't a binary signature file this version can continue");
+  return 1;
+}
+
+/* The number of complete records in a partly written .sigb file open for
+ * update, or 0 if it hasn't got as far as a header.
+ */
+uint64_t sigfile_resumable(FILE *fl, uint64_t profile_hash) {
+  sigfile_header hdr;
+  off_t size;
+
+  if (!read_header(fl, &hdr, &size)) return 0;
+  if (hdr.flags & sigfile_RLE) die("Can't resume RLE output");
+  if (hdr.profile_hash != profile_hash)
+    die("Output was made with a different profile");
+
+  uint64_t n = (size - sizeof(hdr)) / sizeof(signature);
+  return hdr.frames != sigfile_UNKNOWN && hdr.frames < n ? hdr.frames : n;
+}
+
+/* Carry on writing a .sigb file after its first n records, dropping any
+ * that follow. The header is marked incomplete until the writer is
+ * freed.
+ */
+sigfile_writer *sigfile_writer_resume(FILE *fl, uint64_t n) {
+  sigfile_writer *w = alloc(sizeof(sigfile_writer));
+  sigfile_header *hdr = &w->hdr;
+  off_t size;
+
+  if (!read_header(fl, hdr, &size)) die("Output has no header to resume");
+  if (hdr->flags & sigfile_RLE) die("Can't resume RLE output");
+
+  w->fl = fl;
+  w->start = 0;
+
+  off_t end = (off_t)(sizeof(*hdr) + n * sizeof(signature));
+  if (end > size) die("Output is shorter than %llu records", (unsigned long long) n);
+
+  hdr->frames = sigfile_UNKNOWN;
+  if (fseeko(fl, 0, SEEK_SET)) die("Seek failed: %s", strerror(errno));
+  put(w, hdr, sizeof(*hdr));
+  fflush(fl);
+  if (ftruncate(fileno(fl), end)) die("Can't truncate output: %s", strerror(errno));
+  if (fseeko(fl, end, SEEK_SET)) die("Seek failed: %s", strerror(errno));
+
+  hdr->frames = n;
+  return w;
+}
+
+void sigfile_write(sigfile_writer *w, uint64_t frame, const signature *sig) {
+  if (w->hdr.frames++ == 0)
+    w->hdr.first_frame = frame;
+
+  if (!(w->hdr.flags & sigfile_RLE)) {
+    put(w, sig, sizeof(*sig));
+    return;
+  }
+
+  if (w->pending && !memcmp(&w->run.sig, sig, sizeof(*sig)))
+    return;
+
+  if (w->pending) put(w, &w->run, sizeof(w->run));
+  w->run.sig = *sig;
+  w->run.frame = w->hdr.first_frame + w->hdr.frames - 1;
+  w->pending = 1;
+}
+
+/* Flushes any pending run and fills in the header. If the file isn't
+ * seekable an RLE stream is closed with a copy of the last run starting
+ * at the final frame so readers can still count frames.
+ */
+void sigfile_writer_free(sigfile_writer *w) {
+  if (w) {
+    int seekable = w->start >= 0 && !fseek(w->fl, 0, SEEK_CUR);
+    if (w->pending) {
+      put(w, &w->run, sizeof(w->run));
+      uint64_t last = w->hdr.first_frame + w->hdr.frames - 1;
+      if (!seekable && w->run.frame != last) {
+        w->run.frame = last;
+        put(w, &w->run, sizeof(w->run));
+      }
+    }
+    if (seekable && !fseek(w->fl, w->start, SEEK_SET)) {
+      put(w, &w->hdr, sizeof(w->hdr));
+      fseek(w->fl, 0, SEEK_END);
+    }
+    fflush(w->fl);
+    free(w);
+  }
+}
+
+int sigfile_is_bin(const char *filename) {
+  char magic[8];
+  FILE *fl = fopen(filename, "rb");
+  if (!fl) die("Can't read %s: %s", filename, strerror(errno));
+  size_t got = fread(magic, 1, sizeof(magic), fl);
+  fclose(fl);
+  return got == sizeof(magic) && !memcmp(magic, sigfile_MAGIC, sizeof(magic));
+}
+
+sigfile *sigfile_open(const char *filename) {
+  sigfile *sf = alloc(sizeof(sigfile));
+  sf->filename = sstrdup(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) die("Can't read %s: %s", filename, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st)) die("Can't stat %s: %s", filename, strerror(errno));
+  if ((size_t) st.st_size < sizeof(sigfile_header)) die("%s is truncated", filename);
+
+  sf->map_size = st.st_size;
+  sf->map = mmap(NULL, sf->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (sf->map == MAP_FAILED) die("Can't map %s: %s", filename, strerror(errno));
+  close(fd);
+
+  const sigfile_header *hdr = sf->hdr = sf->map;
+  if (memcmp(hdr->magic, sigfile_MAGIC, sizeof(hdr->magic)))
+    die("%s is not a binary signature file", filename);
+  if (hdr->bom != sigfile_BOM)
+    die("%s has the wrong byte order", filename);
+  if (hdr->version != sigfile_VERSION)
+    die("%s: unsupported version %u", filename, (unsigned) hdr->version);
+
+  int rle = !!(hdr->flags & sigfile_RLE);
+  if (hdr->record_size != (rle ? sizeof(sigfile_run) : sizeof(signature)))
+    die("%s is corrupt", filename);
+
+  const void *rec = hdr + 1;
+  sf->n_rec = (sf->map_size - sizeof(*hdr)) / hdr->record_size;
+
+  if (rle) {
+    sf->run = rec;
+    if (hdr->frames != sigfile_UNKNOWN)
+      sf->frames = hdr->frames;
+    else if (sf->n_rec)
+      sf->frames = sf->run[sf->n_rec - 1].frame - hdr->first_frame + 1;
+  }
+  else {
+    sf->sig = rec;
+    sf->frames = sf->n_rec;
+    if (hdr->frames != sigfile_UNKNOWN && hdr->frames != sf->n_rec)
+      die("%s is corrupt", filename);
+  }
+
+  return sf;
+}
+
+void sigfile_close(sigfile *sf) {
+  if (sf) {
+    munmap(sf->map, sf->map_size);
+    free(sf->filename);
+    free(sf);
+  }
+}
+
+/* The signature of the idx'th frame in the file */
+const signature *sigfile_get(const sigfile *sf, uint64_t idx) {
+  if (idx >= sf->frames) return NULL;
+  if (sf->sig) return &sf->sig[idx];
+
+  uint64_t frame = sf->hdr->first_frame + idx;
+  size_t lo = 0, hi = sf->n_rec;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (sf->run[mid].frame <= frame) lo = mid;
+    else hi = mid;
+  }
+  return &sf->run[lo].sig;
+}
+
+/* Read a whole signature file - .sigb or downtown-sig text / hex -
+ * into memory. Returns the signatures; the count and the number of the
+ * first frame go in *np and *firstp.
+ */
+signature *sigfile_load(const char *filename, size_t *np, uint64_t *firstp) {
+  signature *sig = NULL;
+  size_t n = 0, cap = 0;
+  uint64_t first = 0;
+
+  if (sigfile_is_bin(filename)) {
+    sigfile *sf = sigfile_open(filename);
+    n = sf->frames;
+    sig = alloc_no_clear(sizeof(signature) * (n ? n : 1));
+    for (uint64_t i = 0; i < n; i++)
+      sig[i] = *sigfile_get(sf, i);
+    first = sf->hdr->first_frame;
+    sigfile_close(sf);
+  }
+  else {
+    FILE *fl = fopen(filename, "r");
+    if (!fl) die("Can't read %s: %s", filename, strerror(errno));
+
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, fl) >= 0) {
+      unsigned long long frame;
+      char str[signature_LEN_BIN + 1];
+      if (sscanf(line, "%llu %256s", &frame, str) != 2)
+        die("Bad signature line in %s: %s", filename, line);
+      if (n == cap) {
+        cap = cap ? cap * 2 : 1024;
+        sig = realloc(sig, sizeof(signature) * cap);
+        if (!sig) die("Out of memory");
+      }
+      if (n == 0) first = frame;
+      signature_parse(&sig[n++], str);
+    }
+
+    free(line);
+    fclose(fl);
+  }
+
+  *np = n;
+  if (firstp) *firstp = first;
+  return sig;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,81 @@
+/* sigfile.h */
+
+#ifndef SIGFILE_H_
+#define SIGFILE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "signature.h"
+
+#define sigfile_RLE       0x0001
+
+/* frames is sigfile_UNKNOWN if the writer couldn't seek back to fill it
+ * in; readers then count the records instead.
+ */
+#define sigfile_UNKNOWN   UINT64_MAX
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint32_t flags;
+  uint32_t record_size;
+  uint32_t fps_num, fps_den;
+  uint64_t profile_hash;
+  uint64_t first_frame;
+  uint64_t frames;
+  uint64_t reserved;
+} sigfile_header;
+
+/* An RLE record: sig applies from frame until the next record */
+typedef struct {
+  signature sig;
+  uint64_t frame;
+} sigfile_run;
+
+typedef struct {
+  FILE *fl;
+  sigfile_header hdr;
+  long start;
+  int pending;
+  sigfile_run run;
+} sigfile_writer;
+
+typedef struct {
+  char *filename;
+  void *map;
+  size_t map_size;
+  const sigfile_header *hdr;
+  const signature *sig;
+  const sigfile_run *run;
+  size_t n_rec;
+  uint64_t frames;
+} sigfile;
+
+sigfile_writer *sigfile_writer_new(FILE *fl, uint64_t profile_hash,
+                                   unsigned fps_num, unsigned fps_den,
+                                   unsigned flags);
+uint64_t sigfile_resumable(FILE *fl, uint64_t profile_hash);
+sigfile_writer *sigfile_writer_resume(FILE *fl, uint64_t n);
+void sigfile_write(sigfile_writer *w, uint64_t frame, const signature *sig);
+void sigfile_writer_free(sigfile_writer *w);
+
+int sigfile_is_bin(const char *filename);
+sigfile *sigfile_open(const char *filename);
+void sigfile_close(sigfile *sf);
+const signature *sigfile_get(const sigfile *sf, uint64_t idx);
+signature *sigfile_load(const char *filename, size_t *np, uint64_t *firstp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
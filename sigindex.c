@@ -0,0 +1,504 @@
+/* sigindex.c */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "log.h"
+#include "sigfile.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "util.h"
+
+#define PREFIX_MASK (sigindex_BUCKETS - 1)
+
+sigindex *sigindex_new(void) {
+  return alloc(sizeof(sigindex));
+}
+
+void sigindex_free(sigindex *idx) {
+  if (idx) {
+    for (unsigned i = 0; i < idx->n_files; i++)
+      free(idx->files[i].name);
+    free(idx->files);
+    free(idx->parts);
+    free(idx->pending);
+    for (unsigned i = 0; i < idx->n_owned; i++)
+      free(idx->owned[i]);
+    free(idx->owned);
+    free(idx);
+  }
+}
+
+static void *own(sigindex *idx, void *mem) {
+  idx->owned = realloc(idx->owned, sizeof(void *) * (idx->n_owned + 1));
+  if (!idx->owned) die("Out of memory");
+  return idx->owned[idx->n_owned++] = mem;
+}
+
+static unsigned n_tables(const sigindex_part *part) {
+  return signature_BITS / part->key_bits;
+}
+
+/* The t'th key_bits wide substring of sig */
+static uint32_t key_of(const signature *sig, unsigned key_bits, unsigned t) {
+  unsigned per_word = signature_WBITS / key_bits;
+  signature_word mask = ((signature_word) 1 << key_bits) - 1;
+  return (uint32_t)((sig->w[t / per_word] >> (t % per_word * key_bits)) & mask);
+}
+
+/* Files */
+
+unsigned sigindex_add(sigindex *idx, const char *name, uint64_t first_frame,
+                      const signature *sig, size_t n) {
+  if (idx->n_pending + n > UINT32_MAX)
+    die("Too many signatures for one index part");
+
+  if (idx->n_pending + n > idx->pending_cap) {
+    while (idx->n_pending + n > idx->pending_cap)
+      idx->pending_cap = idx->pending_cap ? idx->pending_cap * 2 : 65536;
+    idx->pending = realloc(idx->pending, sizeof(signature) * idx->pending_cap);
+    if (!idx->pending) die("Out of memory");
+  }
+
+  memcpy(idx->pending + idx->n_pending, sig, sizeof(signature) * n);
+
+  idx->files = realloc(idx->files, sizeof(sigindex_file) * (idx->n_files + 1));
+  if (!idx->files) die("Out of memory");
+
+  sigindex_file *f = &idx->files[idx->n_files];
+  f->name = sstrdup(name);
+  f->first_frame = first_frame;
+  f->frames = n;
+  f->part = idx->n_parts;
+  f->base = idx->n_pending;
+
+  idx->n_pending += n;
+  return idx->n_files++;
+}
+
+unsigned sigindex_add_file(sigindex *idx, const char *filename) {
+  size_t n;
+  uint64_t first;
+  signature *sig = sigfile_load(filename, &n, &first);
+  unsigned fn = sigindex_add(idx, filename, first, sig, n);
+  free(sig);
+  return fn;
+}
+
+/* Building */
+
+typedef struct {
+  sigindex_part *part;
+  uint32_t *start[sigindex_MAX_TABLES];
+  uint32_t *ids[sigindex_MAX_TABLES];
+  uint16_t *low[sigindex_MAX_TABLES];
+  unsigned next;
+  pthread_mutex_t mutex;
+} build_context;
+
+/* Stable counting sort of ids by a 16 bit digit of the t'th key */
+static void sort_digit(const sigindex_part *part, unsigned t, unsigned shift,
+                       const uint32_t *in, uint32_t *out, uint32_t *start) {
+  uint32_t *pos = alloc_no_clear(sizeof(uint32_t) * sigindex_BUCKETS);
+
+  memset(start, 0, sizeof(uint32_t) * (sigindex_BUCKETS + 1));
+  for (uint32_t i = 0; i < part->n_sig; i++)
+    start[((key_of(&part->sig[i], part->key_bits, t) >> shift) & PREFIX_MASK) + 1]++;
+  for (unsigned k = 0; k < sigindex_BUCKETS; k++)
+    start[k + 1] += start[k];
+
+  memcpy(pos, start, sizeof(uint32_t) * sigindex_BUCKETS);
+  for (uint32_t i = 0; i < part->n_sig; i++) {
+    uint32_t id = in ? in[i] : i;
+    out[pos[(key_of(&part->sig[id], part->key_bits, t) >> shift) & PREFIX_MASK]++] = id;
+  }
+
+  free(pos);
+}
+
+static void build_table(build_context *bc, unsigned t) {
+  const sigindex_part *part = bc->part;
+  unsigned shift = part->key_bits - sigindex_PREFIX_BITS;
+
+  if (!shift) {
+    sort_digit(part, t, 0, NULL, bc->ids[t], bc->start[t]);
+    return;
+  }
+
+  /* LSD radix sort: low digit, then prefix */
+  uint32_t *tmp = alloc_no_clear(sizeof(uint32_t) * part->n_sig);
+  sort_digit(part, t, 0, NULL, tmp, bc->start[t]);
+  sort_digit(part, t, shift, tmp, bc->ids[t], bc->start[t]);
+  free(tmp);
+
+  for (uint32_t i = 0; i < part->n_sig; i++)
+    bc->low[t][i] = (uint16_t) key_of(&part->sig[bc->ids[t][i]], part->key_bits, t);
+}
+
+static void *build_worker(void *ctx) {
+  build_context *bc = ctx;
+
+  for (;;) {
+    pthread_mutex_lock(&bc->mutex);
+    unsigned t = bc->next++;
+    pthread_mutex_unlock(&bc->mutex);
+    if (t >= n_tables(bc->part)) break;
+    build_table(bc, t);
+  }
+
+  return NULL;
+}
+
+/* Turn the files added since the last build into a new part. Tables are
+ * built in parallel on up to threads threads.
+ */
+void sigindex_build(sigindex *idx, unsigned threads) {
+  build_context bc;
+  sigindex_part part;
+
+  if (!idx->n_pending) return;
+
+  memset(&part, 0, sizeof(part));
+  part.n_sig = idx->n_pending;
+  part.key_bits = idx->key_bits ? idx->key_bits
+                  : part.n_sig >= sigindex_LONG_KEYS ? 32 : 16;
+  if (part.key_bits != 16 && part.key_bits != 32)
+    die("Index keys must be 16 or 32 bits");
+
+  part.sig = own(idx, realloc(idx->pending, sizeof(signature) * idx->n_pending));
+  part.file_base = idx->n_files;
+  while (part.file_base && idx->files[part.file_base - 1].part == idx->n_parts)
+    part.file_base--;
+  part.n_files = idx->n_files - part.file_base;
+
+  idx->pending = NULL;
+  idx->n_pending = idx->pending_cap = 0;
+
+  memset(&bc, 0, sizeof(bc));
+  bc.part = &part;
+  for (unsigned t = 0; t < n_tables(&part); t++) {
+    part.start[t] = bc.start[t] = own(idx, alloc_no_clear(sizeof(uint32_t) * (sigindex_BUCKETS + 1)));
+    part.ids[t] = bc.ids[t] = own(idx, alloc_no_clear(sizeof(uint32_t) * part.n_sig));
+    if (part.key_bits > sigindex_PREFIX_BITS)
+      part.low[t] = bc.low[t] = own(idx, alloc_no_clear(sizeof(uint16_t) * part.n_sig));
+  }
+
+  if (threads < 1) threads = 1;
+  if (threads > n_tables(&part)) threads = n_tables(&part);
+
+  pthread_t thread[threads];
+  pthread_mutex_init(&bc.mutex, NULL);
+  for (unsigned i = 0; i < threads; i++)
+    if (pthread_create(&thread[i], NULL, build_worker, &bc))
+      die("Can't create thread");
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join(thread[i], NULL);
+  pthread_mutex_destroy(&bc.mutex);
+
+  idx->parts = realloc(idx->parts, sizeof(sigindex_part) * (idx->n_parts + 1));
+  if (!idx->parts) die("Out of memory");
+  idx->parts[idx->n_parts++] = part;
+
+  log_debug("Indexed %llu signatures from %u files with %u bit keys",
+            (unsigned long long) part.n_sig, (unsigned) part.n_files, part.key_bits);
+}
+
+/* Add a part built elsewhere, typically mapped from a database. The
+ * part's arrays aren't copied and must outlive the index. files[i].base
+ * is the file's position in the part; the files are numbered after
+ * those already added. Returns the number of the first.
+ */
+unsigned sigindex_add_part(sigindex *idx, const sigindex_part *part,
+                           const sigindex_file *files, size_t n_files) {
+  if (idx->n_pending) die("Can't add a part while files are pending");
+  if (part->key_bits != 16 && part->key_bits != 32)
+    die("Index keys must be 16 or 32 bits");
+
+  unsigned first = idx->n_files;
+  idx->files = realloc(idx->files, sizeof(sigindex_file) * (idx->n_files + n_files));
+  if (!idx->files) die("Out of memory");
+
+  for (size_t i = 0; i < n_files; i++) {
+    sigindex_file *f = &idx->files[idx->n_files++];
+    *f = files[i];
+    f->name = sstrdup(files[i].name);
+    f->part = idx->n_parts;
+  }
+
+  idx->parts = realloc(idx->parts, sizeof(sigindex_part) * (idx->n_parts + 1));
+  if (!idx->parts) die("Out of memory");
+  sigindex_part *np = &idx->parts[idx->n_parts++];
+  *np = *part;
+  np->file_base = first;
+  np->n_files = n_files;
+
+  return first;
+}
+
+uint64_t sigindex_size(const sigindex *idx) {
+  uint64_t size = 0;
+  for (unsigned p = 0; p < idx->n_parts; p++)
+    size += idx->parts[p].n_sig;
+  return size;
+}
+
+const signature *sigindex_get(const sigindex *idx, unsigned file, uint64_t frame) {
+  if (file >= idx->n_files) return NULL;
+  const sigindex_file *f = &idx->files[file];
+  if (frame >= f->frames || f->part >= idx->n_parts) return NULL;
+  return &idx->parts[f->part].sig[f->base + frame];
+}
+
+/* Searching */
+
+typedef struct {
+  sigindex_match *m;
+  size_t n, k;
+  unsigned radius;
+} topk;
+
+static int match_cmp(const sigindex_match *a, const sigindex_match *b) {
+  if (a->distance != b->distance) return a->distance < b->distance ? -1 : 1;
+  if (a->file != b->file) return a->file < b->file ? -1 : 1;
+  if (a->frame != b->frame) return a->frame < b->frame ? -1 : 1;
+  return 0;
+}
+
+/* The largest distance still worth looking for */
+static unsigned topk_limit(const topk *tk) {
+  if (tk->n < tk->k) return tk->radius;
+  return MIN(tk->radius, tk->m[tk->n - 1].distance);
+}
+
+static void topk_insert(topk *tk, const sigindex_match *m) {
+  if (tk->n == tk->k && match_cmp(m, &tk->m[tk->n - 1]) >= 0) return;
+  size_t pos = tk->n < tk->k ? tk->n++ : tk->n - 1;
+  while (pos && match_cmp(m, &tk->m[pos - 1]) < 0) {
+    tk->m[pos] = tk->m[pos - 1];
+    pos--;
+  }
+  tk->m[pos] = *m;
+}
+
+static unsigned file_of(const sigindex *idx, const sigindex_part *part, uint32_t id) {
+  if (part->file_map) return (unsigned)(part->file_base + part->file_map[id]);
+
+  size_t lo = part->file_base, hi = part->file_base + part->n_files;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (idx->files[mid].base <= id) lo = mid;
+    else hi = mid;
+  }
+  return (unsigned) lo;
+}
+
+/* Next larger key mask with the same number of bits set */
+static uint64_t next_mask(uint64_t v) {
+  uint64_t t = v | (v - 1);
+  return (t + 1) | (((~t & -~t) - 1) >> (__builtin_ctzll(v) + 1));
+}
+
+/* A candidate turns up in every table, and at every level, where its
+ * substring is close enough. Only the table holding its closest
+ * substring, at exactly that level, gets to consider it.
+ */
+static void consider(const sigindex *idx, const sigindex_part *part, topk *tk,
+                     const signature *q, uint32_t id, unsigned t, unsigned level) {
+  const signature *s = &part->sig[id];
+  unsigned per_word = signature_WBITS / part->key_bits;
+  signature_word mask = ((signature_word) 1 << part->key_bits) - 1;
+  unsigned dist = 0, best = part->key_bits + 1, best_t = 0;
+
+  for (unsigned w = 0; w < signature_WCOUNT; w++) {
+    signature_word x = q->w[w] ^ s->w[w];
+    for (unsigned j = 0; j < per_word; j++) {
+      unsigned d = (unsigned) __builtin_popcountll((x >> (j * part->key_bits)) & mask);
+      if (d < best) {
+        best = d;
+        best_t = w * per_word + j;
+      }
+      dist += d;
+    }
+  }
+
+  if (best != level || best_t != t || dist > topk_limit(tk)) return;
+
+  sigindex_match m;
+  m.file = file_of(idx, part, id);
+  m.frame = id - idx->files[m.file].base;
+  m.distance = dist;
+  topk_insert(tk, &m);
+}
+
+static void probe(const sigindex *idx, const sigindex_part *part, topk *tk,
+                  const signature *q, unsigned t, unsigned level, uint32_t key) {
+  unsigned shift = part->key_bits - sigindex_PREFIX_BITS;
+  uint32_t lo = part->start[t][key >> shift];
+  uint32_t hi = part->start[t][(key >> shift) + 1];
+
+  if (shift) {
+    const uint16_t *low = part->low[t];
+    uint16_t want = (uint16_t) key;
+    uint32_t l = lo, h = hi;
+    while (l < h) {
+      uint32_t mid = l + (h - l) / 2;
+      if (low[mid] < want) l = mid + 1;
+      else h = mid;
+    }
+    for (lo = l; lo < hi && low[lo] == want; lo++)
+      consider(idx, part, tk, q, part->ids[t][lo], t, level);
+    return;
+  }
+
+  for (; lo < hi; lo++)
+    consider(idx, part, tk, q, part->ids[t][lo], t, level);
+}
+
+static void search_part(const sigindex *idx, const sigindex_part *part,
+                        const signature *q, topk *tk) {
+  unsigned tables = n_tables(part);
+  uint32_t qkey[sigindex_MAX_TABLES];
+  uint64_t limit = (uint64_t) 1 << part->key_bits;
+
+  for (unsigned t = 0; t < tables; t++)
+    qkey[t] = key_of(q, part->key_bits, t);
+
+  for (unsigned level = 0; level * tables <= topk_limit(tk) &&
+       level <= part->key_bits; level++) {
+    for (unsigned t = 0; t < tables; t++) {
+      for (uint64_t mask = ((uint64_t) 1 << level) - 1; mask < limit; ) {
+        probe(idx, part, tk, q, t, level, qkey[t] ^ (uint32_t) mask);
+        if (!mask) break;
+        mask = next_mask(mask);
+      }
+    }
+
+    /* everything closer than this has been seen */
+    if (tk->n == tk->k && tk->m[tk->n - 1].distance < (level + 1) * tables)
+      break;
+  }
+}
+
+/* Find up to k signatures within radius of query, nearest first. Returns
+ * the number found.
+ */
+size_t sigindex_search(const sigindex *idx, const signature *query, unsigned radius,
+                       sigindex_match *match, size_t k) {
+  topk tk;
+
+  if (!k) return 0;
+
+  tk.m = match;
+  tk.n = 0;
+  tk.k = k;
+  tk.radius = radius;
+
+  for (unsigned p = 0; p < idx->n_parts; p++)
+    search_part(idx, &idx->parts[p], query, &tk);
+
+  return tk.n;
+}
+
+/* Searching many */
+
+#define SEARCH_CHUNK 256
+
+typedef struct {
+  const sigindex *idx;
+  const signature *query;
+  size_t n, k;
+  unsigned radius;
+  sigindex_match *match;
+  size_t *count;
+  size_t next;
+  pthread_mutex_t mutex;
+} search_context;
+
+static void *search_worker(void *ctx) {
+  search_context *sc = ctx;
+
+  for (;;) {
+    pthread_mutex_lock(&sc->mutex);
+    size_t from = sc->next;
+    sc->next += SEARCH_CHUNK;
+    pthread_mutex_unlock(&sc->mutex);
+
+    if (from >= sc->n) break;
+    size_t to = MIN(from + SEARCH_CHUNK, sc->n);
+
+    for (size_t i = from; i < to; i++)
+      sc->count[i] = sigindex_search(sc->idx, &sc->query[i], sc->radius,
+                                     &sc->match[i * sc->k], sc->k);
+  }
+
+  return NULL;
+}
+
+/* sigindex_search for each of n queries, using threads threads. The
+ * matches for query i are match[i * k, i * k + count[i]).
+ */
+void sigindex_search_many(const sigindex *idx, const signature *query, size_t n,
+                          unsigned radius, sigindex_match *match, size_t *count,
+                          size_t k, unsigned threads) {
+  search_context sc;
+
+  memset(&sc, 0, sizeof(sc));
+  sc.idx = idx;
+  sc.query = query;
+  sc.n = n;
+  sc.k = k;
+  sc.radius = radius;
+  sc.match = match;
+  sc.count = count;
+
+  if (threads < 1) threads = 1;
+  pthread_t thread[threads];
+  pthread_mutex_init(&sc.mutex, NULL);
+  for (unsigned i = 0; i < threads; i++)
+    if (pthread_create(&thread[i], NULL, search_worker, &sc))
+      die("Can't create thread");
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join(thread[i], NULL);
+  pthread_mutex_destroy(&sc.mutex);
+}
+
+/* Look up every frame of a signature file and write a JSON line of
+ * matches for each to out.
+ */
+void sigindex_match_file(const sigindex *idx, const char *filename, unsigned radius,
+                         size_t k, unsigned threads, FILE *out) {
+  uint64_t first;
+  size_t n;
+
+  signature *query = sigfile_load(filename, &n, &first);
+  sigindex_match *match = alloc(sizeof(sigindex_match) * (n * k + 1));
+  size_t *count = alloc(sizeof(size_t) * (n + 1));
+
+  log_info("Matching %llu frames from %s", (unsigned long long) n, filename);
+  sigindex_search_many(idx, query, n, radius, match, count, k, threads);
+
+  for (size_t i = 0; i < n; i++) {
+    fputs("{\"query\":", out);
+    json_put_string(filename, out);
+    fprintf(out, ",\"frame\":%llu,\"matches\":[", (unsigned long long)(first + i));
+    for (size_t j = 0; j < count[i]; j++) {
+      const sigindex_match *m = &match[i * k + j];
+      const sigindex_file *f = &idx->files[m->file];
+      fprintf(out, "%s{\"file\":", j ? "," : "");
+      json_put_string(f->name, out);
+      fprintf(out, ",\"frame\":%llu,\"distance\":%u}",
+              (unsigned long long)(f->first_frame + m->frame), m->distance);
+    }
+    fputs("]}\n", out);
+  }
+
+  free(count);
+  free(match);
+  free(query);
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,109 @@
+/* sigindex.h */
+
+#ifndef SIGINDEX_H_
+#define SIGINDEX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "signature.h"
+
+/* Multi-index hashing: each signature is split into substrings of
+ * key_bits bits and indexed once per substring. Two signatures within
+ * distance r must agree to within r / tables bits on at least one
+ * substring. Short keys suit small parts; long keys keep the buckets of
+ * big ones sparse.
+ */
+#define sigindex_MAX_TABLES   16
+#define sigindex_PREFIX_BITS  16
+#define sigindex_BUCKETS      (1u << sigindex_PREFIX_BITS)
+
+/* parts at least this big get 32 bit keys */
+#define sigindex_LONG_KEYS    (1u << 20)
+
+typedef struct {
+  char *name;
+  uint64_t first_frame;   /* frame number of the file's first signature */
+  uint64_t frames;
+  unsigned part;
+  uint32_t base;          /* position of first signature in its part */
+} sigindex_file;
+
+/* A contiguous run of signatures with its own hash tables. ids[t] lists
+ * the signatures ordered by their t'th substring and start[t] is a CSR
+ * row index into it by the top sigindex_PREFIX_BITS of the key. With
+ * 32 bit keys low[t] holds the rest of each key for a binary search
+ * within the row. file_map, if present, gives the file (counted from
+ * file_base) of each signature. The arrays may belong to the index or
+ * point into a mapped database.
+ */
+typedef struct {
+  uint32_t n_sig;
+  unsigned key_bits;
+  const signature *sig;
+  const uint32_t *start[sigindex_MAX_TABLES];
+  const uint32_t *ids[sigindex_MAX_TABLES];
+  const uint16_t *low[sigindex_MAX_TABLES];
+  const uint32_t *file_map;
+  size_t file_base, n_files;
+} sigindex_part;
+
+typedef struct {
+  unsigned file;
+  uint64_t frame;         /* index within the file */
+  unsigned distance;
+} sigindex_match;
+
+typedef struct {
+  size_t n_files;
+  sigindex_file *files;
+
+  size_t n_parts;
+  sigindex_part *parts;
+
+  /* key size for the next build: 16, 32 or 0 to choose by size */
+  unsigned key_bits;
+
+  /* files added but not yet built into a part */
+  size_t n_pending;
+  signature *pending;
+  size_t pending_cap;
+
+  /* blocks freed with the index */
+  void **owned;
+  size_t n_owned;
+} sigindex;
+
+sigindex *sigindex_new(void);
+void sigindex_free(sigindex *idx);
+
+unsigned sigindex_add(sigindex *idx, const char *name, uint64_t first_frame,
+                      const signature *sig, size_t n);
+unsigned sigindex_add_file(sigindex *idx, const char *filename);
+void sigindex_build(sigindex *idx, unsigned threads);
+unsigned sigindex_add_part(sigindex *idx, const sigindex_part *part,
+                           const sigindex_file *files, size_t n_files);
+
+uint64_t sigindex_size(const sigindex *idx);
+const signature *sigindex_get(const sigindex *idx, unsigned file, uint64_t frame);
+size_t sigindex_search(const sigindex *idx, const signature *query, unsigned radius,
+                       sigindex_match *match, size_t k);
+void sigindex_search_many(const sigindex *idx, const signature *query, size_t n,
+                          unsigned radius, sigindex_match *match, size_t *count,
+                          size_t k, unsigned threads);
+void sigindex_match_file(const sigindex *idx, const char *filename, unsigned radius,
+                         size_t k, unsigned threads, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
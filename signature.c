@@ -4,19 +4,16 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "profile.h"
 #include "signature.h"
 #include "util.h"
 
-/*
- * https://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
- */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIGNATURE_X86
+#include <immintrin.h>
+#endif
 
-unsigned signature__count_bits(unsigned v) {
-  v = v - ((v >> 1) & (unsigned)~(unsigned)0 / 3);
-  v = (v & (unsigned)~(unsigned)0 / 15 * 3) + ((v >> 2) & (unsigned)~(unsigned)0 / 15 * 3);
-  v = (v + (v >> 4)) & (unsigned)~(unsigned)0 / 255 * 15;
-  return (unsigned)(v * ((unsigned)~(unsigned)0 / 255)) >> (sizeof(unsigned) - 1) * CHAR_BIT;
+unsigned signature__count_bits(signature_word v) {
+  return (unsigned) __builtin_popcountll(v);
 }
 
 unsigned signature_count(const signature *sig) {
@@ -32,10 +29,150 @@ signature *signature_xor(signature *out, const signature *a, const signature *b)
   return out;
 }
 
+/* Batch Hamming distance kernels. The best one the CPU supports is
+ * picked on first use.
+ */
+
+typedef void (*distance_func)(const signature *q, const signature *db,
+                              size_t n, unsigned *out);
+
+static void distance_generic(const signature *q, const signature *db,
+                             size_t n, unsigned *out) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned bits = 0;
+    for (unsigned w = 0; w < signature_WCOUNT; w++)
+      bits += signature__count_bits(q->w[w] ^ db[i].w[w]);
+    out[i] = bits;
+  }
+}
+
+#ifdef SIGNATURE_X86
+
+/* The same loop with the POPCNT instruction in place of the bit hack */
+__attribute__((target("popcnt")))
+static void distance_popcnt(const signature *q, const signature *db,
+                            size_t n, unsigned *out) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned bits = 0;
+    for (unsigned w = 0; w < signature_WCOUNT; w++)
+      bits += (unsigned) __builtin_popcountll(q->w[w] ^ db[i].w[w]);
+    out[i] = bits;
+  }
+}
+
+/* One signature per register; nibble lookup with vpshufb then vpsadbw
+ * to sum the byte counts.
+ */
+__attribute__((target("avx2")))
+static void distance_avx2(const signature *q, const signature *db,
+                          size_t n, unsigned *out) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  const __m256i qv = _mm256_loadu_si256((const __m256i *) q);
+
+  for (size_t i = 0; i < n; i++) {
+    __m256i x = _mm256_xor_si256(qv, _mm256_loadu_si256((const __m256i *) &db[i]));
+    __m256i cnt = _mm256_add_epi8(
+                    _mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                    _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+    __m256i sum = _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+    __m128i s2 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    out[i] = (unsigned)(_mm_cvtsi128_si64(s2) + _mm_extract_epi64(s2, 1));
+  }
+}
+
+/* Two signatures per register with a native 64 bit popcount */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void distance_avx512(const signature *q, const signature *db,
+                            size_t n, unsigned *out) {
+  const __m512i qv = _mm512_broadcast_i64x4(_mm256_loadu_si256((const __m256i *) q));
+  size_t i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m512i x = _mm512_xor_si512(qv, _mm512_loadu_si512((const void *) &db[i]));
+    __m512i cnt = _mm512_popcnt_epi64(x);
+    out[i] = (unsigned) _mm512_mask_reduce_add_epi64(0x0f, cnt);
+    out[i + 1] = (unsigned) _mm512_mask_reduce_add_epi64(0xf0, cnt);
+  }
+
+  if (i < n) {
+    __m512i x = _mm512_xor_si512(qv, _mm512_maskz_loadu_epi64(0x0f, (const void *) &db[i]));
+    out[i] = (unsigned) _mm512_mask_reduce_add_epi64(0x0f, _mm512_popcnt_epi64(x));
+  }
+}
+
+#endif
+
+static const struct {
+  const char *name;
+  distance_func func;
+  const char *feature;
+} impls[] = {
+#ifdef SIGNATURE_X86
+  { "avx512", distance_avx512, "avx512vpopcntdq" },
+  { "avx2", distance_avx2, "avx2" },
+  { "popcnt", distance_popcnt, "popcnt" },
+#endif
+  { "generic", distance_generic, NULL },
+};
+
+#define N_IMPL (sizeof(impls) / sizeof(impls[0]))
+
+static unsigned impl = N_IMPL;
+
+static int impl_supported(unsigned i) {
+#ifdef SIGNATURE_X86
+  __builtin_cpu_init();
+  if (impls[i].feature) {
+    if (!strcmp(impls[i].feature, "avx512vpopcntdq"))
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
+    if (!strcmp(impls[i].feature, "avx2"))
+      return __builtin_cpu_supports("avx2");
+    if (!strcmp(impls[i].feature, "popcnt"))
+      return __builtin_cpu_supports("popcnt");
+  }
+#endif
+  return !impls[i].feature;
+}
+
+static unsigned pick_impl(void) {
+  if (impl == N_IMPL) {
+    unsigned i = 0;
+    while (!impl_supported(i)) i++;
+    impl = i;
+  }
+  return impl;
+}
+
+/* Force a particular kernel; returns 0 if the CPU can't run it. For
+ * tests and benchmarks.
+ */
+int signature__use_impl(const char *name) {
+  for (unsigned i = 0; i < N_IMPL; i++)
+    if (!strcmp(impls[i].name, name)) {
+      if (!impl_supported(i)) return 0;
+      impl = i;
+      return 1;
+    }
+  die("Unknown signature distance kernel: %s", name);
+  return 0;
+}
+
+const char *signature_distance_impl(void) {
+  return impls[pick_impl()].name;
+}
+
+unsigned *signature_distance_many(const signature *query, const signature *db,
+                                  size_t n, unsigned *out) {
+  impls[pick_impl()].func(query, db, n, out);
+  return out;
+}
+
 unsigned signature_distance(const signature *a, const signature *b) {
-  signature tmp;
-  signature_xor(&tmp, a, b);
-  return signature_count(&tmp);
+  unsigned d;
+  impls[pick_impl()].func(a, b, 1, &d);
+  return d;
 }
 
 static signature *parse(signature *out, const char *str, unsigned base) {
@@ -50,7 +187,7 @@ static signature *parse(signature *out, const char *str, unsigned base) {
                     : (digit >= 'a' && digit <= 'f') ? (digit - 'a' + 10) : dmax;
 
       if (dv >= dmax) die("Bad digit in signature");
-      out->w[i] |= (dv << shift);
+      out->w[i] |= (signature_word) dv << shift;
     }
   }
   return out;
@@ -70,7 +207,7 @@ signature *signature_parse(signature *out, const char *str) {
 }
 
 static void format(const signature *sig, char *buf, size_t len, unsigned base) {
-  if (len <= (profile_SIGNATURE_BITS >> base))
+  if (len <= (signature_BITS >> base))
     die("Buffer too small");
 
   unsigned mask = (1u << base) - 1 ;
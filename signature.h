@@ -8,23 +8,31 @@ extern "C" {
 #endif
 
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-#include "profile.h"
+#define signature_BITS        256
 
-#define signature_WBITS       (sizeof(unsigned) * CHAR_BIT)
-#define signature_WCOUNT      (profile_SIGNATURE_BITS / signature_WBITS)
-#define signature_LEN_BIN     profile_SIGNATURE_BITS
+typedef uint64_t signature_word;
+
+#define signature_WBITS       (sizeof(signature_word) * CHAR_BIT)
+#define signature_WCOUNT      (signature_BITS / signature_WBITS)
+#define signature_LEN_BIN     signature_BITS
 #define signature_LEN_HEX     (signature_LEN_BIN / 4)
 
 typedef struct {
-  unsigned w[signature_WCOUNT];
+  signature_word w[signature_WCOUNT];
 } signature;
 
-unsigned signature__count_bits(unsigned v);
+unsigned signature__count_bits(signature_word v);
+int signature__use_impl(const char *name);
+const char *signature_distance_impl(void);
+
 unsigned signature_count(const signature *sig);
 signature *signature_xor(signature *out, const signature *a, const signature *b);
 unsigned signature_distance(const signature *a, const signature *b);
+unsigned *signature_distance_many(const signature *query, const signature *db,
+                                  size_t n, unsigned *out);
 
 signature *signature_parse(signature *out, const char *str);
 char *signature_format_bin(const signature *sig, char *buf, size_t len);
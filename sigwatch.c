@@ -0,0 +1,174 @@
+/* sigwatch.c */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "sigwatch.h"
+#include "util.h"
+
+void sigwatch_defaults(sigwatch_params *p) {
+  memset(p, 0, sizeof(*p));
+  p->k = 4;
+  p->radius = 24;
+  p->max_distance = 48;
+  p->min_frames = 5;
+  p->max_misses = 12;
+}
+
+sigwatch *sigwatch_new(const sigindex *idx, const sigwatch_params *p,
+                       sigwatch_callback cb, void *ctx) {
+  sigwatch *w = alloc(sizeof(sigwatch));
+  w->idx = idx;
+  if (p) w->p = *p;
+  else sigwatch_defaults(&w->p);
+  w->cb = cb;
+  w->ctx = ctx;
+  w->match = alloc(sizeof(sigindex_match) * (w->p.k + 1));
+  return w;
+}
+
+static void emit(sigwatch *w, const sigwatch_candidate *c,
+                 sigwatch_event_type type, uint64_t at) {
+  sigwatch_event ev;
+
+  ev.type = type;
+  ev.file = c->file;
+  ev.frame = type == sigwatch_START ? c->first : c->last + 1;
+  ev.ref_frame = type == sigwatch_START ? c->ref_first : ev.frame + c->offset;
+  ev.at = at;
+  ev.frames = c->last + 1 - c->first;
+  ev.distance = c->hits ? (double) c->total / c->hits : 0;
+
+  if (w->cb) w->cb(&ev, w->ctx);
+}
+
+static int file_started(const sigwatch *w, unsigned file) {
+  for (size_t i = 0; i < w->n_cand; i++)
+    if (w->cand[i].started && w->cand[i].file == file) return 1;
+  return 0;
+}
+
+/* Check a candidate against the frame it predicts, allowing it to slip a
+ * frame either way. Returns 0 once the candidate is dead.
+ */
+static int advance(sigwatch *w, sigwatch_candidate *c, uint64_t frame,
+                   const signature *sig) {
+  const sigindex_file *f = &w->idx->files[c->file];
+  unsigned best = signature_BITS + 1;
+  int slip = 0;
+
+  for (int s = 0; s <= 2; s++) {
+    int ds = s == 0 ? 0 : s == 1 ? -1 : 1;
+    int64_t j = (int64_t) frame + c->offset + ds;
+    if (j < 0 || (uint64_t) j >= f->frames) continue;
+    unsigned d = signature_distance(sig, sigindex_get(w->idx, c->file, j));
+    if (d < best) best = d, slip = ds;
+  }
+
+  if (best <= w->p.max_distance) {
+    c->offset += slip;
+    c->last = frame;
+    c->hits++;
+    c->total += best;
+    c->misses = 0;
+
+    if (!c->started && c->hits >= w->p.min_frames && !file_started(w, c->file)) {
+      c->started = 1;
+      emit(w, c, sigwatch_START, frame);
+    }
+    return 1;
+  }
+
+  if (++c->misses <= w->p.max_misses) return 1;
+  if (c->started) emit(w, c, sigwatch_STOP, frame);
+  return 0;
+}
+
+static int tracked(const sigwatch *w, unsigned file, int64_t offset) {
+  for (size_t i = 0; i < w->n_cand; i++) {
+    const sigwatch_candidate *c = &w->cand[i];
+    if (c->file == file && c->offset >= offset - 1 && c->offset <= offset + 1)
+      return 1;
+  }
+  return 0;
+}
+
+/* A slot for a new candidate. When the table is full the weakest
+ * candidate that hasn't started, the one with fewest hits and then the
+ * stalest, makes way: frames like black or slate match most of the
+ * references and would otherwise fill the table and crowd out a real
+ * item starting later.
+ */
+static sigwatch_candidate *new_candidate(sigwatch *w) {
+  if (w->n_cand < sigwatch_MAX_CANDIDATES) return &w->cand[w->n_cand++];
+
+  sigwatch_candidate *weak = NULL;
+  for (size_t i = 0; i < w->n_cand; i++) {
+    sigwatch_candidate *c = &w->cand[i];
+    if (c->started) continue;
+    if (!weak || c->hits < weak->hits || (c->hits == weak->hits && c->last < weak->last))
+      weak = c;
+  }
+
+  if (!weak && !w->full) {
+    log_warning("Watching %u started matches; ignoring new ones",
+                (unsigned) sigwatch_MAX_CANDIDATES);
+    w->full = 1;
+  }
+
+  return weak;
+}
+
+/* Feed the next frame of the stream. Existing candidates are checked
+ * directly against the frame they expect. The index is searched for
+ * every frame, even while a match is running, and hits that agree with
+ * an alignment already being followed are dropped rather than made into
+ * new candidates.
+ */
+void sigwatch_push(sigwatch *w, uint64_t frame, const signature *sig) {
+  size_t keep = 0;
+  for (size_t i = 0; i < w->n_cand; i++)
+    if (advance(w, &w->cand[i], frame, sig))
+      w->cand[keep++] = w->cand[i];
+  w->n_cand = keep;
+
+  size_t n = sigindex_search(w->idx, sig, w->p.radius, w->match, w->p.k);
+  for (size_t i = 0; i < n; i++) {
+    const sigindex_match *m = &w->match[i];
+    int64_t offset = (int64_t) m->frame - (int64_t) frame;
+    if (tracked(w, m->file, offset)) continue;
+
+    sigwatch_candidate *c = new_candidate(w);
+    if (!c) break;
+    memset(c, 0, sizeof(*c));
+    c->file = m->file;
+    c->offset = offset;
+    c->first = c->last = frame;
+    c->ref_first = m->frame;
+    c->hits = 1;
+    c->total = m->distance;
+
+    if (w->p.min_frames <= 1 && !file_started(w, c->file)) {
+      c->started = 1;
+      emit(w, c, sigwatch_START, frame);
+    }
+  }
+}
+
+/* Matches still running at the end of the stream are stopped */
+void sigwatch_free(sigwatch *w) {
+  if (w) {
+    for (size_t i = 0; i < w->n_cand; i++)
+      if (w->cand[i].started)
+        emit(w, &w->cand[i], sigwatch_STOP, w->cand[i].last);
+    free(w->match);
+    free(w);
+  }
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
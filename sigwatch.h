@@ -0,0 +1,79 @@
+/* sigwatch.h */
+
+#ifndef SIGWATCH_H_
+#define SIGWATCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sigindex.h"
+#include "signature.h"
+
+#define sigwatch_MAX_CANDIDATES 256
+
+typedef struct {
+  unsigned k;             /* index matches per frame */
+  unsigned radius;        /* largest distance for a new candidate */
+  unsigned max_distance;  /* largest distance that continues a match */
+  unsigned min_frames;    /* matching frames before a start is reported */
+  unsigned max_misses;    /* consecutive misses before a stop */
+} sigwatch_params;
+
+typedef enum {
+  sigwatch_START,
+  sigwatch_STOP
+} sigwatch_event_type;
+
+typedef struct {
+  sigwatch_event_type type;
+  unsigned file;
+  uint64_t frame;         /* first matching frame; first frame after a stop */
+  uint64_t ref_frame;     /* matching frame within the file */
+  uint64_t at;            /* frame whose arrival raised the event */
+  uint64_t frames;        /* frames matched so far */
+  double distance;        /* mean distance of the matched frames */
+} sigwatch_event;
+
+typedef void (*sigwatch_callback)(const sigwatch_event *ev, void *ctx);
+
+/* A possible alignment between the stream and one reference file. */
+typedef struct {
+  unsigned file;
+  int64_t offset;         /* reference frame - stream frame */
+  uint64_t first, last;   /* first and most recent matching frames */
+  uint64_t ref_first;     /* reference frame matching first */
+  uint64_t hits, total;
+  unsigned misses;
+  int started;
+} sigwatch_candidate;
+
+typedef struct {
+  const sigindex *idx;
+  sigwatch_params p;
+  sigwatch_callback cb;
+  void *ctx;
+
+  sigwatch_candidate cand[sigwatch_MAX_CANDIDATES];
+  size_t n_cand;
+  int full;               /* warned that every candidate has started */
+  sigindex_match *match;
+} sigwatch;
+
+void sigwatch_defaults(sigwatch_params *p);
+sigwatch *sigwatch_new(const sigindex *idx, const sigwatch_params *p,
+                       sigwatch_callback cb, void *ctx);
+void sigwatch_push(sigwatch *w, uint64_t frame, const signature *sig);
+void sigwatch_free(sigwatch *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,97 @@
+/* spectrum.c */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spectrum.h"
+#include "util.h"
+
+spectrum_sum *spectrum_sum_new(size_t len) {
+  spectrum_sum *ss = alloc(sizeof(spectrum_sum));
+  ss->len = len;
+  ss->sum = alloc(sizeof(double) * len);
+  ss->comp = alloc(sizeof(double) * len);
+  return ss;
+}
+
+void spectrum_sum_free(spectrum_sum *ss) {
+  if (ss) {
+    free(ss->sum);
+    free(ss->comp);
+    free(ss);
+  }
+}
+
+/* Neumaier's variant of Kahan summation */
+static void add(double *sum, double *comp, double x) {
+  double t = *sum + x;
+  if (fabs(*sum) >= fabs(x))
+    *comp += (*sum - t) + x;
+  else
+    *comp += (x - t) + *sum;
+  *sum = t;
+}
+
+void spectrum_sum_add(spectrum_sum *ss, const double *data) {
+  for (unsigned i = 0; i < ss->len; i++)
+    add(&ss->sum[i], &ss->comp[i],
+        data[i] > 0 ? log(data[i]) : spectrum_LOG_FLOOR);
+  ss->count++;
+}
+
+void spectrum_sum_merge(spectrum_sum *ss, const spectrum_sum *other) {
+  if (other->len != ss->len)
+    die("Can't merge spectra of length %u and %u",
+        (unsigned) ss->len, (unsigned) other->len);
+
+  for (unsigned i = 0; i < ss->len; i++) {
+    add(&ss->sum[i], &ss->comp[i], other->sum[i]);
+    ss->comp[i] += other->comp[i];
+  }
+  ss->count += other->count;
+}
+
+/* The mean in the linear domain: exp of the mean log */
+double *spectrum_sum_mean(const spectrum_sum *ss, double *out) {
+  for (unsigned i = 0; i < ss->len; i++)
+    out[i] = ss->count ? exp((ss->sum[i] + ss->comp[i]) / ss->count) : 0;
+  return out;
+}
+
+/* Pull the first plane out of a downtown-sig --raw record:
+ *
+ *   {"frame":0,"planes":[[1.5,2.25,...]]}
+ *
+ * Up to len values are stored in out. Returns the number of values in
+ * the plane, or 0 if the line isn't a spectrum record.
+ */
+size_t spectrum_parse_raw(const char *line, double *out, size_t len) {
+  const char *lp = strstr(line, "\"planes\"");
+  if (!lp) return 0;
+  lp += 8;
+
+  for (int depth = 0; depth < 2; lp++) {
+    if (*lp == '[') depth++;
+    else if (*lp != ':' && *lp != ' ') return 0;
+  }
+
+  size_t count = 0;
+  for (;;) {
+    char *ep;
+    while (*lp == ' ') lp++;
+    if (*lp == ']') break;
+    double v = strtod(lp, &ep);
+    if (ep == lp) die("Bad spectrum: %s", line);
+    if (count < len) out[count] = v;
+    count++;
+    for (lp = ep; *lp == ' '; lp++) ;
+    if (*lp == ',') lp++;
+    else if (*lp != ']') die("Bad spectrum: %s", line);
+  }
+
+  return count;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
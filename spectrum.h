@@ -0,0 +1,40 @@
+/* spectrum.h */
+
+#ifndef SPECTRUM_H_
+#define SPECTRUM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+/* Log of a magnitude that isn't positive */
+#define spectrum_LOG_FLOOR -100
+
+/* Compensated running sum of log spectra. Sums built separately can be
+ * merged without losing precision, so a corpus can be split between
+ * threads.
+ */
+typedef struct {
+  size_t len;
+  unsigned long long count;
+  double *sum, *comp;
+} spectrum_sum;
+
+spectrum_sum *spectrum_sum_new(size_t len);
+void spectrum_sum_free(spectrum_sum *ss);
+void spectrum_sum_add(spectrum_sum *ss, const double *data);
+void spectrum_sum_merge(spectrum_sum *ss, const spectrum_sum *other);
+double *spectrum_sum_mean(const spectrum_sum *ss, double *out);
+
+size_t spectrum_parse_raw(const char *line, double *out, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
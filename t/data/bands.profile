@@ -0,0 +1,32 @@
+{
+   "bands" : [
+      2,
+      4,
+      8,
+      9,
+      16
+   ],
+   "baseline" : [
+      [
+         10,
+         9,
+         8,
+         7,
+         6,
+         5,
+         4,
+         3,
+         3,
+         4,
+         5,
+         6,
+         7,
+         8,
+         9,
+         10
+      ]
+   ],
+   "height" : 256,
+   "sampler" : "spiral:a_rate=5,r_rate=5",
+   "width" : 256
+}
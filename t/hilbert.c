@@ -0,0 +1,128 @@
+/* t/hilbert.c */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "framework.h"
+#include "hilbert.h"
+#include "sampler.h"
+#include "tap.h"
+#include "util.h"
+
+static uint8_t unbyte(double v) {
+  return (uint8_t)(v * 128 + 128);
+}
+
+/* Every pixel once, and each step of the curve to a neighbour */
+static void test_curve(unsigned w, unsigned h) {
+  uint8_t xs[w * h], ys[w * h];
+  unsigned seen[w * h];
+
+  for (unsigned y = 0; y < h; y++)
+    for (unsigned x = 0; x < w; x++) {
+      xs[x + y * w] = (uint8_t) x;
+      ys[x + y * w] = (uint8_t) y;
+    }
+
+  sampler_context *ctx = sampler_new("hilbert", "hilbert");
+  size_t size = sampler_init(ctx, w, h);
+  ok(size == w * h, "%u x %u: size %llu", w, h, (unsigned long long) size);
+
+  double *cx = alloc(sizeof(double) * size);
+  memcpy(cx, sampler_sample(ctx, xs), sizeof(double) * size);
+  double *cy = sampler_sample(ctx, ys);
+
+  memset(seen, 0, sizeof(seen));
+  int adjacent = 1, once = 1;
+  for (size_t i = 0; i < size; i++) {
+    unsigned x = unbyte(cx[i]), y = unbyte(cy[i]);
+    seen[x + y * w]++;
+    if (i) {
+      int dx = abs((int) x - (int) unbyte(cx[i - 1]));
+      int dy = abs((int) y - (int) unbyte(cy[i - 1]));
+      if (dx + dy != 1) adjacent = 0;
+    }
+  }
+  for (size_t i = 0; i < w * h; i++)
+    if (seen[i] != 1) once = 0;
+
+  ok(once, "%u x %u: every pixel once", w, h);
+  /* outside the curve's square the order skips pixels */
+  if (w == h && !(w & (w - 1)))
+    ok(adjacent, "%u x %u: steps to neighbours", w, h);
+
+  free(cx);
+  sampler_free(ctx);
+}
+
+static void test_length(void) {
+  static const unsigned w = 12, h = 10, len = 7;
+  uint8_t in[w * h];
+
+  for (unsigned i = 0; i < w * h; i++) in[i] = (uint8_t)(i * 53 + 7);
+
+  sampler_context *full = sampler_new("hilbert", "full");
+  size_t n = sampler_init(full, w, h);
+  double *all = sampler_sample(full, in);
+
+  sampler_context *ctx = sampler_new("hilbert:length=7", "short");
+  ok(sampler_init(ctx, w, h) == len, "length 7");
+  double *out = sampler_sample(ctx, in);
+
+  int good = 1;
+  for (unsigned i = 0; i < len; i++) {
+    size_t from = i * n / len, to = (i + 1) * n / len;
+    double sum = 0;
+    for (size_t j = from; j < to; j++) sum += unbyte(all[j]);
+    double want = (sum - 128.0 * (to - from)) / 128 / (to - from);
+    if (out[i] != want) good = 0;
+  }
+  ok(good, "runs are averaged");
+
+  sampler_free(ctx);
+  sampler_free(full);
+}
+
+/* A window onto a wider frame samples as a packed copy of it would, as
+ * the stride changes and changes back.
+ */
+static void test_stride(const char *spec, unsigned w, unsigned h) {
+  static const unsigned strides[] = { 0, 3, 40, 0, 17 };
+  uint8_t frame[(w + 40) * (h + 2)], packed[w * h];
+
+  for (unsigned i = 0; i < sizeof(frame); i++) frame[i] = (uint8_t) random();
+
+  sampler_context *ctx = sampler_new(spec, "stride");
+  size_t len = sampler_init(ctx, w, h);
+  double *want = alloc(sizeof(double) * len);
+
+  for (unsigned s = 0; s < sizeof(strides) / sizeof(strides[0]); s++) {
+    unsigned stride = w + strides[s];
+    const uint8_t *win = frame + stride + 1;
+    for (unsigned y = 0; y < h; y++)
+      memcpy(packed + y * w, win + y * stride, w);
+    memcpy(want, sampler_sample(ctx, packed), sizeof(double) * len);
+    ok(!memcmp(sampler_sample_stride(ctx, win, stride), want, sizeof(double) * len),
+       "%s: %ux%u with stride %u", spec, w, h, stride);
+  }
+
+  free(want);
+  sampler_free(ctx);
+}
+
+void test_main(void) {
+  hilbert_register();
+
+  test_curve(1, 1);
+  test_curve(2, 2);
+  test_curve(16, 16);
+  test_curve(64, 64);
+  test_curve(13, 7);
+  test_curve(5, 31);
+  test_length();
+  test_stride("hilbert", 13, 7);
+  test_stride("hilbert:length=9", 20, 11);
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -1,5 +1,9 @@
 /* t/json.c */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "framework.h"
 #include "jd_pretty.h"
 #include "json.h"
@@ -21,8 +25,20 @@ static void test_get_real(void) {
   }
 }
 
+static void test_put_string(void) {
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *f = open_memstream(&buf, &size);
+  json_put_string("a \"b\" c\\d\n\x01", f);
+  fclose(f);
+  if (!ok(!strcmp(buf, "\"a \\\"b\\\" c\\\\d\\u000a\\u0001\""), "string escaped"))
+    diag("Got %s", buf);
+  free(buf);
+}
+
 void test_main(void) {
   test_get_real();
+  test_put_string();
 }
 
 /* vim:ts=2:sw=2:sts=2:et:ft=c
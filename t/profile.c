@@ -1,11 +1,15 @@
 /* t/profile.c */
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "framework.h"
 #include "json.h"
 #include "profile.h"
+#include "resample.h"
+#include "signature.h"
 #include "tap.h"
 #include "util.h"
 
@@ -56,7 +60,93 @@ static void test_profile(void) {
 
   ok(p->len == 7, "profile length");
 
+  size_t lo, hi;
+  profile_bins(p, &lo, &hi);
+  ok(lo == 0 && hi == 7, "default bins cover whole profile");
+
+  profile_free(p);
+  nest_out();
+}
+
+static void test_bins(void) {
+  nest_in("bins");
+  char *prof = tf_resource("data/band.profile");
+  profile *p = profile_load(prof);
+  free(prof);
+
+  size_t lo, hi;
+  profile_bins(p, &lo, &hi);
+  ok(p->len == 16, "profile length");
+  ok(lo == 4 && hi == 12, "bin range");
+
+  double data[16];
+  for (unsigned i = 0; i < countof(data); i++)
+    data[i] = p->baseline[i] * (1 + 0.5 * _random());
+
+  char want[profile_SIGNATURE_BITS + 1];
+  char got[profile_SIGNATURE_BITS + 1];
+  profile_signature(p, want, data, countof(data));
+
+  for (unsigned i = 0; i < countof(data); i++)
+    if (i < lo || i >= hi) data[i] = i & 1 ? 0 : 1e6;
+
+  profile_signature(p, got, data, countof(data));
+  ok(!strcmp(want, got), "bins outside range ignored");
+
+  data[lo] = 0;
+  profile_signature(p, got, data, countof(data));
+  ok(strcmp(want, got), "bins inside range used");
+
+  profile_free(p);
+  nest_out();
+}
+
+static void test_bands(void) {
+  nest_in("bands");
+  char *prof = tf_resource("data/bands.profile");
+  char *bin = tf_resource("data/bands.profbin.tmp");
+  profile *p = profile_load(prof);
+
+  size_t lo, hi;
+  profile_bins(p, &lo, &hi);
+  ok(p->n_bands == 4, "band count");
+  ok(lo == 2 && hi == 16, "bands set the bin range");
+
+  double data[16];
+  for (unsigned i = 0; i < countof(data); i++)
+    data[i] = p->baseline[i] * (1 + 0.5 * _random());
+
+  char want[profile_SIGNATURE_BITS + 1];
+  char got[profile_SIGNATURE_BITS + 1];
+  profile_signature(p, want, data, countof(data));
+
+  data[0] = 0;
+  data[1] = 1e6;
+  data[4] += 3;
+  data[7] -= 3;
+  profile_signature(p, got, data, countof(data));
+  ok(!strcmp(want, got), "only band totals count");
+
+  data[8] = 0;
+  profile_signature(p, got, data, countof(data));
+  ok(strcmp(want, got), "band total used");
+
+  profile_save_bin(p, bin);
+  profile *pb = profile_load(bin);
+  if (ok(pb->n_bands == p->n_bands, "binary band count matches"))
+    ok(!memcmp(pb->bands, p->bands, sizeof(uint64_t) * (p->n_bands + 1)),
+       "binary band edges match");
+  char got_bin[profile_SIGNATURE_BITS + 1];
+  profile_signature(p, got, data, countof(data));
+  profile_signature(pb, got_bin, data, countof(data));
+  ok(!strcmp(got, got_bin), "binary signature matches");
+  ok(profile_hash(p) == profile_hash(pb), "binary hash matches");
+
+  profile_free(pb);
   profile_free(p);
+  unlink(bin);
+  free(bin);
+  free(prof);
   nest_out();
 }
 
@@ -121,6 +211,11 @@ static void test_sig(void) {
     }
     ok(!strcmp(want, got), "signature: %s", want);
 
+    signature bits, parsed;
+    profile_signature_bits(p, &bits, data, dlen);
+    signature_parse(&parsed, got);
+    ok(!memcmp(&bits, &parsed, sizeof(signature)), "packed signature matches");
+
     free(data);
   }
 
@@ -138,10 +233,105 @@ static void test_sig(void) {
   nest_out();
 }
 
+static void test_bin(void) {
+  nest_in("binary");
+
+  char *prof = tf_resource("data/default.profile");
+  char *bin = tf_resource("data/default.profbin.tmp");
+
+  profile *p = profile_load(prof);
+  ok(!profile_is_bin(prof), "JSON profile detected");
+  profile_save_bin(p, bin);
+
+  ok(profile_is_bin(bin), "binary profile detected");
+  profile *pb = profile_load(bin);
+
+  unsigned w, h, wb, hb;
+  profile_frame_size(p, &w, &h);
+  profile_frame_size(pb, &wb, &hb);
+  ok(w == wb && h == hb, "frame size matches");
+  ok(pb->smooth_span == p->smooth_span, "smooth span matches");
+  ok(pb->bin_lo == p->bin_lo && pb->bin_hi == p->bin_hi, "bins match");
+  ok(!strcmp(pb->spec, p->spec), "sampler spec matches");
+  if (ok(pb->len == p->len, "length matches"))
+    ok(!memcmp(pb->baseline, p->baseline, sizeof(double) * p->len), "baseline matches");
+
+  double data[p->len];
+  for (unsigned i = 0; i < p->len; i++)
+    data[i] = p->baseline[i] * (0.5 + _random());
+
+  char want[profile_SIGNATURE_BITS + 1];
+  char got[profile_SIGNATURE_BITS + 1];
+  profile_signature(p, want, data, p->len);
+  profile_signature(pb, got, data, p->len);
+  ok(!strcmp(want, got), "signature matches");
+  ok(profile_hash(p) == profile_hash(pb), "hash matches");
+
+  profile_free(pb);
+  profile_free(p);
+  unlink(bin);
+
+  free(prof);
+  free(bin);
+
+  nest_out();
+}
+
+/* The compiled plan should agree with the straightforward computation */
+static void test_plan(void) {
+  nest_in("plan");
+
+  jd_var sig = JD_INIT;
+
+  char *prof = tf_resource("data/default.profile");
+  profile *p = profile_load(prof);
+
+  char *ref = tf_resource("data/sig.json");
+  json_load_file(&sig, ref);
+
+  size_t frames = jd_count(&sig);
+  for (unsigned f = 0; f < frames; f++) {
+    size_t dlen;
+    jd_var *slot = jd_get_idx(&sig, f);
+    double *data = json_get_real(jd_get_idx(jd_get_ks(slot, "planes", 0), 0), &dlen);
+
+    double norm[dlen], smoothed[dlen], sig_raw[dlen];
+    double want[profile_SIGNATURE_BITS], got[profile_SIGNATURE_BITS];
+
+    for (unsigned i = 0; i < dlen; i++)
+      norm[i] = data[i] / p->baseline[i];
+    double *smoop = profile_smooth(p, smoothed, norm, dlen);
+    for (unsigned i = 0; i < dlen; i++)
+      sig_raw[i] = norm[i] - (smoop ? smoop[i] : 1);
+    resample_double(want, profile_SIGNATURE_BITS, sig_raw, dlen);
+
+    profile_signature_data(p, got, data, dlen);
+
+    unsigned bad = 0;
+    for (unsigned i = 0; i < profile_SIGNATURE_BITS; i++)
+      if (fabs(got[i] - want[i]) > 1e-9 * (1 + fabs(want[i]))) bad++;
+    ok(bad == 0, "frame %u: signature data matches", f);
+
+    free(data);
+  }
+
+  profile_free(p);
+
+  free(prof);
+  free(ref);
+  jd_release(&sig);
+
+  nest_out();
+}
+
 void test_main(void) {
   test_lin_log();
   test_profile();
+  test_bins();
+  test_bands();
   test_sig();
+  test_bin();
+  test_plan();
 }
 
 /* vim:ts=2:sw=2:sts=2:et:ft=c
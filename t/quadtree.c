@@ -83,8 +83,133 @@ static void test_quadtree(void) {
   quadtree_free(qt);
 }
 
+static int cmp_int(const void *a, const void *b) {
+  const int *ia = a;
+  const int *ib = b;
+  return *ia < *ib ? -1 : *ia > *ib ? 1 : 0;
+}
+
+static void test_queries(void) {
+  static const int width = 200;
+  static const int height = 150;
+  static const unsigned count = 1000;
+  static const size_t k = 7;
+  static const int radius = 12;
+
+  quadtree_point *pt = alloc(sizeof(quadtree_point) * count);
+  srandom(1);
+  for (unsigned i = 0; i < count; i++) {
+    pt[i].x = random() % width;
+    pt[i].y = random() % height;
+    pt[i].tag = i;
+  }
+
+  quadtree *qt = quadtree_build(width, height, pt, count);
+  quadtree *inc = quadtree_new(width, height);
+  for (unsigned i = 0; i < count; i++)
+    quadtree_add_point(inc, &pt[i]);
+
+  quadtree_point *got = alloc(sizeof(quadtree_point) * count);
+  quadtree_point *want = alloc(sizeof(quadtree_point) * count);
+  quadtree_get(qt, got);
+  quadtree_get(inc, want);
+  ok(quadtree_used(qt) == count && !memcmp(got, want, sizeof(quadtree_point) * count),
+     "quadtree_build matches quadtree_add_point");
+
+  const quadtree_point **near = alloc(sizeof(quadtree_point *) * count);
+  int *all = alloc(sizeof(int) * count);
+  int knn_ok = 1, within_ok = 1, nearest_ok = 1;
+
+  for (int y = 0; y < height; y += 7) {
+    for (int x = 0; x < width; x += 9) {
+      unsigned inside = 0;
+      for (unsigned i = 0; i < count; i++) {
+        all[i] = dist(x, y, pt[i].x, pt[i].y);
+        if (all[i] <= radius * radius) inside++;
+      }
+      qsort(all, count, sizeof(int), cmp_int);
+
+      size_t found = quadtree_knearest(qt, x, y, near, k);
+      if (found != k) knn_ok = 0;
+      for (size_t i = 0; i < found; i++)
+        if (dist(x, y, near[i]->x, near[i]->y) != all[i]) knn_ok = 0;
+      if (found && near[0] != quadtree_nearest(qt, x, y)) nearest_ok = 0;
+
+      size_t n = quadtree_within(qt, x, y, radius, near, count);
+      if (n != inside) within_ok = 0;
+      for (size_t i = 0; i < n; i++)
+        if (dist(x, y, near[i]->x, near[i]->y) > radius * radius) within_ok = 0;
+      if (quadtree_within(qt, x, y, radius, near, 2) != inside) within_ok = 0;
+    }
+  }
+
+  ok(knn_ok, "k nearest agree with brute force");
+  ok(nearest_ok, "nearest is first of k nearest");
+  ok(within_ok, "points within radius agree with brute force");
+
+  quadtree *empty = quadtree_new(width, height);
+  ok(quadtree_nearest(empty, 0, 0) == NULL, "empty tree has no nearest");
+  ok(quadtree_knearest(empty, 0, 0, near, k) == 0, "empty tree has no k nearest");
+  quadtree_free(empty);
+
+  free(all);
+  free(near);
+  free(want);
+  free(got);
+  quadtree_free(inc);
+  quadtree_free(qt);
+  free(pt);
+}
+
+/* The order quadtree_get() returned these points in when the tree was
+ * built by inserting them one at a time into linked nodes. It follows
+ * the tree's shape, which voronoi maps depend on, so it mustn't change.
+ */
+static void test_shape(void) {
+  static const unsigned want[] = {
+    2, 6, 12, 26, 27, 29, 36, 59, 64, 86, 99, 108, 114, 116, 156, 162,
+    164, 181, 187, 4, 10, 46, 63, 68, 62, 82, 172, 180, 194, 55, 168, 179,
+    193, 0, 40, 60, 80, 91, 120, 160, 178, 5, 39, 72, 94, 123, 126, 148,
+    150, 38, 54, 56, 75, 87, 119, 152, 167, 7, 37, 48, 67, 88, 163, 16,
+    23, 24, 34, 89, 100, 186, 189, 1, 15, 31, 52, 57, 77, 83, 102, 107,
+    111, 136, 138, 143, 144, 145, 153, 171, 173, 176, 185, 13, 20, 25, 28, 71,
+    73, 76, 81, 84, 90, 96, 98, 103, 109, 118, 127, 137, 155, 165, 170, 125,
+    157, 169, 53, 115, 196, 197, 45, 51, 74, 112, 121, 134, 146, 190, 8, 19,
+    22, 47, 61, 85, 101, 110, 122, 128, 135, 154, 161, 192, 195, 199, 11, 17,
+    41, 139, 188, 191, 149, 182, 9, 14, 32, 33, 35, 44, 66, 69, 70, 92,
+    93, 95, 97, 105, 113, 130, 131, 166, 184, 18, 58, 65, 79, 117, 147, 174,
+    177
+  };
+  const unsigned count = sizeof(want) / sizeof(want[0]);
+
+  /* some points fall outside and every 40th is at the same place */
+  quadtree *qt = quadtree_new(100, 80);
+  uint32_t seed = 12345;
+  for (unsigned i = 0; i < 200; i++) {
+    seed = seed * 1103515245 + 12345;
+    int x = (int)((seed >> 8) % 110) - 5;
+    seed = seed * 1103515245 + 12345;
+    int y = (int)((seed >> 8) % 90) - 5;
+    if (i % 40 == 0) x = 61, y = 17;
+    quadtree_add(qt, x, y, i);
+  }
+
+  quadtree_point pt[200];
+  int good = quadtree_used(qt) == count;
+  if (good) {
+    quadtree_get(qt, pt);
+    for (unsigned i = 0; i < count; i++)
+      if (pt[i].tag != want[i]) good = 0;
+  }
+  ok(good, "tree has the shape incremental insertion gave it");
+
+  quadtree_free(qt);
+}
+
 void test_main(void) {
   test_quadtree();
+  test_queries();
+  test_shape();
 }
 
 
@@ -0,0 +1,63 @@
+/* t/sad.c */
+
+#include <stdlib.h>
+
+#include "framework.h"
+#include "sad.h"
+#include "tap.h"
+
+static uint64_t slow_sad(const uint8_t *a, const uint8_t *b, size_t len) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < len; i++)
+    sum += abs((int) a[i] - (int) b[i]);
+  return sum;
+}
+
+static void test_sad(void) {
+  static uint8_t a[1000], b[1000];
+
+  for (unsigned i = 0; i < sizeof(a); i++) {
+    a[i] = rand() & 0xFF;
+    b[i] = rand() & 0xFF;
+  }
+
+  is(sad_u8(a, a, sizeof(a)), 0, "identical");
+
+  unsigned bad = 0;
+  for (size_t off = 0; off < 17; off++)
+    for (size_t len = 0; len + off <= sizeof(a); len += 37)
+      if (sad_u8(a + off, b + off, len) != slow_sad(a + off, b + off, len))
+        bad++;
+  is(bad, 0, "matches scalar for all alignments and lengths");
+
+  for (unsigned i = 0; i < sizeof(a); i++) {
+    a[i] = 255;
+    b[i] = 0;
+  }
+  is(sad_u8(a, b, sizeof(a)), 255 * sizeof(a), "extremes");
+}
+
+static void test_sum(void) {
+  static uint8_t a[300];
+  uint8_t zero[300] = {0};
+
+  for (unsigned i = 0; i < sizeof(a); i++)
+    a[i] = rand() & 0xFF;
+
+  is(sad_sum_u8(a, 0), 0, "sum of nothing");
+
+  unsigned bad = 0;
+  for (size_t off = 0; off < 17; off++)
+    for (size_t len = 0; len + off <= sizeof(a); len++)
+      if (sad_sum_u8(a + off, len) != slow_sad(a + off, zero, len))
+        bad++;
+  is(bad, 0, "sum matches scalar for all alignments and lengths");
+}
+
+void test_main(void) {
+  test_sad();
+  test_sum();
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -1,13 +1,17 @@
 /* t/sampler.c */
 
 #include <math.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "framework.h"
+#include "hilbert.h"
 #include "sampler.h"
 #include "tap.h"
 #include "util.h"
+#include "voronoi.h"
+#include "zigzag.h"
 
 static void test_param(void) {
   sampler_params *sp = sampler_parse_params("a=1.24,b=-3,c='Hello, World',d=\"Boo\",e=true");
@@ -80,8 +84,9 @@ size_t test_sampler_init(sampler_context *ctx) {
   return ctx->width * ctx->height;
 }
 
-double *test_sampler_sample(sampler_context *ctx, const uint8_t *in)  {
+double *test_sampler_sample(sampler_context *ctx, const uint8_t *in, unsigned stride)  {
   (void)  in;
+  (void)  stride;
   return ctx->buf;
 }
 
@@ -93,6 +98,17 @@ void test_sampler_free(sampler_context *ctx) {
   done_free++;
 }
 
+static size_t test_copy_init(sampler_context *ctx) {
+  ctx->buf = alloc(sizeof(double) * ctx->width * ctx->height);
+  return ctx->width * ctx->height;
+}
+
+static double *test_copy_sample(sampler_context *ctx, const uint8_t *in, unsigned stride)  {
+  for (unsigned y = 0; y < ctx->height; y++)
+    sampler_bytes2double(ctx->buf + y * ctx->width, in + y * stride, ctx->width);
+  return ctx->buf;
+}
+
 static void test_register(void) {
   sampler_info info = {
     .name = "test_sampler",
@@ -129,10 +145,259 @@ static void test_register(void) {
   sampler_free(ctx);
 }
 
+typedef struct {
+  double size;
+  double scale;
+  const char *label;
+} test_config;
+
+static const sampler_schema test_params[] = {
+  { "size", sampler_NUMBER, "10", offsetof(test_config, size) },
+  { "scale", sampler_NUMBER, NULL, offsetof(test_config, scale) },
+  { "label", sampler_TEXT, NULL, offsetof(test_config, label) },
+  { NULL, sampler_NUMBER, NULL, 0 }
+};
+
+static void test_schema_spec(const char *spec, const char *want) {
+  sampler_context *ctx = sampler_new(spec, "schema");
+  if (!ok(!strcmp(sampler_spec(ctx), want), "%s: canonical spec", spec))
+    diag("Got %s", sampler_spec(ctx));
+  sampler_free(ctx);
+}
+
+static void test_schema(void) {
+  sampler_info info = {
+    .name = "test_schema",
+    .init = test_copy_init,
+    .sample = test_copy_sample,
+    .schema = test_params,
+    .config_size = sizeof(test_config)
+  };
+
+  sampler_register(&info);
+
+  sampler_context *ctx = sampler_new("test_schema:label='hi',scale=0.5", "schema");
+  const test_config *cfg = ctx->config;
+  ok(cfg->size == 10, "default compiled");
+  ok(cfg->scale == 0.5, "number compiled");
+  ok(cfg->label && !strcmp(cfg->label, "hi"), "text compiled");
+
+  sampler_context *dflt = sampler_new("test_schema", "schema");
+  cfg = dflt->config;
+  ok(isnan(cfg->scale), "missing number is NAN");
+  ok(cfg->label == NULL, "missing text is NULL");
+
+  test_schema_spec("test_schema", "test_schema:size=10");
+  test_schema_spec("test_schema:scale=0.5,label='hi'", sampler_spec(ctx));
+  test_schema_spec("test_schema:label=\"hi\",scale=.50,size=1e1", sampler_spec(ctx));
+
+  sampler_context *other = sampler_new("test_schema:label='hi',scale=0.25", "schema");
+  ok(sampler_hash(ctx) != sampler_hash(other), "different specs, different hashes");
+  ok(sampler_hash(dflt) == sampler_hash(dflt), "hash is stable");
+
+  sampler_free(other);
+  sampler_free(dflt);
+  sampler_free(ctx);
+
+  sampler_context *a = sampler_acquire("test_schema:scale=2", "a", 16, 8);
+  sampler_context *b = sampler_acquire("test_schema:size=10.0,scale=2", "b", 16, 8);
+  sampler_context *c = sampler_acquire("test_schema:scale=2", "c", 8, 8);
+  ok(a == b, "same sampler shared");
+  ok(a != c, "other size not shared");
+  is(a->len, 16 * 8, "shared sampler initialised");
+  sampler_free(b);
+
+  sampler_context *d = sampler_acquire("test_schema:scale=2", "d", 16, 8);
+  ok(a == d, "still shared after a free");
+  sampler_free(d);
+  sampler_free(a);
+
+  sampler_context *e = sampler_acquire("test_schema:scale=2", "e", 16, 8);
+  ok(e->refs == 1, "new sampler after the last free");
+  sampler_free(e);
+  sampler_free(c);
+}
+
+static void test_linear(void) {
+  sampler_info info = {
+    .name = "test_linear",
+    .init = test_sampler_init,
+    .sample = test_sampler_sample,
+    .free = test_sampler_free,
+    .linear = 1
+  };
+
+  sampler_register(&info);
+
+  ok(sampler_is_linear("test_linear"), "linear");
+  ok(sampler_is_linear("test_linear:x=1"), "linear with params");
+  ok(!sampler_is_linear("test_sampler"), "not linear");
+  ok(!sampler_is_linear("test_lin"), "prefix doesn't match");
+  ok(!sampler_is_linear("no_such_sampler"), "unknown not linear");
+}
+
+static void test_convert(void) {
+  uint8_t in[300];
+  double out[300], ref[300];
+
+  for (unsigned i = 0; i < 300; i++)
+    in[i] = (uint8_t) i;
+
+  sampler_bytes2double(out, in, 300);
+  for (unsigned i = 0; i < 300; i++) ref[i] = sampler_byte2double(in[i]);
+  ok(!memcmp(out, ref, sizeof(ref)), "bytes2double");
+
+  sampler_bytes2double_reverse(out, in, 299);
+  for (unsigned i = 0; i < 299; i++) ref[298 - i] = sampler_byte2double(in[i]);
+  ok(!memcmp(out, ref, sizeof(double) * 299), "bytes2double_reverse");
+}
+
+/* Reference: halve w x h in to out, the slow way */
+static void halve(uint8_t *out, const uint8_t *in, unsigned w, unsigned h) {
+  for (unsigned y = 0; y < h / 2; y++)
+    for (unsigned x = 0; x < w / 2; x++) {
+      const uint8_t *p = in + y * 2 * w + x * 2;
+      out[y * (w / 2) + x] = (uint8_t)((p[0] + p[1] + p[w] + p[w + 1] + 2) / 4);
+    }
+}
+
+static void test_pyramid_size(unsigned w, unsigned h, unsigned levels) {
+  sampler_pyramid *py = sampler_pyramid_new(w, h);
+  uint8_t *frame = alloc(w * h);
+  uint8_t *ref = alloc(w * h);
+  uint8_t *tmp = alloc(w * h);
+  sampler_context *ctx[levels];
+
+  for (unsigned i = 0; i < w * h; i++) frame[i] = (uint8_t) random();
+
+  unsigned lw = w, lh = h;
+  for (unsigned l = 0; l < levels; l++, lw /= 2, lh /= 2) {
+    ok(sampler_pyramid_find(py, lw, lh) == (int) l, "%ux%u: %ux%u is level %u", w, h, lw, lh, l);
+    ctx[l] = sampler_new("test_copy", "copy");
+    sampler_init(ctx[l], lw, lh);
+  }
+  ok(sampler_pyramid_find(py, lw, lh) == -1, "%ux%u: no level %u", w, h, levels);
+  ok(sampler_pyramid_find(py, w + 1, h) == -1, "%ux%u: other sizes aren't levels", w, h);
+
+  /* attached deepest first so the pyramid grows */
+  for (unsigned l = levels; l-- > 0;)
+    is(sampler_pyramid_attach(py, ctx[l]), l, "%ux%u: attached level %u", w, h, l);
+
+  for (unsigned pass = 0; pass < 2; pass++) {
+    sampler_pyramid_frame(py, frame, w);
+
+    memcpy(ref, frame, w * h);
+    lw = w, lh = h;
+    int good = 1;
+    for (unsigned l = 0; l < levels; l++) {
+      const double *out = sampler_pyramid_sample(py, ctx[l]);
+      for (unsigned i = 0; i < lw * lh; i++)
+        if (out[i] != sampler_byte2double(ref[i])) good = 0;
+      halve(tmp, ref, lw, lh);
+      memcpy(ref, tmp, (lw / 2) * (lh / 2));
+      lw /= 2, lh /= 2;
+    }
+    ok(good, "%ux%u: levels match, frame %u", w, h, pass);
+
+    for (unsigned i = 0; i < w * h; i++) frame[i] = (uint8_t) random();
+  }
+
+  for (unsigned l = 0; l < levels; l++)
+    sampler_free(ctx[l]);
+  sampler_pyramid_free(py);
+  free(tmp);
+  free(ref);
+  free(frame);
+}
+
+static void test_pyramid(void) {
+  sampler_info info = {
+    .name = "test_copy",
+    .init = test_copy_init,
+    .sample = test_copy_sample,
+    .linear = 1
+  };
+
+  sampler_register(&info);
+
+  test_pyramid_size(37, 23, 5);
+  test_pyramid_size(100, 6, 3);
+  test_pyramid_size(256, 256, 9);
+}
+
+/* Sample n frames as a batch from padded rows and one at a time, and
+ * each padded frame on its own. Every sampler is checked here.
+ */
+static void test_batch(const char *spec, unsigned w, unsigned h) {
+  enum { N = 3, PAD = 7 };
+  unsigned stride[N];
+  uint8_t *padded[N], *packed[N];
+
+  sampler_context *ctx = sampler_new(spec, "batch");
+  size_t len = sampler_init(ctx, w, h);
+  is(ctx->len, len, "%s: len recorded", spec);
+
+  for (unsigned f = 0; f < N; f++) {
+    stride[f] = w + PAD * f;
+    padded[f] = alloc(stride[f] * h);
+    packed[f] = alloc(w * h);
+    for (unsigned i = 0; i < stride[f] * h; i++) padded[f][i] = (uint8_t) random();
+    for (unsigned y = 0; y < h; y++)
+      memcpy(packed[f] + y * w, padded[f] + y * stride[f], w);
+  }
+
+  size_t ld = len + 3;
+  double *out = alloc(sizeof(double) * ld * N);
+  double *want = alloc(sizeof(double) * len * N);
+  for (unsigned f = 0; f < N; f++)
+    memcpy(want + f * len, sampler_sample(ctx, packed[f]), sizeof(double) * len);
+
+  int good = 1;
+  sampler_sample_batch(ctx, (const uint8_t *const *) padded, stride, N, out, ld);
+  for (unsigned f = 0; f < N; f++)
+    if (memcmp(out + f * ld, want + f * len, sizeof(double) * len)) good = 0;
+  ok(good, "%s: %ux%u batch from strided planes", spec, w, h);
+
+  good = 1;
+  sampler_sample_batch(ctx, (const uint8_t *const *) packed, NULL, N, out, len);
+  if (memcmp(out, want, sizeof(double) * len * N)) good = 0;
+  ok(good, "%s: %ux%u batch from packed planes", spec, w, h);
+
+  good = 1;
+  for (unsigned f = 0; f < N; f++)
+    if (memcmp(sampler_sample_stride(ctx, padded[f], stride[f]), want + f * len,
+               sizeof(double) * len)) good = 0;
+  ok(good, "%s: %ux%u strided planes", spec, w, h);
+
+  for (unsigned f = 0; f < N; f++) {
+    free(padded[f]);
+    free(packed[f]);
+  }
+  free(out);
+  free(want);
+  sampler_free(ctx);
+}
+
 void test_main(void) {
   test_param();
   test_get_set();
   test_register();
+  test_schema();
+  test_linear();
+  test_convert();
+  test_pyramid();
+  test_batch("test_copy", 21, 9);
+
+  zigzag_register();
+  hilbert_register();
+  voronoi_register();
+  test_batch("zigzag", 37, 5);
+  test_batch("zigzag", 16, 16);
+  test_batch("raster", 37, 5);
+  test_batch("weave", 37, 5);
+  test_batch("hilbert", 37, 5);
+  test_batch("hilbert:length=40", 37, 5);
+  test_batch("spiral:r_rate=2,a_rate=3", 67, 45);
 }
 
 
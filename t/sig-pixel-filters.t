@@ -0,0 +1,86 @@
+#!/usr/bin/env perl
+
+use v5.10;
+
+use autodie;
+use strict;
+use warnings;
+
+use File::Temp qw( tempdir );
+use Test::More;
+
+# downtown-sig --pixel-domain must filter each size's scaled frames,
+# which is what downtown-filter does before handing them on.
+
+my $W       = 192;
+my $H       = 144;
+my $FRAMES  = 13;
+my $SAMPLER = "spiral:r_rate=2,a_rate=2";
+
+my $dir = tempdir( CLEANUP => 1 );
+my $in  = "$dir/in.y4m2";
+
+sub make_input {
+  open my $fh, '>:raw', $in;
+  print $fh "YUV4MPEG2 W$W H$H F25:1 Ip A1:1 C420jpeg\n";
+  for my $f ( 0 .. $FRAMES - 1 ) {
+    print $fh "FRAME\n";
+    my $y = '';
+    for my $j ( 0 .. $H - 1 ) {
+      for my $i ( 0 .. $W - 1 ) {
+        my $v = 128 + 60 * sin( ( $i + $f * 3 ) / 9 ) * cos( ( $j - $f * 2 ) / 13 );
+        $v += ( $i * 7 + $j * 13 + $f * 5 ) % 31;
+        $y .= chr( $v < 0 ? 0 : $v > 255 ? 255 : int $v );
+      }
+    }
+    print $fh $y, chr(128) x ( $W * $H / 2 );
+  }
+  close $fh;
+}
+
+sub slurp {
+  my $name = shift;
+  open my $fh, '<:raw', $name;
+  local $/;
+  return <$fh>;
+}
+
+sub run {
+  my $cmd = shift;
+  system( $cmd ) == 0 or die "$cmd failed\n";
+}
+
+make_input();
+
+# spectra only: downtown-filter's output is renumbered when it's parsed
+sub spectra {
+  ( my $raw = slurp(shift) ) =~ s/"frame":\d+,//g;
+  return $raw;
+}
+
+my @sizes = ( '96x72', '64x48' );
+
+for my $opt ( '-d -M 2', '-M 2', '-H -M 2', '-c' ) {
+  ( my $tag = $opt ) =~ s/\W+//g;
+
+  for my $size (@sizes) {
+    run(  "../downtown-filter -q -s $size $opt < $in"
+        . " | ../downtown-sig -q -S $SAMPLER -r $dir/want.$tag.$size" );
+  }
+
+  run("../downtown-sig -q -P $opt -s $sizes[0] -S $SAMPLER -r $dir/one.$tag < $in");
+  is spectra("$dir/one.$tag"), spectra("$dir/want.$tag.$sizes[0]"),
+   "single job $opt";
+
+  run(  "../downtown-sig -q -P $opt"
+      . join( '', map { " -s $_ -S $SAMPLER -r $dir/got.$tag.$_" } @sizes )
+      . " < $in" );
+  for my $size (@sizes) {
+    is spectra("$dir/got.$tag.$size"), spectra("$dir/want.$tag.$size"),
+     "$opt: the $size job filters its own scaled frames";
+  }
+}
+
+done_testing();
+
+# vim:ts=2:sw=2:sts=2:et:ft=perl
@@ -0,0 +1,99 @@
+/* t/sigalign.c */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "framework.h"
+#include "sigalign.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "tap.h"
+#include "util.h"
+
+#define N_REF_A   3000
+#define N_REF_B   2000
+#define N_QUERY   1200
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t xorshift(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static void random_sig(signature *sig) {
+  for (unsigned w = 0; w < signature_WCOUNT; w++)
+    sig->w[w] = xorshift();
+}
+
+static void flip_bits(signature *sig, unsigned n) {
+  while (n--) {
+    unsigned b = xorshift() % signature_BITS;
+    sig->w[b / signature_WBITS] ^= (signature_word) 1 << (b % signature_WBITS);
+  }
+}
+
+static void test_find(void) {
+  static signature ref_a[N_REF_A], ref_b[N_REF_B], query[N_QUERY];
+
+  for (unsigned i = 0; i < N_REF_A; i++) random_sig(&ref_a[i]);
+  for (unsigned i = 0; i < N_REF_B; i++) random_sig(&ref_b[i]);
+
+  /* noise, a[1000..1600) at the same rate, every other frame of b from
+   * 100, noise
+   */
+  for (unsigned i = 0; i < N_QUERY; i++) {
+    if (i >= 200 && i < 800) query[i] = ref_a[800 + i];
+    else if (i >= 800 && i < 1100) query[i] = ref_b[100 + 2 * (i - 800)];
+    else random_sig(&query[i]);
+    flip_bits(&query[i], xorshift() % 12);
+  }
+
+  sigindex *idx = sigindex_new();
+  sigindex_add(idx, "a", 0, ref_a, N_REF_A);
+  sigindex_add(idx, "b", 50, ref_b, N_REF_B);
+  sigindex_build(idx, 2);
+
+  sigalign_params p;
+  sigalign_defaults(&p);
+  p.threads = 2;
+
+  sigalign_segment seg[8];
+  size_t n_seg = sigalign_find(idx, query, N_QUERY, &p, seg, 8);
+
+  if (!is(n_seg, 2, "two segments found")) {
+    sigindex_free(idx);
+    return;
+  }
+
+  is(seg[0].file, 0, "first segment in a");
+  is(seg[0].q_start, 200, "first segment starts");
+  is(seg[0].q_end, 800, "first segment ends");
+  is(seg[0].r_start, 1000, "first segment reference start");
+  ok(fabs(seg[0].rate - 1) < 0.01, "first segment rate is 1 (%g)", seg[0].rate);
+  ok(fabs(seg[0].offset - 800) < 1, "first segment offset is 800 (%g)", seg[0].offset);
+
+  is(seg[1].file, 1, "second segment in b");
+  is(seg[1].q_start, 800, "second segment starts");
+  is(seg[1].q_end, 1100, "second segment ends");
+  is(seg[1].r_start, 100, "second segment reference start");
+  ok(fabs(seg[1].rate - 2) < 0.01, "second segment rate is 2 (%g)", seg[1].rate);
+
+  ok(seg[0].confidence > 0.9 && seg[1].confidence > 0.9, "confident matches");
+
+  /* nothing to find */
+  for (unsigned i = 0; i < N_QUERY; i++) random_sig(&query[i]);
+  is(sigalign_find(idx, query, N_QUERY, &p, seg, 8), 0, "no segments in noise");
+
+  sigindex_free(idx);
+}
+
+void test_main(void) {
+  test_find();
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
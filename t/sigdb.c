@@ -0,0 +1,239 @@
+/* t/sigdb.c */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "sigdb.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "tap.h"
+#include "util.h"
+
+#define N_SIG   2000
+#define K       4
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t xorshift(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static void flip_bits(signature *sig, unsigned n) {
+  while (n--) {
+    unsigned b = xorshift() % signature_BITS;
+    sig->w[b / signature_WBITS] ^= (signature_word) 1 << (b % signature_WBITS);
+  }
+}
+
+static void append(const char *db, const signature *corpus, unsigned key_bits,
+                   unsigned from, unsigned to, const char *const *names) {
+  sigindex *idx = sigindex_new();
+  idx->key_bits = key_bits;
+  unsigned mid = (from + to) / 2;
+  sigindex_add(idx, names[0], 10, corpus + from, mid - from);
+  sigindex_add(idx, names[1], 0, corpus + mid, to - mid);
+  sigindex_build(idx, 2);
+  sigdb_append(db, idx);
+  sigindex_free(idx);
+}
+
+static void test_db(void) {
+  static signature corpus[N_SIG];
+  char db_name[] = "/tmp/sigdb-test-XXXXXX";
+
+  int fd = mkstemp(db_name);
+  if (fd < 0) die("Can't create temporary file");
+  close(fd);
+  unlink(db_name);
+
+  for (unsigned i = 0; i < N_SIG; i++)
+    for (unsigned w = 0; w < signature_WCOUNT; w++)
+      corpus[i].w[w] = xorshift();
+
+  static const char *const first[] = { "a", "b" };
+  static const char *const second[] = { "c", "d" };
+  append(db_name, corpus, 16, 0, 1200, first);
+  append(db_name, corpus, 32, 1200, N_SIG, second);
+
+  ok(sigdb_is_db(db_name), "is a database");
+
+  sigdb *db = sigdb_open(db_name);
+  is(db->n_segments, 2, "two segments");
+
+  sigindex *idx = sigindex_new();
+  sigdb_load(db, idx);
+  is(idx->n_files, 4, "four files");
+  is(sigindex_size(idx), N_SIG, "all signatures");
+  ok(!strcmp(idx->files[2].name, "c"), "file name");
+  is(idx->files[0].first_frame, 10, "first frame");
+  is(idx->parts[1].key_bits, 32, "second segment has long keys");
+
+  /* built in memory for comparison */
+  sigindex *mem = sigindex_new();
+  sigindex_add(mem, "all", 0, corpus, N_SIG);
+  sigindex_build(mem, 1);
+
+  unsigned bad = 0;
+  for (unsigned i = 0; i < 200; i++) {
+    unsigned src = xorshift() % N_SIG;
+    signature q = corpus[src];
+    flip_bits(&q, xorshift() % 16);
+
+    sigindex_match got[K], want[K];
+    size_t ng = sigindex_search(idx, &q, 20, got, K);
+    size_t nw = sigindex_search(mem, &q, 20, want, K);
+    if (ng != nw || !ng) {
+      bad++;
+      continue;
+    }
+    for (unsigned j = 0; j < ng; j++)
+      if (got[j].distance != want[j].distance) bad++;
+
+    const signature *hit = sigindex_get(idx, got[0].file, got[0].frame);
+    if (memcmp(hit, &corpus[src], sizeof(signature))) bad++;
+  }
+  is(bad, 0, "database search agrees with memory");
+
+  sigdb_compact(db_name, 2);
+
+  /* still mapped after being replaced */
+  const signature *before = sigindex_get(idx, 3, 5);
+  ok(!memcmp(before, &corpus[1600 + 5], sizeof(signature)), "old map survives compaction");
+
+  sigdb *cdb = sigdb_open(db_name);
+  is(cdb->n_segments, 1, "one segment after compaction");
+
+  sigindex *cidx = sigindex_new();
+  sigdb_load(cdb, cidx);
+  is(cidx->n_files, 4, "files kept");
+  is(sigindex_size(cidx), N_SIG, "signatures kept");
+  ok(!strcmp(cidx->files[2].name, "c"), "names kept");
+  is(cidx->files[0].first_frame, 10, "first frames kept");
+
+  bad = 0;
+  for (unsigned i = 0; i < 200; i++) {
+    signature q = corpus[xorshift() % N_SIG];
+    flip_bits(&q, xorshift() % 16);
+
+    sigindex_match got[K], want[K];
+    size_t ng = sigindex_search(cidx, &q, 20, got, K);
+    size_t nw = sigindex_search(idx, &q, 20, want, K);
+    if (ng != nw) {
+      bad++;
+      continue;
+    }
+    for (unsigned j = 0; j < ng; j++)
+      if (got[j].file != want[j].file || got[j].frame != want[j].frame
+          || got[j].distance != want[j].distance) bad++;
+  }
+  is(bad, 0, "compacted search agrees");
+
+  sigindex_free(cidx);
+  sigdb_close(cdb);
+  sigindex_free(mem);
+  sigindex_free(idx);
+  sigdb_close(db);
+  unlink(db_name);
+}
+
+static char *temp_name(void) {
+  char name[] = "/tmp/sigdb-test-XXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0) die("Can't create temporary file");
+  close(fd);
+  unlink(name);
+  return sstrdup(name);
+}
+
+/* Does loading filename die rather than crash or succeed? */
+static int load_dies(const char *filename) {
+  int status;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) die("Can't fork");
+  if (pid == 0) {
+    if (!freopen("/dev/null", "w", stderr)) _exit(2);
+    sigdb *db = sigdb_open(filename);
+    sigindex *idx = sigindex_new();
+    sigdb_load(db, idx);
+    _exit(0);
+  }
+  if (waitpid(pid, &status, 0) != pid) die("Can't wait");
+  return WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+/* Copy src to dst with len bytes at off replaced by data */
+static void patch_copy(const char *dst, const char *src, uint64_t off,
+                       const void *data, size_t len) {
+  FILE *in = fopen(src, "rb");
+  FILE *out = fopen(dst, "wb");
+  if (!in || !out) die("Can't copy %s", src);
+  int ch;
+  while ((ch = getc(in)) != EOF) putc(ch, out);
+  fclose(in);
+  if (fseek(out, (long) off, SEEK_SET) || fwrite(data, 1, len, out) != len)
+    die("Can't patch %s", dst);
+  fclose(out);
+}
+
+static void test_corrupt(void) {
+  static signature corpus[300];
+  char *db_name = temp_name();
+  char *bad_name = temp_name();
+
+  for (unsigned i = 0; i < 300; i++)
+    for (unsigned w = 0; w < signature_WCOUNT; w++)
+      corpus[i].w[w] = xorshift();
+
+  static const char *const names[] = { "a", "b" };
+  append(db_name, corpus, 16, 0, 300, names);
+
+  sigdb *db = sigdb_open(db_name);
+  const sigdb_segment *seg = db->seg[0];
+  uint64_t base = (uint64_t)((const char *) seg - (const char *) db->map);
+
+  uint32_t big = seg->n_sig, one = 1, zero = 0, huge = 0xffffffff;
+  struct {
+    const char *name;
+    uint64_t off;
+    const void *data;
+    size_t len;
+  } cases[] = {
+    { "start not monotonic", seg->start[3] + 4 * 100, &huge, 4 },
+    { "start doesn't end at n_sig", seg->start[0] + 4 * sigindex_BUCKETS, &zero, 4 },
+    { "id out of range", seg->ids[5] + 4 * 7, &big, 4 },
+    { "map disagrees with files", seg->map, &one, 4 },
+    { "files overlap", seg->files + sizeof(sigdb_file) + offsetof(sigdb_file, base), &zero, 4 },
+    { "name out of range", seg->files + offsetof(sigdb_file, name), &huge, 4 },
+    { "misaligned table", offsetof(sigdb_segment, sig), &one, 1 },
+  };
+
+  patch_copy(bad_name, db_name, 0, "", 0);
+  ok(!load_dies(bad_name), "intact database loads");
+
+  for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    patch_copy(bad_name, db_name, base + cases[i].off, cases[i].data, cases[i].len);
+    ok(load_dies(bad_name), "corrupt: %s", cases[i].name);
+  }
+
+  sigdb_close(db);
+  unlink(bad_name);
+  unlink(db_name);
+  free(bad_name);
+  free(db_name);
+}
+
+void test_main(void) {
+  test_db();
+  test_corrupt();
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,80 @@
+/* t/sigfile.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "sigfile.h"
+#include "signature.h"
+#include "tap.h"
+#include "util.h"
+
+#define FRAMES 50
+#define FIRST  1000
+
+/* Runs of identical signatures of varying length */
+static void make_sig(signature *sig, unsigned frame) {
+  unsigned run = frame < 10 ? frame / 4 : frame < 40 ? 3 + frame / 7 : 100 + frame;
+  memset(sig, 0, sizeof(*sig));
+  for (unsigned i = 0; i < signature_WCOUNT; i++)
+    sig->w[i] = (signature_word)(run * 2654435761u + i * 40503u);
+}
+
+static void check_file(const char *name, unsigned flags, FILE *fl) {
+  sigfile_writer *sw = sigfile_writer_new(fl, 0x0123456789abcdefULL, 25, 1, flags);
+  for (unsigned f = 0; f < FRAMES; f++) {
+    signature sig;
+    make_sig(&sig, f);
+    sigfile_write(sw, FIRST + f, &sig);
+  }
+  sigfile_writer_free(sw);
+  fclose(fl);
+
+  ok(sigfile_is_bin(name), "binary signatures detected");
+
+  sigfile *sf = sigfile_open(name);
+  is(sf->frames, FRAMES, "frame count");
+  is(sf->hdr->first_frame, FIRST, "first frame");
+  ok(sf->hdr->profile_hash == 0x0123456789abcdefULL, "profile hash");
+  ok(sf->hdr->fps_num == 25 && sf->hdr->fps_den == 1, "frame rate");
+
+  if (flags & sigfile_RLE)
+    ok(sf->n_rec < FRAMES, "runs compressed (%u records)", (unsigned) sf->n_rec);
+  else
+    is(sf->n_rec, FRAMES, "one record per frame");
+
+  unsigned bad = 0;
+  for (unsigned f = 0; f < FRAMES; f++) {
+    signature sig;
+    make_sig(&sig, f);
+    const signature *got = sigfile_get(sf, f);
+    if (!got || signature_distance(got, &sig)) bad++;
+  }
+  is(bad, 0, "all signatures match");
+  null(sigfile_get(sf, FRAMES), "no signature past the end");
+
+  sigfile_close(sf);
+}
+
+static void test_sigfile(void) {
+  char *name = tf_resource("data/sigfile.sigb.tmp");
+
+  for (unsigned flags = 0; flags <= sigfile_RLE; flags += sigfile_RLE) {
+    nest_in(flags ? "rle" : "plain");
+    FILE *fl = fopen(name, "wb");
+    if (!fl) die("Can't write %s", name);
+    check_file(name, flags, fl);
+    nest_out();
+  }
+
+  unlink(name);
+  free(name);
+}
+
+void test_main(void) {
+  test_sigfile();
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,145 @@
+/* t/sigindex.c */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "framework.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "tap.h"
+#include "util.h"
+
+#define N_SIG   3000
+#define K       8
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t xorshift(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static void flip_bits(signature *sig, unsigned n) {
+  while (n--) {
+    unsigned b = xorshift() % signature_BITS;
+    sig->w[b / signature_WBITS] ^= (signature_word) 1 << (b % signature_WBITS);
+  }
+}
+
+/* Brute force reference ordered like sigindex_search */
+static size_t brute(const sigindex *idx, const signature *q, unsigned radius,
+                    sigindex_match *m, size_t k) {
+  size_t n = 0;
+  for (unsigned f = 0; f < idx->n_files; f++) {
+    for (uint64_t i = 0; i < idx->files[f].frames; i++) {
+      unsigned d = signature_distance(q, sigindex_get(idx, f, i));
+      if (d > radius) continue;
+      sigindex_match nm = { f, i, d };
+      size_t pos = n < k ? n++ : k;
+      if (pos == k) {
+        if (d >= m[k - 1].distance) continue;
+        pos = k - 1;
+      }
+      while (pos && m[pos - 1].distance > d) {
+        m[pos] = m[pos - 1];
+        pos--;
+      }
+      m[pos] = nm;
+    }
+  }
+  return n;
+}
+
+static void test_search(const signature *corpus, unsigned key_bits) {
+  nest_in("%u bit keys", key_bits);
+
+  sigindex *idx = sigindex_new();
+  idx->key_bits = key_bits;
+  sigindex_add(idx, "a", 100, corpus, 1000);
+  sigindex_add(idx, "b", 0, corpus + 1000, 500);
+  sigindex_build(idx, 4);
+  sigindex_add(idx, "c", 7, corpus + 1500, N_SIG - 1500);
+  sigindex_build(idx, 1);
+
+  is(idx->n_parts, 2, "two parts");
+  is(sigindex_size(idx), N_SIG, "all signatures indexed");
+  ok(sigindex_get(idx, 2, 3) && !memcmp(sigindex_get(idx, 2, 3), &corpus[1503],
+                                       sizeof(signature)), "get from second part");
+  null(sigindex_get(idx, 1, 500), "get past end of file");
+
+  unsigned radius[] = { 0, 5, 20, 30 };
+  for (unsigned r = 0; r < sizeof(radius) / sizeof(radius[0]); r++) {
+    nest_in("radius %u", radius[r]);
+    unsigned bad = 0, found = 0;
+
+    for (unsigned i = 0; i < 200; i++) {
+      signature q = corpus[xorshift() % N_SIG];
+      flip_bits(&q, xorshift() % 24);
+
+      sigindex_match want[K], got[K];
+      size_t nw = brute(idx, &q, radius[r], want, K);
+      size_t ng = sigindex_search(idx, &q, radius[r], got, K);
+      found += ng;
+
+      if (nw != ng) {
+        bad++;
+        continue;
+      }
+      /* ties may come back in either order; distances must agree */
+      for (unsigned j = 0; j < ng; j++)
+        if (got[j].distance != want[j].distance ||
+            got[j].distance != signature_distance(&q, sigindex_get(idx, got[j].file, got[j].frame)))
+          bad++;
+    }
+
+    is(bad, 0, "search agrees with brute force (%u matches)", found);
+    nest_out();
+  }
+
+  /* a batch spread over threads finds what one search at a time does */
+  enum { NQ = 600 };
+  signature *q = alloc(sizeof(signature) * NQ);
+  sigindex_match *many = alloc(sizeof(sigindex_match) * NQ * K);
+  size_t *count = alloc(sizeof(size_t) * NQ);
+  for (unsigned i = 0; i < NQ; i++) {
+    q[i] = corpus[xorshift() % N_SIG];
+    flip_bits(&q[i], xorshift() % 24);
+  }
+  sigindex_search_many(idx, q, NQ, 20, many, count, K, 3);
+  unsigned bad = 0;
+  for (unsigned i = 0; i < NQ; i++) {
+    sigindex_match one[K];
+    size_t n = sigindex_search(idx, &q[i], 20, one, K);
+    if (n != count[i] || memcmp(one, many + i * K, sizeof(sigindex_match) * n)) bad++;
+  }
+  is(bad, 0, "search_many agrees with search");
+  free(count);
+  free(many);
+  free(q);
+
+  is(idx->parts[0].key_bits, key_bits, "key size");
+  sigindex_free(idx);
+  nest_out();
+}
+
+void test_main(void) {
+  static signature corpus[N_SIG];
+
+  for (unsigned i = 0; i < N_SIG; i++)
+    for (unsigned w = 0; w < signature_WCOUNT; w++)
+      corpus[i].w[w] = xorshift();
+
+  /* near duplicates so there's something to find at each radius */
+  for (unsigned i = 1; i < N_SIG; i += 3) {
+    corpus[i] = corpus[i - 1];
+    flip_bits(&corpus[i], i % 40);
+  }
+
+  test_search(corpus, 16);
+  test_search(corpus, 32);
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
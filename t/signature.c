@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "framework.h"
+#include "profile.h"
 #include "signature.h"
 #include "tap.h"
 #include "util.h"
@@ -40,11 +41,12 @@ static void test_count(void) {
   nest_in("signature__count_bits");
 
   ok(0 == signature__count_bits(0), "0 has 0 set bits");
-  ok(signature_WBITS == signature__count_bits(UINT_MAX), "%u has %u set bits",
-     UINT_MAX, signature_WBITS);
+  ok(signature_WBITS == signature__count_bits(UINT64_MAX), "%llu has %u set bits",
+     (unsigned long long) UINT64_MAX, (unsigned) signature_WBITS);
 
   for (unsigned b = 0; b < signature_WBITS; b++)
-    ok(1 == signature__count_bits(1u << b), "%u has 1 set bit", 1u << b);
+    ok(1 == signature__count_bits((signature_word) 1 << b), "%llu has 1 set bit",
+       1ull << b);
 
   nest_out();
 }
@@ -102,10 +104,46 @@ static void test_distance(void) {
   nest_out();
 }
 
+/* Every kernel the CPU can run must agree with the reference */
+static void test_distance_many(void) {
+  static const char *impl[] = { "generic", "popcnt", "avx2", "avx512" };
+  enum { N = 37 };
+
+  char sig_buf[signature_LEN_BIN + 1];
+  signature query, db[N];
+  unsigned want[N], got[N];
+
+  random_sig(sig_buf);
+  signature_parse(&query, sig_buf);
+  for (unsigned i = 0; i < N; i++) {
+    char db_buf[signature_LEN_BIN + 1];
+    random_sig(db_buf);
+    signature_parse(&db[i], db_buf);
+    want[i] = count_diff(sig_buf, db_buf);
+  }
+
+  for (unsigned k = 0; k < sizeof(impl) / sizeof(impl[0]); k++) {
+    nest_in("distance_many (%s)", impl[k]);
+    if (signature__use_impl(impl[k])) {
+      for (unsigned n = 0; n <= N; n++) {
+        memset(got, 0xff, sizeof(got));
+        signature_distance_many(&query, db, n, got);
+        ok(!memcmp(got, want, sizeof(unsigned) * n), "%u distances", n);
+        ok(n == N || got[n] == UINT_MAX, "nothing written past %u", n);
+      }
+    }
+    else {
+      diag("%s not supported", impl[k]);
+    }
+    nest_out();
+  }
+}
+
 void test_main(void) {
   test_count();
   test_format();
   test_distance();
+  test_distance_many();
 }
 
 /* vim:ts=2:sw=2:sts=2:et:ft=c
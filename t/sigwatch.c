@@ -0,0 +1,154 @@
+/* t/sigwatch.c */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "framework.h"
+#include "sigindex.h"
+#include "signature.h"
+#include "sigwatch.h"
+#include "tap.h"
+#include "util.h"
+
+#define N_REF     1000
+#define MAX_EV    16
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t xorshift(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static void random_sig(signature *sig) {
+  for (unsigned w = 0; w < signature_WCOUNT; w++)
+    sig->w[w] = xorshift();
+}
+
+static void flip_bits(signature *sig, unsigned n) {
+  while (n--) {
+    unsigned b = xorshift() % signature_BITS;
+    sig->w[b / signature_WBITS] ^= (signature_word) 1 << (b % signature_WBITS);
+  }
+}
+
+typedef struct {
+  sigwatch_event ev[MAX_EV];
+  unsigned n;
+} event_log;
+
+static void record(const sigwatch_event *ev, void *ctx) {
+  event_log *el = ctx;
+  if (el->n < MAX_EV) el->ev[el->n] = *ev;
+  el->n++;
+}
+
+static void test_watch(void) {
+  static signature ref[N_REF];
+  for (unsigned i = 0; i < N_REF; i++) random_sig(&ref[i]);
+
+  sigindex *idx = sigindex_new();
+  sigindex_add(idx, "ref", 0, ref, N_REF);
+  sigindex_build(idx, 1);
+
+  sigwatch_params p;
+  sigwatch_defaults(&p);
+
+  event_log el;
+  memset(&el, 0, sizeof(el));
+  sigwatch *w = sigwatch_new(idx, &p, record, &el);
+
+  /* noise, ref[300..500), noise, then the tail of ref until the end */
+  for (unsigned f = 0; f < 700; f++) {
+    signature sig;
+    if (f >= 100 && f < 300) sig = ref[200 + f];
+    else if (f >= 600) sig = ref[300 + f];
+    else random_sig(&sig);
+    flip_bits(&sig, xorshift() % 12);
+    sigwatch_push(w, 1000 + f, &sig);
+
+    if (f == 100 + p.min_frames - 1)
+      is(el.n, 1, "start reported after %u frames", p.min_frames);
+  }
+
+  is(el.n, 3, "three events before the end");
+  sigwatch_free(w);
+
+  if (is(el.n, 4, "four events")) {
+    is(el.ev[0].type, sigwatch_START, "start");
+    is(el.ev[0].frame, 1100, "start frame");
+    is(el.ev[0].ref_frame, 300, "start reference frame");
+
+    is(el.ev[1].type, sigwatch_STOP, "stop");
+    is(el.ev[1].frame, 1300, "stop frame");
+    is(el.ev[1].ref_frame, 500, "stop reference frame");
+    is(el.ev[1].frames, 200, "frames matched");
+    is(el.ev[1].at, 1300 + p.max_misses, "stop reported after %u misses", p.max_misses);
+
+    is(el.ev[2].type, sigwatch_START, "second start");
+    is(el.ev[2].ref_frame, 900, "second start reference frame");
+    is(el.ev[3].type, sigwatch_STOP, "stopped at end of stream");
+    is(el.ev[3].frame, 1700, "end of stream");
+  }
+
+  sigindex_free(idx);
+}
+
+/* A reference full of near identical frames, like slate, matches
+ * every frame of slate in the stream at many alignments.
+ */
+static void test_crowded(void) {
+  static signature ref[N_REF];
+  signature slate;
+  random_sig(&slate);
+  for (unsigned i = 0; i < N_REF; i++) {
+    if (i < N_REF / 2) {
+      ref[i] = slate;
+      flip_bits(&ref[i], xorshift() % 4);
+    }
+    else random_sig(&ref[i]);
+  }
+
+  sigindex *idx = sigindex_new();
+  sigindex_add(idx, "slate", 0, ref, N_REF / 2);
+  sigindex_add(idx, "item", 0, ref + N_REF / 2, N_REF / 2);
+  sigindex_build(idx, 1);
+
+  sigwatch_params p;
+  sigwatch_defaults(&p);
+  p.k = 16;
+
+  event_log el;
+  memset(&el, 0, sizeof(el));
+  sigwatch *w = sigwatch_new(idx, &p, record, &el);
+
+  /* enough slate to fill the table, then the item */
+  unsigned n_slate = 400;
+  for (unsigned f = 0; f < n_slate + 100; f++) {
+    signature sig = f < n_slate ? slate : ref[N_REF / 2 + 50 + f - n_slate];
+    flip_bits(&sig, xorshift() % 8);
+    sigwatch_push(w, f, &sig);
+  }
+
+  const sigwatch_event *start = NULL;
+  for (unsigned i = 0; i < el.n && i < MAX_EV; i++)
+    if (el.ev[i].type == sigwatch_START && el.ev[i].file == 1) start = &el.ev[i];
+
+  if (ok(start != NULL, "item after slate is reported")) {
+    is(start->frame, n_slate, "item start frame");
+    is(start->at, n_slate + p.min_frames - 1, "item reported without waiting for slate to stop");
+  }
+
+  sigwatch_free(w);
+  sigindex_free(idx);
+}
+
+void test_main(void) {
+  test_watch();
+  test_crowded();
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -0,0 +1,98 @@
+/* t/spectrum.c */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "framework.h"
+#include "spectrum.h"
+#include "tap.h"
+
+#define countof(ar) (sizeof(ar) / sizeof((ar)[0]))
+
+static void test_parse(void) {
+  double out[4];
+
+  nest_in("parse");
+
+  is(spectrum_parse_raw("{\"sampler\":\"spiral\",\"width\":64,\"height\":64}\n",
+                        out, countof(out)), 0, "header isn't a spectrum");
+
+  is(spectrum_parse_raw("{\"frame\":3,\"planes\":[[1.5,2.25,-3e2]]}\n",
+                        out, countof(out)), 3, "three values");
+  ok(out[0] == 1.5 && out[1] == 2.25 && out[2] == -300, "values parsed");
+
+  is(spectrum_parse_raw("{\"frame\":4,\"planes\" : [ [ 1 , 2 ,3,4,5,6 ] ] }",
+                        out, countof(out)), 6, "long spectrum counted");
+  ok(out[0] == 1 && out[3] == 4, "values stored up to len");
+
+  nest_out();
+}
+
+static double datum(unsigned frame, unsigned bin) {
+  return 1 + (frame * 7 + bin * 13) % 97 * 1e3 + (frame & 1 ? 1e-6 : 0);
+}
+
+static void test_sum(void) {
+  enum { LEN = 8, FRAMES = 1000, SPLIT = 337 };
+  double data[LEN];
+  double whole[LEN], merged[LEN];
+
+  nest_in("sum");
+
+  spectrum_sum *all = spectrum_sum_new(LEN);
+  spectrum_sum *part[2] = { spectrum_sum_new(LEN), spectrum_sum_new(LEN) };
+
+  for (unsigned f = 0; f < FRAMES; f++) {
+    for (unsigned b = 0; b < LEN; b++) data[b] = datum(f, b);
+    spectrum_sum_add(all, data);
+    spectrum_sum_add(part[f >= SPLIT], data);
+  }
+
+  spectrum_sum_merge(part[0], part[1]);
+  is(part[0]->count, FRAMES, "merged count");
+
+  spectrum_sum_mean(all, whole);
+  spectrum_sum_mean(part[0], merged);
+
+  for (unsigned b = 0; b < LEN; b++) {
+    double lsum = 0;
+    for (unsigned f = 0; f < FRAMES; f++) lsum += log(datum(f, b));
+    within(whole[b], exp(lsum / FRAMES), 1e-9 * whole[b], "bin %u: geometric mean", b);
+    within(merged[b], whole[b], 1e-12 * whole[b], "bin %u: merge matches", b);
+  }
+
+  spectrum_sum_free(part[0]);
+  spectrum_sum_free(part[1]);
+  spectrum_sum_free(all);
+
+  nest_out();
+}
+
+static void test_floor(void) {
+  double data[] = { 0, -1, 1 };
+  double mean[countof(data)];
+
+  nest_in("floor");
+
+  spectrum_sum *ss = spectrum_sum_new(countof(data));
+  spectrum_sum_add(ss, data);
+  spectrum_sum_mean(ss, mean);
+
+  close_to(mean[0], exp(spectrum_LOG_FLOOR), "zero uses floor");
+  close_to(mean[1], exp(spectrum_LOG_FLOOR), "negative uses floor");
+  close_to(mean[2], 1, "one is one");
+
+  spectrum_sum_free(ss);
+
+  nest_out();
+}
+
+void test_main(void) {
+  test_parse();
+  test_sum();
+  test_floor();
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
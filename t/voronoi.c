@@ -0,0 +1,154 @@
+/* t/voronoi.c */
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "framework.h"
+#include "sampler.h"
+#include "tap.h"
+#include "util.h"
+#include "voronoi.h"
+
+static void fill_random(uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (uint8_t) random();
+}
+
+/* n times bigger by pixel replication */
+static void upscale(uint8_t *out, const uint8_t *in, unsigned w, unsigned h, unsigned n) {
+  for (unsigned y = 0; y < h * n; y++)
+    for (unsigned x = 0; x < w * n; x++)
+      out[x + y * w * n] = in[x / n + y / n * w];
+}
+
+static void test_project(unsigned w, unsigned h, unsigned n) {
+  const char *spec = "spiral:r_rate=2,a_rate=3";
+  uint8_t *small = alloc(w * h);
+  uint8_t *big = alloc(w * h * n * n);
+
+  fill_random(small, w * h);
+  upscale(big, small, w, h, n);
+
+  sampler_context *ref = sampler_new(spec, "ref");
+  sampler_context *prj = sampler_new(spec, "projected");
+  size_t len = sampler_init(ref, w, h);
+  size_t plen = sampler_init(prj, w, h);
+
+  ok(sampler_can_project(prj), "spiral can be projected");
+  sampler_project(prj, w * n, h * n);
+  is(prj->width, w * n, "width projected");
+  is(prj->height, h * n, "height projected");
+  if (!is(plen, len, "same length"))
+    diag("wanted %lu, got %lu", (unsigned long) len, (unsigned long) plen);
+
+  const double *want = sampler_sample(ref, small);
+  const double *got = sampler_sample(prj, big);
+
+  size_t bad = 0;
+  for (size_t i = 0; i < len; i++)
+    if (fabs(want[i] - got[i]) > 1e-9) bad++;
+
+  if (!ok(bad == 0, "%ux%u projected %u times matches", w, h, n))
+    diag("%lu of %lu regions differ", (unsigned long) bad, (unsigned long) len);
+
+  sampler_free(ref);
+  sampler_free(prj);
+  free(small);
+  free(big);
+}
+
+static void test_same_size(void) {
+  sampler_context *ctx = sampler_new("spiral", "same");
+  sampler_init(ctx, 64, 64);
+  sampler_project(ctx, 64, 64);
+  is(ctx->width, 64, "same size: width unchanged");
+  is(ctx->height, 64, "same size: height unchanged");
+  sampler_free(ctx);
+}
+
+static unsigned clear_dir(const char *dir) {
+  unsigned n = 0;
+  DIR *dh = opendir(dir);
+  if (!dh) return 0;
+  for (struct dirent *de; (de = readdir(dh));) {
+    if (de->d_name[0] == '.') continue;
+    char *name = ssprintf("%s/%s", dir, de->d_name);
+    unlink(name);
+    free(name);
+    n++;
+  }
+  closedir(dh);
+  return n;
+}
+
+static void test_cache(void) {
+  char dir[] = "/tmp/voronoi-test-XXXXXX";
+  const char *spec = "spiral:r_rate=2,a_rate=3";
+  uint8_t frame[80 * 60], big[160 * 120];
+
+  if (!mkdtemp(dir)) die("Can't make temporary directory");
+  fill_random(frame, sizeof(frame));
+  upscale(big, frame, 80, 60, 2);
+
+  sampler_set_cache("");
+  sampler_context *ref = sampler_new(spec, "ref");
+  size_t len = sampler_init(ref, 80, 60);
+  const double *want = sampler_sample(ref, frame);
+
+  sampler_set_cache(dir);
+
+  sampler_context *built = sampler_new(spec, "built");
+  is(sampler_init(built, 80, 60), len, "built length");
+  ok(!memcmp(sampler_sample(built, frame), want, sizeof(double) * len), "built samples");
+
+  sampler_context *loaded = sampler_new(spec, "loaded");
+  is(sampler_init(loaded, 80, 60), len, "cached length");
+  ok(!memcmp(sampler_sample(loaded, frame), want, sizeof(double) * len), "cached samples");
+
+  sampler_project(loaded, 160, 120);
+  ok(!memcmp(sampler_sample(loaded, big), want, sizeof(double) * len),
+     "cached map projects");
+
+  sampler_context *other = sampler_new(spec, "other");
+  sampler_init(other, 60, 80);
+
+  /* scribble over the end of the map, where the runs are */
+  char *file = sampler_cache_file(built, "vmap");
+  FILE *fh = fopen(file, "r+b");
+  if (!fh || fseek(fh, 0, SEEK_END)) die("Can't open %s", file);
+  long size = ftell(fh);
+  fseek(fh, size / 2, SEEK_SET);
+  for (long i = size / 2; i < size; i++) fputc(0xff, fh);
+  fclose(fh);
+  free(file);
+
+  sampler_context *mended = sampler_new(spec, "mended");
+  is(sampler_init(mended, 80, 60), len, "corrupt map rebuilt");
+  ok(!memcmp(sampler_sample(mended, frame), want, sizeof(double) * len),
+     "rebuilt map samples");
+
+  sampler_free(ref);
+  sampler_free(built);
+  sampler_free(loaded);
+  sampler_free(other);
+  sampler_free(mended);
+
+  is(clear_dir(dir), 2, "one map per size");
+  rmdir(dir);
+  sampler_set_cache("");
+}
+
+void test_main(void) {
+  voronoi_register();
+  test_same_size();
+  test_project(64, 64, 2);
+  test_project(48, 32, 3);
+  test_cache();
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
@@ -2,6 +2,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "colour.h"
 #include "framework.h"
@@ -88,6 +90,87 @@ static void test_parse(void) {
   y4m2_free_parms(p);
 }
 
+typedef struct {
+  unsigned count;
+  uint64_t first_seq;
+  int first_val;
+  double first_elapsed;
+} skip_log;
+
+static void skip_cb(y4m2_reason reason, const y4m2_parameters *parms,
+                    y4m2_frame *frame, void *ctx) {
+  skip_log *sl = ctx;
+  (void) parms;
+  if (reason != Y4M2_FRAME) return;
+  if (!sl->count++) {
+    sl->first_seq = frame->sequence;
+    sl->first_val = frame->buf[0];
+    sl->first_elapsed = frame->elapsed;
+  }
+  y4m2_release_frame(frame);
+}
+
+/* ten 8x8 frames filled with their number; frame 3 has a parameter */
+static FILE *skip_stream(int tagged) {
+  FILE *fl = tmpfile();
+  if (!fl) die("Can't create temporary file");
+  fputs("YUV4MPEG2 W8 H8 F25:1 C420\n", fl);
+  for (int f = 0; f < 10; f++) {
+    fputs(tagged && f == 3 ? "FRAME Ip\n" : "FRAME\n", fl);
+    for (int i = 0; i < 8 * 8 * 3 / 2; i++) fputc(f, fl);
+  }
+  rewind(fl);
+  return fl;
+}
+
+static void check_skip(const char *desc, FILE *fl, uint64_t skip,
+                       unsigned want_count, int want_first) {
+  skip_log sl;
+  memset(&sl, 0, sizeof(sl));
+  y4m2_parse_skip(fl, y4m2_output_next(skip_cb, &sl), skip);
+
+  ok(sl.count == want_count, "%s: %u frames", desc, want_count);
+  if (want_count) {
+    ok(sl.first_seq == (uint64_t) want_first && sl.first_val == want_first,
+       "%s: starts at frame %d", desc, want_first);
+    ok(sl.first_elapsed > want_first * 0.04 - 1e-9 && sl.first_elapsed < want_first * 0.04 + 1e-9,
+       "%s: elapsed time carried", desc);
+  }
+}
+
+static void test_parse_skip(void) {
+  FILE *fl = skip_stream(0);
+  check_skip("seek", fl, 4, 6, 4);
+  rewind(fl);
+  check_skip("skip everything", fl, 20, 0, 0);
+  rewind(fl);
+  check_skip("no skip", fl, 0, 10, 0);
+  fclose(fl);
+
+  fl = skip_stream(1);
+  check_skip("tagged frame", fl, 6, 4, 6);
+  fclose(fl);
+
+  /* a pipe can't seek */
+  FILE *src = skip_stream(1);
+  int pfd[2];
+  if (pipe(pfd)) die("Can't create pipe");
+  if (fork() == 0) {
+    int ch;
+    close(pfd[0]);
+    FILE *out = fdopen(pfd[1], "w");
+    while ((ch = getc(src)) != EOF) putc(ch, out);
+    fclose(out);
+    _exit(0);
+  }
+  close(pfd[1]);
+  fclose(src);
+  fl = fdopen(pfd[0], "r");
+  check_skip("pipe", fl, 7, 3, 7);
+  fclose(fl);
+  wait(NULL);
+}
+
 static void random_frame(y4m2_frame *frame) {
   uint8_t *bp = frame->buf;
   for (unsigned p = 0; p < Y4M2_N_PLANE; p++) {
@@ -340,6 +423,7 @@ void test_main(void) {
   test_parms();
   test_adjust_parms();
   test_parse();
+  test_parse_skip();
   test_float();
   test_notes();
   test_drawing();
@@ -104,6 +104,26 @@ static void test_grid(int w, int h) {
   sampler_free(ctx);
 }
 
+static void test_scan(const char *spec, int w, int h) {
+  uint8_t in[w * h];
+  double ref[w * h];
+
+  for (int i = 0; i < w * h; i++) in[i] = (uint8_t)(i * 37 + 11);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int sx = (!strcmp(spec, "weave") && (y & 1)) ? w - 1 - x : x;
+      ref[x + y * w] = ((double) in[sx + y * w] - 128) / 128;
+    }
+
+  sampler_context *ctx = sampler_new(spec, spec);
+  size_t size = sampler_init(ctx, w, h);
+  double *out = sampler_sample(ctx, in);
+
+  ok(size == (size_t)(w * h) && 0 == memcmp(ref, out, sizeof(double) * w * h),
+     "%s %d x %d", spec, w, h);
+  sampler_free(ctx);
+}
+
 static void test_zigzag(void) {
   zigzag_register();
 
@@ -115,6 +135,13 @@ static void test_zigzag(void) {
   test_grid(10, 11);
   test_grid(11, 10);
   test_grid(256, 256);
+
+  static const int sizes[][2] = { {1, 1}, {15, 3}, {16, 4}, {37, 5}, {64, 64} };
+  for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    test_scan("raster", sizes[i][0], sizes[i][1]);
+    test_scan("weave", sizes[i][0], sizes[i][1]);
+  }
+
 }
 
 void test_main(void) {
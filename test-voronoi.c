@@ -0,0 +1,179 @@
+/* test-voronoi.c */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sampler.h"
+#include "util.h"
+#include "voronoi.h"
+
+#define PROG      "test-voronoi"
+
+static unsigned cfg_count = 3;
+static int cfg_jobs = 0;
+static double cfg_r_rate = 2.25;
+static double cfg_a_rate = 3.375;
+
+static void usage() {
+  fprintf(stderr, "Usage: " PROG " [options] [<size>...]\n\n"
+          "Time voronoi map construction at each size (default 128 256 512 1024)\n"
+          "with one thread and with many, and check that the maps agree.\n\n"
+          "Options:\n"
+          "  -h, --help                See this message\n"
+          "  -a, --a-rate <n>          Spiral a_rate (default 3.375)\n"
+          "  -c, --count <n>           Builds to time at each size (default 3)\n"
+          "  -j, --jobs <n>            Threads (default: one per CPU)\n"
+          "  -r, --r-rate <n>          Spiral r_rate (default 2.25)\n"
+          "\n"
+         );
+  exit(1);
+}
+
+static double parse_double(const char *num) {
+  char *ep;
+  double v = strtod(num, &ep);
+  if (ep == num || *ep) die("Bad number: %s", num);
+  return v;
+}
+
+static void parse_options(int *argc, char ***argv) {
+  int ch, oidx;
+
+  static struct option opts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"a-rate", required_argument, NULL, 'a'},
+    {"count", required_argument, NULL, 'c'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"r-rate", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (ch = getopt_long(*argc, *argv, "a:c:hj:r:", opts, &oidx), ch != -1) {
+    switch (ch) {
+
+    case 'a':
+      cfg_a_rate = parse_double(optarg);
+      break;
+
+    case 'c':
+      cfg_count = (unsigned) parse_double(optarg);
+      if (cfg_count < 1) cfg_count = 1;
+      break;
+
+    case 'j':
+      cfg_jobs = atoi(optarg);
+      break;
+
+    case 'r':
+      cfg_r_rate = parse_double(optarg);
+      break;
+
+    case 'h':
+    default:
+      usage();
+      break;
+
+    }
+  }
+
+  *argc -= optind;
+  *argv += optind;
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Best of cfg_count builds. The last sampler built is returned in *ctxp. */
+static double time_build(const char *spec, unsigned size, unsigned threads,
+                         sampler_context **ctxp, size_t *lenp) {
+  double best = 0;
+
+  voronoi_set_threads(threads);
+
+  for (unsigned i = 0; i < cfg_count; i++) {
+    sampler_context *ctx = sampler_new(spec, "bench");
+    double start = now();
+    *lenp = sampler_init(ctx, size, size);
+    double took = now() - start;
+    if (i == 0 || took < best) best = took;
+    if (i == cfg_count - 1) *ctxp = ctx;
+    else sampler_free(ctx);
+  }
+
+  return best;
+}
+
+static void bench(unsigned size, unsigned threads, const uint8_t *frame) {
+  char *spec = ssprintf("spiral:r_rate=%g,a_rate=%g", cfg_r_rate, cfg_a_rate);
+  sampler_context *one, *many;
+  size_t len_one, len_many;
+
+  double t_one = time_build(spec, size, 1, &one, &len_one);
+  double t_many = time_build(spec, size, threads, &many, &len_many);
+
+  /* maps that sample a noisy frame the same way are the same maps */
+  int same = len_one == len_many &&
+             !memcmp(sampler_sample(one, frame), sampler_sample(many, frame),
+                     sizeof(double) * len_one);
+
+  printf("%6u %8lu %12.2f %12.2f %8.2f   %s\n", size, (unsigned long) len_one,
+         t_one * 1000, t_many * 1000, t_many > 0 ? t_one / t_many : 0,
+         same ? "yes" : "NO");
+
+  sampler_free(one);
+  sampler_free(many);
+  free(spec);
+
+  if (!same) die("Maps differ at %ux%u", size, size);
+}
+
+int main(int argc, char *argv[]) {
+  static const unsigned default_sizes[] = { 128, 256, 512, 1024 };
+
+  parse_options(&argc, &argv);
+  log_level = ERROR;
+
+  /* time building maps, not loading them from $DOWNTOWN_CACHE */
+  sampler_set_cache("");
+
+  unsigned threads = cfg_jobs > 0 ? (unsigned) cfg_jobs : (unsigned) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+
+  voronoi_register();
+
+  unsigned n_sizes = argc ? (unsigned) argc : sizeof(default_sizes) / sizeof(default_sizes[0]);
+  unsigned *sizes = alloc(sizeof(unsigned) * n_sizes);
+  unsigned max_size = 0;
+  for (unsigned i = 0; i < n_sizes; i++) {
+    sizes[i] = argc ? (unsigned) parse_double(argv[i]) : default_sizes[i];
+    if (sizes[i] < 1) die("Bad size: %s", argv[i]);
+    max_size = MAX(max_size, sizes[i]);
+  }
+
+  uint8_t *frame = alloc_no_clear((size_t) max_size * max_size);
+  for (size_t i = 0; i < (size_t) max_size * max_size; i++)
+    frame[i] = (uint8_t) random();
+
+  printf("# r_rate=%g, a_rate=%g, best of %u\n", cfg_r_rate, cfg_a_rate, cfg_count);
+  printf("%6s %8s %12s %12s %8s   %s\n", "size", "points", "1 thread ms",
+         "threads ms", "speedup", "same");
+
+  for (unsigned i = 0; i < n_sizes; i++)
+    bench(sizes[i], threads, frame);
+
+  free(frame);
+  free(sizes);
+
+  return 0;
+}
+
+/* vim:ts=2:sw=2:sts=2:et:ft=c
+ */
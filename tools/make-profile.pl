@@ -21,10 +21,11 @@ Options:
 EOT
 
 my %SAMPLER = (
-  spiral => 'r_rate=5,a_rate=5,area_limit=1.2,edge_trim=1',
-  zigzag => '',
-  weave  => '',
-  raster => '',
+  spiral  => 'r_rate=5,a_rate=5,area_limit=1.2,edge_trim=1',
+  hilbert => 'length=0',
+  zigzag  => '',
+  weave   => '',
+  raster  => '',
 );
 
 my %O = ( params => undef, );
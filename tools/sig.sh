@@ -12,8 +12,9 @@ for obj in "$@"; do
 
       tmp="$sig.tmp"
 
+      # an interrupted run leaves $tmp behind to be resumed
       ffmpeg -nostdin -i "$mov"  -pix_fmt yuv420p -s 256x256 -f yuv4mpegpipe - \
-        | ./downtown-sig --output "$tmp" && mv "$tmp" "$sig" || exit
+        | ./downtown-sig --resume --output "$tmp" && mv "$tmp" "$sig" || exit
 
     fi
 
@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# a failed or truncated decode must not leave .dat files behind
+set -o pipefail
+
 DURATION=240
 
 for obj in "$@"; do
@@ -8,6 +11,9 @@ for obj in "$@"; do
         || echo "$obj"
     } | while read src; do
 
+    args=()
+    dats=()
+
     for parm in                                         \
       "size=128; spiral='r_rate=1.500,a_rate=3.375'"    \
       "size=128; spiral='r_rate=2.250,a_rate=3.375'"    \
@@ -44,32 +50,31 @@ for obj in "$@"; do
       "size=512; spiral='r_rate=11.391,a_rate=7.594'"   \
       "size=512; spiral='r_rate=11.391,a_rate=11.391'"; do
       eval $parm;
-      echo "src: $src, size: $size, spiral: $spiral"
 
       dat="$src.$size.$spiral.dat"
-      if [ "$src" -nt "$dat" ]; then
-
-        y4m2="$src.$size.y4m2"
-        if [ "$src" -nt "$y4m2" ]; then
-          y4m2_t="$y4m2.tmp.y4m2"
-          ffmpeg                  \
-            -nostdin              \
-            -t "$DURATION"        \
-            -i "$src"             \
-            -s "${size}x${size}"  \
-            -pix_fmt yuv420p      \
-            -f yuv4mpegpipe       \
-            -y "$y4m2_t"          \
-              && mv "$y4m2_t" "$y4m2" || exit
-        fi
-
-        dat_t="$dat.tmp.dat"
-        ./downtown-sig --input "$y4m2" --raw "$dat_t" --sampler "spiral:$spiral" \
-          && mv "$dat_t" "$dat" || exit
+      if [ "$src" -nt "$dat" ] && [[ " ${dats[*]} " != *" $dat "* ]]; then
+        echo "src: $src, size: $size, spiral: $spiral"
+        args+=(--size "${size}x${size}" --sampler "spiral:$spiral" --raw "$dat.tmp.dat")
+        dats+=("$dat")
       fi
 
     done
 
+    # one decode of the source feeds every stale combination
+    if [ ${#dats[@]} -gt 0 ]; then
+      ffmpeg                  \
+        -nostdin              \
+        -t "$DURATION"        \
+        -i "$src"             \
+        -pix_fmt yuv420p      \
+        -f yuv4mpegpipe       \
+        - | ./downtown-sig --input - "${args[@]}" || exit
+
+      for dat in "${dats[@]}"; do
+        mv "$dat.tmp.dat" "$dat" || exit
+      done
+    fi
+
   done
 done
 
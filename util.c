@@ -81,23 +81,49 @@ char *aspect_ratio(int w, int h) {
   return ssprintf("%d:%d", w / g, h / g);
 }
 
-void mkpath(const char *path, mode_t mode) {
-  if (mkdir(path, mode) == 0 || errno == EEXIST) return;
+/* Like mkpath but returns -1 with errno set instead of dying */
+int try_mkpath(const char *path, mode_t mode) {
+  if (mkdir(path, mode) == 0 || errno == EEXIST) return 0;
   char *pcopy = sstrdup(path);
   char *parent = sstrdup(dirname(pcopy));
-  mkpath(parent, mode);
+  int rc = try_mkpath(parent, mode);
+  int err = errno;
   free(parent);
   free(pcopy);
-  if (mkdir(path, mode) && errno != EEXIST)
-    die("Can't create %s: %s", strerror(errno));
+  if (rc) {
+    errno = err;
+    return -1;
+  }
+  if (mkdir(path, mode) && errno != EEXIST) return -1;
+  return 0;
 }
 
-void mkparents(const char *path, mode_t mode) {
+int try_mkparents(const char *path, mode_t mode) {
   char *pcopy = sstrdup(path);
   char *parent = sstrdup(dirname(pcopy));
-  mkpath(parent, mode);
+  int rc = try_mkpath(parent, mode);
+  int err = errno;
   free(parent);
   free(pcopy);
+  errno = err;
+  return rc;
+}
+
+void mkpath(const char *path, mode_t mode) {
+  if (try_mkpath(path, mode))
+    die("Can't create %s: %s", path, strerror(errno));
+}
+
+void mkparents(const char *path, mode_t mode) {
+  if (try_mkparents(path, mode))
+    die("Can't create parents of %s: %s", path, strerror(errno));
+}
+
+/* 64 bit FNV-1a of data, continuing from h. Start with FNV_OFFSET. */
+uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+  const unsigned char *dp = data;
+  while (len--) h = (h ^ *dp++) * FNV_PRIME;
+  return h;
 }
 
 /* vim:ts=2:sw=2:sts=2:et:ft=c
@@ -8,11 +8,15 @@ extern "C" {
 #endif
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
 void die(const char *msg, ...);
 void *alloc_no_clear(size_t size);
 void *alloc(size_t size);
@@ -24,6 +28,9 @@ char *aspect_ratio(int w, int h);
 void *memdup(const void *in, size_t size);
 void mkpath(const char *path, mode_t mode);
 void mkparents(const char *path, mode_t mode);
+int try_mkpath(const char *path, mode_t mode);
+int try_mkparents(const char *path, mode_t mode);
+uint64_t fnv1a(uint64_t h, const void *data, size_t len);
 
 #ifdef __cplusplus
 }
@@ -1,24 +1,112 @@
 /* voronoi.c */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "quadtree.h"
+#include "sad.h"
 #include "sampler.h"
 #include "util.h"
 #include "voronoi.h"
 #include "y4m2png.h"
 #include "yuv4mpeg2.h"
 
+#define MAP_ROWS  16
+
+/* Pixels [start, start + len) of a row all belong to region */
+typedef struct {
+  uint16_t region, start, len;
+} voronoi_run16;
+
+typedef struct {
+  uint32_t region, start, len;
+} voronoi_run32;
+
 typedef struct {
   unsigned *xlate;
   double *area;
   quadtree *qt;
   unsigned n_points;
+
+  /* xlate compiled by _compile: row y's runs are [row_runs[y],
+   * row_runs[y + 1]). Excluded pixels have no run. runs holds
+   * voronoi_run32 if wide, voronoi_run16 otherwise.
+   */
+  uint64_t *row_runs;
+  size_t n_runs;
+  void *runs;
+  int wide;
+  uint64_t *sum;
+
+  /* a cached map; the arrays above may point into it */
+  void *map;
+  size_t map_size;
 } voronoi_context;
 
+/* Cached maps (.vmap)
+ *
+ * A voronoi_map_header, the NUL terminated sampler spec and then area,
+ * xlate, row_runs and runs, each at a voronoi_MAP_ALIGN boundary. Maps
+ * are mapped privately so _project() can change them in memory.
+ */
+#define voronoi_MAP_MAGIC   "DTVMAP\0\0"
+#define voronoi_MAP_VERSION 1
+#define voronoi_MAP_BOM     0x01020304
+#define voronoi_MAP_ALIGN   64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint32_t width, height;
+  uint32_t n_points;
+  uint32_t wide;
+  uint64_t count;
+  uint64_t n_runs;
+  uint64_t spec_len;
+  uint64_t area, xlate, row_runs, runs;
+  uint64_t size;
+} voronoi_map_header;
+
+typedef struct {
+  sampler_context *ctx;
+  unsigned next;
+  pthread_mutex_t mutex;
+} voronoi_map_work;
+
+typedef struct {
+  double r_rate, a_rate;
+  double area_limit;
+  double edge_trim;
+  const char *dump;
+} voronoi_config;
+
+static const sampler_schema voronoi_schema[] = {
+  { "r_rate", sampler_NUMBER, "5", offsetof(voronoi_config, r_rate) },
+  { "a_rate", sampler_NUMBER, "5", offsetof(voronoi_config, a_rate) },
+  { "area_limit", sampler_NUMBER, "1.2", offsetof(voronoi_config, area_limit) },
+  { "edge_trim", sampler_NUMBER, "1", offsetof(voronoi_config, edge_trim) },
+  { "dump", sampler_TEXT, NULL, offsetof(voronoi_config, dump) },
+  { NULL, sampler_NUMBER, NULL, 0 }
+};
+
+static unsigned voronoi_threads = 0;
+
+/* Threads used to build maps; 0 for one per CPU */
+void voronoi_set_threads(unsigned threads) {
+  voronoi_threads = threads;
+}
+
 static voronoi_context *_init(sampler_context *ctx) {
   voronoi_context *vc = alloc(sizeof(voronoi_context));
 
@@ -79,7 +167,8 @@ static void _debug_dump_png(sampler_context *ctx, const char *name) {
 }
 
 static void _debug_dump(sampler_context *ctx) {
-  const char *dump_png = sampler_optional_text(ctx->params, "dump");
+  const voronoi_config *cfg = ctx->config;
+  const char *dump_png = cfg->dump;
   if (dump_png) {
     char *name = ssprintf(dump_png, ctx->name);
     log_debug("Writing voronoi map to %s", name);
@@ -140,8 +229,318 @@ static size_t _count_points(sampler_context *ctx) {
   return 0;
 }
 
+/* Free p unless it's part of a cached map */
+static void _release(voronoi_context *vc, void *p) {
+  const char *cp = p, *map = vc->map;
+  if (map && cp >= map && cp < map + vc->map_size) return;
+  free(p);
+}
+
+static size_t _count_runs(sampler_context *ctx, uint64_t *row_runs) {
+  voronoi_context *vc = ctx->user;
+  size_t n_runs = 0;
+
+  for (unsigned y = 0; y < ctx->height; y++) {
+    const unsigned *row = vc->xlate + y * ctx->width;
+    row_runs[y] = n_runs;
+    for (unsigned x = 0; x < ctx->width; x++)
+      if (row[x] != vc->n_points && (x == 0 || row[x] != row[x - 1]))
+        n_runs++;
+  }
+  row_runs[ctx->height] = n_runs;
+
+  return n_runs;
+}
+
+#define FILL_RUNS(type) do {                                            \
+    type *rp = vc->runs;                                                \
+    for (unsigned y = 0; y < ctx->height; y++) {                        \
+      const unsigned *row = vc->xlate + y * ctx->width;                 \
+      for (unsigned x = 0; x < ctx->width;) {                           \
+        unsigned xl = row[x], start = x;                                \
+        while (x < ctx->width && row[x] == xl) x++;                     \
+        if (xl == vc->n_points) continue;                               \
+        rp->region = xl;                                                \
+        rp->start = start;                                              \
+        rp->len = x - start;                                            \
+        rp++;                                                           \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+/* Compile xlate into runs so sampling reads each included pixel once,
+ * in order, and nothing else.
+ */
+static void _compile(sampler_context *ctx) {
+  voronoi_context *vc = ctx->user;
+
+  _release(vc, vc->row_runs);
+  _release(vc, vc->runs);
+
+  vc->row_runs = alloc(sizeof(uint64_t) * (ctx->height + 1));
+  size_t n_runs = vc->n_runs = _count_runs(ctx, vc->row_runs);
+
+  vc->wide = vc->n_points > UINT16_MAX + 1 || ctx->width > UINT16_MAX;
+  if (vc->wide) {
+    vc->runs = alloc(sizeof(voronoi_run32) * (n_runs + 1));
+    FILL_RUNS(voronoi_run32);
+  }
+  else {
+    vc->runs = alloc(sizeof(voronoi_run16) * (n_runs + 1));
+    FILL_RUNS(voronoi_run16);
+  }
+
+  if (!vc->sum) vc->sum = alloc(sizeof(uint64_t) * vc->n_points);
+
+  log_debug("Compiled %ux%u voronoi map to %llu %s bit runs",
+            ctx->width, ctx->height, (unsigned long long) n_runs,
+            vc->wide ? "32" : "16");
+}
+
+static void *_map_worker(void *arg) {
+  voronoi_map_work *mw = arg;
+  sampler_context *ctx = mw->ctx;
+  voronoi_context *vc = ctx->user;
+
+  for (;;) {
+    pthread_mutex_lock(&mw->mutex);
+    unsigned from = mw->next;
+    mw->next += MAP_ROWS;
+    pthread_mutex_unlock(&mw->mutex);
+
+    if (from >= ctx->height) break;
+    unsigned to = MIN(from + MAP_ROWS, ctx->height);
+
+    for (unsigned y = from; y < to; y++) {
+      unsigned *row = vc->xlate + y * ctx->width;
+      for (unsigned x = 0; x < ctx->width; x++)
+        row[x] = quadtree_nearest(vc->qt, x, y)->tag;
+    }
+  }
+
+  return NULL;
+}
+
+/* Find the nearest point to every pixel. Each pixel gets the point a
+ * lone query would give it so the map doesn't depend on the number of
+ * threads that share out the rows.
+ */
+static void _build_map(sampler_context *ctx) {
+  voronoi_context *vc = ctx->user;
+  voronoi_map_work mw;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned threads = voronoi_threads ? voronoi_threads : cpus > 0 ? (unsigned) cpus : 1;
+
+  threads = MIN(threads, (ctx->height + MAP_ROWS - 1) / MAP_ROWS);
+
+  /* index up front: the workers share the tree */
+  quadtree_index(vc->qt);
+
+  mw.ctx = ctx;
+  mw.next = 0;
+  pthread_mutex_init(&mw.mutex, NULL);
+
+  if (threads > 1) {
+    pthread_t thread[threads];
+    for (unsigned i = 0; i < threads; i++)
+      if (pthread_create(&thread[i], NULL, _map_worker, &mw))
+        die("Can't create thread");
+    for (unsigned i = 0; i < threads; i++)
+      pthread_join(thread[i], NULL);
+  }
+  else {
+    _map_worker(&mw);
+  }
+
+  pthread_mutex_destroy(&mw.mutex);
+
+  for (size_t i = 0; i < (size_t) ctx->width * ctx->height; i++)
+    vc->area[vc->xlate[i]]++;
+}
+
+static size_t _map_align(size_t off) {
+  return (off + voronoi_MAP_ALIGN - 1) & ~(size_t)(voronoi_MAP_ALIGN - 1);
+}
+
+static size_t _runs_size(const voronoi_context *vc) {
+  return vc->n_runs * (vc->wide ? sizeof(voronoi_run32) : sizeof(voronoi_run16));
+}
+
+/* Does an array of count size byte elements at off fit in map_size
+ * bytes and start on an alignment boundary?
+ */
+static int _map_fits(uint64_t off, uint64_t count, size_t size, size_t map_size) {
+  return off % voronoi_MAP_ALIGN == 0 && off <= map_size &&
+         count <= (map_size - off) / size;
+}
+
+#define CHECK_RUNS(type) do {                                           \
+    const type *rp = (const type *) runs;                               \
+    for (unsigned y = 0; y < ctx->height; y++) {                        \
+      const type *end = rp + row_runs[y + 1] - row_runs[y];             \
+      for (; rp != end; rp++)                                           \
+        if (rp->region >= hdr->n_points ||                              \
+            rp->start > ctx->width || rp->len > ctx->width - rp->start) \
+          return 0;                                                     \
+    }                                                                   \
+  } while (0)
+
+/* Check everything a sampler will index with, so a damaged map can't
+ * send it outside its arrays.
+ */
+static int _map_valid(sampler_context *ctx, const voronoi_map_header *hdr, size_t map_size) {
+  const char *map = (const char *) hdr;
+  const size_t pixels = (size_t) ctx->width * ctx->height;
+  const size_t run_size = hdr->wide ? sizeof(voronoi_run32) : sizeof(voronoi_run16);
+
+  if (!_map_fits(hdr->area, hdr->n_points, sizeof(double), map_size) ||
+      !_map_fits(hdr->xlate, pixels, sizeof(unsigned), map_size) ||
+      !_map_fits(hdr->row_runs, ctx->height + 1, sizeof(uint64_t), map_size) ||
+      !_map_fits(hdr->runs, hdr->n_runs, run_size, map_size) ||
+      hdr->count > hdr->n_points)
+    return 0;
+
+  const unsigned *xlate = (const unsigned *)(map + hdr->xlate);
+  for (size_t i = 0; i < pixels; i++)
+    if (xlate[i] > hdr->n_points) return 0;
+
+  const uint64_t *row_runs = (const uint64_t *)(map + hdr->row_runs);
+  if (row_runs[0] != 0 || row_runs[ctx->height] != hdr->n_runs) return 0;
+  for (unsigned y = 0; y < ctx->height; y++)
+    if (row_runs[y + 1] < row_runs[y]) return 0;
+
+  const void *runs = map + hdr->runs;
+  if (hdr->wide) CHECK_RUNS(voronoi_run32);
+  else CHECK_RUNS(voronoi_run16);
+
+  return 1;
+}
+
+/* Use the map in filename if it's there and for this sampler. Returns
+ * the sampler's length or 0 to build it.
+ */
+static size_t _cache_load(sampler_context *ctx, const char *filename) {
+  voronoi_context *vc = ctx->user;
+  const char *spec = sampler_spec(ctx);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) || (size_t) st.st_size < sizeof(voronoi_map_header)) {
+    close(fd);
+    return 0;
+  }
+
+  size_t map_size = st.st_size;
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  const voronoi_map_header *hdr = map;
+
+  if (memcmp(hdr->magic, voronoi_MAP_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != voronoi_MAP_VERSION || hdr->bom != voronoi_MAP_BOM ||
+      hdr->size != map_size || hdr->width != ctx->width || hdr->height != ctx->height ||
+      hdr->spec_len != strlen(spec) + 1 ||
+      sizeof(*hdr) + hdr->spec_len > map_size ||
+      memcmp(hdr + 1, spec, hdr->spec_len) ||
+      !_map_valid(ctx, hdr, map_size)) {
+    log_warning("Ignoring stale or corrupt map %s", filename);
+    munmap(map, map_size);
+    return 0;
+  }
+
+  vc->map = map;
+  vc->map_size = map_size;
+  vc->n_points = hdr->n_points;
+  vc->wide = hdr->wide;
+  vc->n_runs = hdr->n_runs;
+  vc->area = (double *)((char *) map + hdr->area);
+  vc->xlate = (unsigned *)((char *) map + hdr->xlate);
+  vc->row_runs = (uint64_t *)((char *) map + hdr->row_runs);
+  vc->runs = (char *) map + hdr->runs;
+
+  ctx->buf = alloc(sizeof(double) * vc->n_points);
+  vc->sum = alloc(sizeof(uint64_t) * vc->n_points);
+
+  log_debug("Loaded voronoi map from %s", filename);
+  return hdr->count;
+}
+
+static int _write_at(int fd, uint64_t off, const void *data, size_t len) {
+  return pwrite(fd, data, len, off) == (ssize_t) len;
+}
+
+/* Save the map for other samplers with the same spec and size. It's
+ * written to a temporary file and renamed into place so readers never
+ * see part of one. Failure costs only time, so it's just logged.
+ */
+static void _cache_save(sampler_context *ctx, const char *filename, size_t count) {
+  voronoi_context *vc = ctx->user;
+  const char *spec = sampler_spec(ctx);
+  const size_t pixels = (size_t) ctx->width * ctx->height;
+  voronoi_map_header hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, voronoi_MAP_MAGIC, sizeof(hdr.magic));
+  hdr.version = voronoi_MAP_VERSION;
+  hdr.bom = voronoi_MAP_BOM;
+  hdr.width = ctx->width;
+  hdr.height = ctx->height;
+  hdr.n_points = vc->n_points;
+  hdr.wide = vc->wide;
+  hdr.count = count;
+  hdr.n_runs = vc->n_runs;
+  hdr.spec_len = strlen(spec) + 1;
+  hdr.area = _map_align(sizeof(hdr) + hdr.spec_len);
+  hdr.xlate = _map_align(hdr.area + sizeof(double) * vc->n_points);
+  hdr.row_runs = _map_align(hdr.xlate + sizeof(unsigned) * pixels);
+  hdr.runs = _map_align(hdr.row_runs + sizeof(uint64_t) * (ctx->height + 1));
+  hdr.size = _map_align(hdr.runs + _runs_size(vc));
+
+  if (try_mkparents(filename, 0777)) {
+    log_warning("Can't cache voronoi map in %s: %s", filename, strerror(errno));
+    return;
+  }
+
+  char *tmp = ssprintf("%s.%ld.tmp", filename, (long) getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  if (fd < 0 ||
+      ftruncate(fd, hdr.size) ||
+      !_write_at(fd, 0, &hdr, sizeof(hdr)) ||
+      !_write_at(fd, sizeof(hdr), spec, hdr.spec_len) ||
+      !_write_at(fd, hdr.area, vc->area, sizeof(double) * vc->n_points) ||
+      !_write_at(fd, hdr.xlate, vc->xlate, sizeof(unsigned) * pixels) ||
+      !_write_at(fd, hdr.row_runs, vc->row_runs, sizeof(uint64_t) * (ctx->height + 1)) ||
+      !_write_at(fd, hdr.runs, vc->runs, _runs_size(vc)) ||
+      close(fd) ||
+      rename(tmp, filename)) {
+    log_warning("Can't cache voronoi map in %s: %s", filename, strerror(errno));
+    if (fd >= 0) close(fd);
+    unlink(tmp);
+  }
+  else {
+    log_debug("Cached voronoi map in %s", filename);
+  }
+
+  free(tmp);
+}
+
 static size_t _setup(sampler_context *ctx) {
   voronoi_context *vc = ctx->user;
+  const voronoi_config *cfg = ctx->config;
+
+  /* a map loaded from the cache can't be dumped */
+  char *cache = cfg->dump ? NULL : sampler_cache_file(ctx, "vmap");
+  if (cache) {
+    size_t count = _cache_load(ctx, cache);
+    if (count) {
+      free(cache);
+      return count;
+    }
+  }
 
   vc->xlate = alloc(sizeof(unsigned) * ctx->width * ctx->height);
 
@@ -149,20 +548,21 @@ static size_t _setup(sampler_context *ctx) {
   vc->area = alloc(sizeof(double) * vc->n_points);
   ctx->buf = alloc(sizeof(double) * vc->n_points);
 
-  /* build voronoi map */
-  for (unsigned y = 0; y < ctx->height; y++) {
-    for (unsigned x = 0; x < ctx->width; x++) {
-      const quadtree_point *pt = quadtree_nearest(vc->qt, x, y);
-      vc->area[pt->tag]++;
-      vc->xlate[x + y * ctx->width] = pt->tag;
-    }
-  }
+  _build_map(ctx);
 
-  _area_limit(ctx, sampler_require_double(ctx->params, "area_limit"));
-  if (sampler_require_double(ctx->params, "edge_trim")) _edge_trim(ctx);
+  _area_limit(ctx, cfg->area_limit);
+  if (cfg->edge_trim) _edge_trim(ctx);
 
   _debug_dump(ctx);
-  return _count_points(ctx);
+  _compile(ctx);
+
+  size_t count = _count_points(ctx);
+  if (cache) {
+    _cache_save(ctx, cache, count);
+    free(cache);
+  }
+
+  return count;
 }
 
 static size_t _spiral_init(sampler_context *ctx) {
@@ -175,8 +575,9 @@ static size_t _spiral_init(sampler_context *ctx) {
   double a = 0;
   double r = 1;
 
-  double a_rate = sampler_require_double(ctx->params, "a_rate"); /* default 2.0 */
-  double r_rate = sampler_require_double(ctx->params, "r_rate"); /* default 1.0 */
+  const voronoi_config *cfg = ctx->config;
+  double a_rate = cfg->a_rate;
+  double r_rate = cfg->r_rate;
 
   int lx = 0, ly = 0;
   unsigned tag = 0;
@@ -197,29 +598,119 @@ static size_t _spiral_init(sampler_context *ctx) {
   return _setup(ctx);
 }
 
-static double *_sample(sampler_context *ctx, const uint8_t *in)  {
+#define SUM_RUNS(type) do {                                             \
+    const type *rp = vc->runs;                                          \
+    for (unsigned y = 0; y < ctx->height; y++) {                        \
+      const uint8_t *row = in + (size_t) y * stride;                    \
+      const type *end = rp + vc->row_runs[y + 1] - vc->row_runs[y];     \
+      for (; rp != end; rp++)                                           \
+        vc->sum[rp->region] += sad_sum_u8(row + rp->start, rp->len);    \
+    }                                                                   \
+  } while (0)
+
+static double *_sample(sampler_context *ctx, const uint8_t *in, unsigned stride)  {
   voronoi_context *vc = ctx->user;
-  size_t limit = ctx->width * ctx->height;
-  unsigned i;
 
-  memset(ctx->buf, 0, sizeof(double) * vc->n_points);
-  for (i = 0; i < limit; i++) {
-    unsigned xl = vc->xlate[i];
-    if (xl != vc->n_points)
-      ctx->buf[xl] += sampler_byte2double(in[i]);
-  }
+  memset(vc->sum, 0, sizeof(uint64_t) * vc->n_points);
+  if (vc->wide) SUM_RUNS(voronoi_run32);
+  else SUM_RUNS(voronoi_run16);
 
-  for (i = 0; i < vc->n_points; i++)
-    if (vc->area[i]) ctx->buf[i] /= vc->area[i];
+  /* the mean of sampler_byte2double of each pixel, exactly as summing
+   * them one at a time would give it
+   */
+  for (unsigned i = 0; i < vc->n_points; i++) {
+    double area = vc->area[i];
+    ctx->buf[i] = area ? ((double) vc->sum[i] - 128 * area) / 128 / area : 0;
+  }
 
   return ctx->buf;
 }
 
+/* Each run is summed for every frame in turn so the runs are read once
+ * a batch. The sums go straight into out: they're whole numbers well
+ * inside a double's precision so the results are exactly _sample's.
+ */
+#define SUM_RUNS_BATCH(type) do {                                       \
+    const type *rp = vc->runs;                                          \
+    for (unsigned y = 0; y < ctx->height; y++) {                        \
+      const type *end = rp + vc->row_runs[y + 1] - vc->row_runs[y];     \
+      for (size_t f = 0; f < n; f++)                                    \
+        row[f] = in[f] + (size_t) y * (stride ? stride[f] : ctx->width); \
+      for (; rp != end; rp++)                                           \
+        for (size_t f = 0; f < n; f++)                                  \
+          out[f * ld + rp->region] +=                                   \
+            (double) sad_sum_u8(row[f] + rp->start, rp->len);           \
+    }                                                                   \
+  } while (0)
+
+static void _sample_batch(sampler_context *ctx, const uint8_t *const *in,
+                          const unsigned *stride, size_t n,
+                          double *out, size_t ld) {
+  voronoi_context *vc = ctx->user;
+  const uint8_t **row = alloc_no_clear(sizeof(uint8_t *) * (n + 1));
+
+  for (size_t f = 0; f < n; f++)
+    memset(out + f * ld, 0, sizeof(double) * ctx->len);
+
+  if (vc->wide) SUM_RUNS_BATCH(voronoi_run32);
+  else SUM_RUNS_BATCH(voronoi_run16);
+
+  for (size_t f = 0; f < n; f++) {
+    double *op = out + f * ld;
+    for (size_t i = 0; i < ctx->len; i++) {
+      double area = vc->area[i];
+      op[i] = area ? (op[i] - 128 * area) / 128 / area : 0;
+    }
+  }
+
+  free(row);
+}
+
+/* Rebuild the map for w x h frames. Each pixel takes the region under
+ * its centre in the original map so regions keep their shape, and a
+ * region samples the mean of the pixels it covers instead of the mean of
+ * a scaled copy of them. Regions that no pixel lands in sample as zero.
+ */
+static void _project(sampler_context *ctx, unsigned w, unsigned h) {
+  voronoi_context *vc = ctx->user;
+  unsigned *xlate = alloc(sizeof(unsigned) * w * h);
+  unsigned *col = alloc(sizeof(unsigned) * w);
+
+  for (unsigned x = 0; x < w; x++)
+    col[x] = MIN((unsigned)((x + 0.5) * ctx->width / w), ctx->width - 1);
+
+  memset(vc->area, 0, sizeof(double) * vc->n_points);
+
+  for (unsigned y = 0; y < h; y++) {
+    unsigned py = MIN((unsigned)((y + 0.5) * ctx->height / h), ctx->height - 1);
+    const unsigned *src = vc->xlate + py * ctx->width;
+    unsigned *dst = xlate + y * w;
+    for (unsigned x = 0; x < w; x++) {
+      unsigned xl = dst[x] = src[col[x]];
+      if (xl != vc->n_points) vc->area[xl]++;
+    }
+  }
+
+  log_debug("Projected voronoi map from %ux%u to %ux%u",
+            ctx->width, ctx->height, w, h);
+
+  free(col);
+  _release(vc, vc->xlate);
+  vc->xlate = xlate;
+  ctx->width = w;
+  ctx->height = h;
+
+  _compile(ctx);
+}
 
 static void _free(sampler_context *ctx) {
   voronoi_context *vc = ctx->user;
-  free(vc->xlate);
-  free(vc->area);
+  _release(vc, vc->xlate);
+  _release(vc, vc->area);
+  _release(vc, vc->row_runs);
+  _release(vc, vc->runs);
+  free(vc->sum);
+  if (vc->map) munmap(vc->map, vc->map_size);
   quadtree_free(vc->qt);
 }
 
@@ -228,8 +719,12 @@ void voronoi_register(void) {
     .name = "spiral",
     .init = _spiral_init,
     .sample = _sample,
+    .sample_batch = _sample_batch,
     .free = _free,
-    .default_config = "r_rate=5,a_rate=5,area_limit=1.2,edge_trim=1"
+    .project = _project,
+    .schema = voronoi_schema,
+    .config_size = sizeof(voronoi_config),
+    .linear = 1
   };
 
   sampler_register(&spiral);
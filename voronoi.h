@@ -8,6 +8,7 @@ extern "C" {
 #endif
 
   void voronoi_register(void);
+  void voronoi_set_threads(unsigned threads);
 
 #ifdef __cplusplus
 }
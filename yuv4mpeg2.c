@@ -379,7 +379,50 @@ static void check_frames(int *allocated) {
   }
 }
 
+/* Step over the payload of the frame whose header has just been read
+ * and, when the input is seekable and frame headers are bare "FRAME"
+ * lines, jump straight past up to n - 1 more. Returns the number of
+ * frames passed.
+ */
+static uint64_t skip_frames(FILE *in, size_t size, size_t hdr_len, int bare, uint64_t n) {
+  off_t here = ftello(in);
+
+  if (here < 0 || fseeko(in, (off_t) size, SEEK_CUR)) {
+    char junk[65536];
+    while (size) {
+      size_t got = fread(junk, 1, MIN(size, sizeof(junk)), in);
+      if (!got) die("Short read");
+      size -= got;
+    }
+    return 1;
+  }
+
+  if (bare && n > 1) {
+    /* frames are all the same size; check the last one we'd skip
+     * really starts where we expect
+     */
+    off_t stride = (off_t)(hdr_len + size);
+    off_t last = here + (off_t) size + (off_t)(n - 2) * stride;
+    char hdr[16];
+
+    if (!fseeko(in, last, SEEK_SET) && fread(hdr, 1, hdr_len, in) == hdr_len
+        && !memcmp(hdr, "FRAME\n", hdr_len) && !fseeko(in, (off_t) size, SEEK_CUR))
+      return n;
+
+    if (fseeko(in, here + (off_t) size, SEEK_SET)) die("Seek failed");
+  }
+
+  return 1;
+}
+
 int y4m2_parse(FILE *in, y4m2_output *out) {
+  return y4m2_parse_skip(in, out, 0);
+}
+
+/* Parse a stream without emitting its first skip frames. Later frames
+ * keep the sequence numbers and times they'd have had anyway.
+ */
+int y4m2_parse_skip(FILE *in, y4m2_output *out, uint64_t skip) {
   char buf[1024];
   y4m2_parameters *global = NULL;
   uint64_t sequence = 0;
@@ -424,6 +467,18 @@ int y4m2_parse(FILE *in, y4m2_output *out) {
       y4m2_parameters *merged = y4m2_clone_parms(global);
       y4m2_merge_parms(merged, parms);
 
+      if (sequence < skip) {
+        y4m2_frame_info info;
+        y4m2_parse_frame_info(&info, merged);
+        int bare = c == '\n' && pos == strlen(tag[Y4M2_FRAME]) + 1;
+        uint64_t n = skip_frames(in, info.size, pos, bare, skip - sequence);
+        sequence += n;
+        elapsed += n * _frame_duration(merged);
+        y4m2_free_parms(parms);
+        y4m2_free_parms(merged);
+        continue;
+      }
+
       y4m2_frame *frame = y4m2_new_frame(merged);
       frame->sequence = sequence++;
       frame->elapsed = elapsed;
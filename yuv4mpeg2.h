@@ -114,6 +114,7 @@ int y4m2_has_notes(const y4m2_frame *frame);
 /* Pipeline */
 
 int y4m2_parse(FILE *in, y4m2_output *out);
+int y4m2_parse_skip(FILE *in, y4m2_output *out, uint64_t skip);
 int y4m2_emit_start(y4m2_output *out, const y4m2_parameters *parms);
 int y4m2_emit_frame(y4m2_output *out, const y4m2_parameters *parms, y4m2_frame *frame);
 int y4m2_emit_end(y4m2_output *out);
@@ -1,6 +1,7 @@
 /* zigzag.c */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -14,9 +15,18 @@ static size_t _init(sampler_context *ctx) {
   return ctx->width * ctx->height;
 }
 
-static void _zigzag_permute(double *out, const uint8_t *in, int w, int h) {
+/* The zigzag order depends only on the frame size so each diagonal's
+ * first pixel and length are worked out once. A table of every pixel's
+ * offset would be simpler but reading it costs more than it saves.
+ */
+typedef struct {
+  uint32_t x, y;
+  uint32_t count;
+} zigzag_diagonal;
+
+static zigzag_diagonal *_zigzag_plan(int w, int h) {
   unsigned limit = w + h - 1;
-  double *op = out;
+  zigzag_diagonal *plan = alloc(sizeof(zigzag_diagonal) * limit);
 
   for (unsigned x = 0; x < limit; x++) {
     int x0 = x;
@@ -26,41 +36,91 @@ static void _zigzag_permute(double *out, const uint8_t *in, int w, int h) {
     if (y1 >= h) y1 = h - 1;
     int x1 = x - y1;
 
-    const uint8_t *inp = (x & 1) ? (in + y0 * w + x0) : (in + y1 * w + x1);
-    int stride = (x & 1) ? (w - 1) : (1 - w);
-    unsigned count = x0 - x1 + 1;
+    plan[x].x = (x & 1) ? x0 : x1;
+    plan[x].y = (x & 1) ? y0 : y1;
+    plan[x].count = x0 - x1 + 1;
+  }
+
+  return plan;
+}
+
+static size_t _zigzag_init(sampler_context *ctx) {
+  free(ctx->user);
+  ctx->user = _zigzag_plan(ctx->width, ctx->height);
+  return _init(ctx);
+}
+
+static unsigned _stride(const sampler_context *ctx, const unsigned *stride, size_t i) {
+  return stride ? stride[i] : ctx->width;
+}
 
-    for (unsigned i = 0; i < count; i++) {
-      *op++ = sampler_byte2double(*inp);
-      inp += stride;
+/* Even diagonals start at their bottom left pixel and run up and to the
+ * right; odd ones start at their top right pixel and run down and to the
+ * left. A batch walks each diagonal of every frame before moving on so
+ * the plan is read once.
+ */
+static void _zigzag_batch(sampler_context *ctx, const uint8_t *const *in,
+                          const unsigned *stride, size_t n,
+                          double *out, size_t ld) {
+  const zigzag_diagonal *plan = ctx->user;
+  unsigned limit = ctx->width + ctx->height - 1;
+  size_t first = 0;
+
+  for (unsigned x = 0; x < limit; x++) {
+    for (size_t f = 0; f < n; f++) {
+      int diag = (int) _stride(ctx, stride, f) - 1;
+      const uint8_t *inp = in[f] + (size_t) plan[x].y * (diag + 1) + plan[x].x;
+      int step = (x & 1) ? diag : -diag;
+      double *op = out + f * ld + first;
+      for (unsigned i = 0; i < plan[x].count; i++) {
+        *op++ = sampler_byte2double(*inp);
+        inp += step;
+      }
     }
+    first += plan[x].count;
   }
 }
 
-static double *_zigzag_sample(sampler_context *ctx, const uint8_t *in)  {
-  _zigzag_permute(ctx->buf, in, ctx->width, ctx->height);
+static double *_zigzag_sample(sampler_context *ctx, const uint8_t *in, unsigned stride)  {
+  _zigzag_batch(ctx, &in, &stride, 1, ctx->buf, 0);
   return ctx->buf;
 }
 
-static void _b2d(double *out, const uint8_t *in, size_t size) {
-  for (unsigned i = 0; i < size; i++) *out++ = sampler_byte2double(*in++);
-}
-
-static void _b2dr(double *out, const uint8_t *in, size_t size) {
-  double *op = out + size;
-  for (unsigned i = 0; i < size; i++) *--op = sampler_byte2double(*in++);
+static void _raster_batch(sampler_context *ctx, const uint8_t *const *in,
+                          const unsigned *stride, size_t n,
+                          double *out, size_t ld) {
+  for (size_t f = 0; f < n; f++) {
+    unsigned st = _stride(ctx, stride, f);
+    if (st == ctx->width) {
+      sampler_bytes2double(out + f * ld, in[f], ctx->width * ctx->height);
+      continue;
+    }
+    for (unsigned y = 0; y < ctx->height; y++)
+      sampler_bytes2double(out + f * ld + ctx->width * y, in[f] + (size_t) st * y, ctx->width);
+  }
 }
 
-static double *_raster_sample(sampler_context *ctx, const uint8_t *in)  {
-  _b2d(ctx->buf, in, ctx->width * ctx->height);
+static double *_raster_sample(sampler_context *ctx, const uint8_t *in, unsigned stride)  {
+  _raster_batch(ctx, &in, &stride, 1, ctx->buf, 0);
   return ctx->buf;
 }
 
-static double *_weave_sample(sampler_context *ctx, const uint8_t *in)  {
-  for (unsigned y = 0; y < ctx->height; y++) {
-    if (y & 1) _b2dr(ctx->buf + ctx->width * y, in + ctx->width * y, ctx->width);
-    else _b2d(ctx->buf + ctx->width * y, in + ctx->width * y, ctx->width);
+static void _weave_batch(sampler_context *ctx, const uint8_t *const *in,
+                         const unsigned *stride, size_t n,
+                         double *out, size_t ld) {
+  for (size_t f = 0; f < n; f++) {
+    unsigned st = _stride(ctx, stride, f);
+    for (unsigned y = 0; y < ctx->height; y++) {
+      double *op = out + f * ld + ctx->width * y;
+      const uint8_t *ip = in[f] + (size_t) st * y;
+      if (y & 1) sampler_bytes2double_reverse(op, ip, ctx->width);
+      else sampler_bytes2double(op, ip, ctx->width);
+    }
   }
+}
+
+static double *_weave_sample(sampler_context *ctx, const uint8_t *in, unsigned stride)  {
+  _weave_batch(ctx, &in, &stride, 1, ctx->buf, 0);
   return ctx->buf;
 }
 
@@ -68,29 +128,39 @@ static void _free(sampler_context *ctx) {
   (void) ctx;
 }
 
+static void _zigzag_free(sampler_context *ctx) {
+  free(ctx->user);
+}
+
 void zigzag_register(void) {
   sampler_info zigzag = {
     .name = "zigzag",
-    .init = _init,
+    .init = _zigzag_init,
     .sample = _zigzag_sample,
-    .free = _free,
-    .default_config = NULL
+    .sample_batch = _zigzag_batch,
+    .free = _zigzag_free,
+    .default_config = NULL,
+    .linear = 1
   };
 
   sampler_info raster = {
     .name = "raster",
     .init = _init,
     .sample = _raster_sample,
+    .sample_batch = _raster_batch,
     .free = _free,
-    .default_config = NULL
+    .default_config = NULL,
+    .linear = 1
   };
 
   sampler_info weave = {
     .name = "weave",
     .init = _init,
     .sample = _weave_sample,
+    .sample_batch = _weave_batch,
     .free = _free,
-    .default_config = NULL
+    .default_config = NULL,
+    .linear = 1
   };
 
   sampler_register(&zigzag);